@@ -0,0 +1,172 @@
+#pragma once
+#include "executor.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Runs an ExecutionPlan one request at a time on the calling thread, without
+// blocking it on asynchronous kernels.
+//
+// Synchronous kernels run inline. An async kernel is started and its node
+// suspended; whichever thread finishes the call (e.g. a service's completion
+// thread) hands the node back, and the executor then schedules its
+// successors. Any number of async calls of one request can be in flight at
+// once, so a request waiting on several remote services takes about as long
+// as the slowest of them. Kernels see the request's RequestArena until they
+// first suspend; after that they run on the completing thread, which
+// allocates from its own current resource. The same goes for the
+// CancellationToken of a run.
+class AsyncExecutor : public ExecutorBase {
+public:
+  explicit AsyncExecutor(std::shared_ptr<const ExecutionPlan> plan)
+      : ExecutorBase(std::move(plan)), calls_(plan_->instructions().size()) {
+    for (uint32_t i = 0; i < calls_.size(); i++) {
+      calls_[i].executor = this;
+      calls_[i].instr = i;
+    }
+  }
+
+  AsyncExecutor(const Graph& graph, const KernelRegistry& kernels)
+      : AsyncExecutor(ExecutionPlan::compile(graph, kernels)) {}
+
+  AsyncExecutor(const AsyncExecutor&) = delete;
+  AsyncExecutor& operator=(const AsyncExecutor&) = delete;
+
+  // Returns once every instruction has run. If a kernel throws, no new
+  // instructions are started; the calls in flight are waited for and the
+  // first exception is rethrown.
+  void run() {
+    run(nullptr);
+  }
+
+  // As run(), but no instruction is started once `token` is cancelled. The
+  // calls in flight are still waited for, as their kernels own the slots
+  // they write; a cancelled run then throws CancelledError.
+  void run(const CancellationToken& token) {
+    run(&token);
+  }
+
+private:
+  void run(const CancellationToken* token) {
+    check_inputs();
+    ExecutionState& state = *state_;
+    state.clear_results();
+    RequestArena::Scope arena(state.arena());
+    CancellationToken::Scope cancellation(token);
+    const ExecutionPlan& plan = *plan_;
+    const auto& instructions = plan.instructions();
+    std::vector<uint32_t>& pending = state.pending();
+    for (size_t i = 0; i < instructions.size(); i++) {
+      pending[i] = instructions[i].dependencies;
+    }
+    Span<const uint32_t> roots = plan.roots();
+    ready_.assign(roots.begin(), roots.end());
+    size_t in_flight = 0;
+    size_t started = 0;
+    bool cancelled = false;
+    std::exception_ptr error;
+
+    while (!ready_.empty() || in_flight) {
+      if (ready_.empty()) {
+        wait_for_completions();
+      }
+      while (!ready_.empty()) {
+        uint32_t next = ready_.back();
+        ready_.pop_back();
+        if (error || cancelled) {
+          continue;
+        }
+        if (token && token->cancelled()) {
+          cancelled = true;
+          continue;
+        }
+        const auto& instr = instructions[next];
+        state.ran(next);
+        started++;
+        if (instr.kernel->async()) {
+          Call& call = calls_[next];
+          call.pending =
+              instr.kernel->start(state.slots(), plan.inputs(instr),
+                                  plan.outputs(instr), plan.movable(next));
+          in_flight++;
+          call.pending->start(&Call::finished, &call);
+          continue;
+        }
+        try {
+          (*instr.kernel)(state.slots(), plan.inputs(instr),
+                          plan.outputs(instr), plan.movable(next));
+          complete(instr);
+        } catch (...) {
+          error = std::current_exception();
+        }
+      }
+      // Async calls that finished since the last look
+      std::vector<uint32_t> finished;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished.swap(finished_);
+      }
+      for (uint32_t instr : finished) {
+        in_flight--;
+        Call& call = calls_[instr];
+        try {
+          call.pending->result();
+          complete(instructions[instr]);
+        } catch (...) {
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+        call.pending.reset();
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    finish_run(started, token);
+  }
+
+  // An async kernel call in flight, and what its completion callback needs.
+  struct Call {
+    AsyncExecutor* executor;
+    uint32_t instr;
+    std::optional<Async<>> pending;
+
+    // On the thread that finished the call.
+    static void finished(void* context) {
+      auto* call = static_cast<Call*>(context);
+      AsyncExecutor& executor = *call->executor;
+      std::lock_guard<std::mutex> lock(executor.mutex_);
+      executor.finished_.push_back(call->instr);
+      executor.wakeup_.notify_one();
+    }
+  };
+
+  // Indexed by instruction
+  std::vector<Call> calls_;
+  std::vector<uint32_t> ready_;
+
+  // Async calls finished, pushed from any thread
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::vector<uint32_t> finished_;
+
+  void wait_for_completions() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wakeup_.wait(lock, [this] { return !finished_.empty(); });
+  }
+
+  void complete(const ExecutionPlan::Instruction& instr) {
+    std::vector<uint32_t>& pending = state_->pending();
+    for (uint32_t successor : plan_->successors(instr)) {
+      if (--pending[successor] == 0) {
+        ready_.push_back(successor);
+      }
+    }
+  }
+};
@@ -0,0 +1,241 @@
+#include "async_executor.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+// A local stand-in for a remote service: every lookup completes on the
+// service's timer thread once its delay has passed.
+class FakeService {
+public:
+  explicit FakeService(Clock::duration delay)
+      : delay_(delay), timer_([this] { loop(); }) {}
+
+  ~FakeService() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    timer_.join();
+  }
+
+  struct Lookup {
+    FakeService& service;
+    int32_t key;
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+      service.schedule(handle);
+    }
+
+    // Keys below zero are unknown to the service
+    std::string await_resume() const {
+      if (key < 0) {
+        throw std::runtime_error("unknown key");
+      }
+      return "value_" + std::to_string(key);
+    }
+  };
+
+  Lookup lookup(int32_t key) {
+    return Lookup{*this, key};
+  }
+
+  size_t max_in_flight() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return max_in_flight_;
+  }
+
+private:
+  Clock::duration delay_;
+  mutable std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::multimap<Clock::time_point, std::coroutine_handle<>> timers_;
+  size_t max_in_flight_ = 0;
+  bool stopping_ = false;
+  std::thread timer_;
+
+  void schedule(std::coroutine_handle<> handle) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      timers_.emplace(Clock::now() + delay_, handle);
+      max_in_flight_ = std::max(max_in_flight_, timers_.size());
+    }
+    wakeup_.notify_one();
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      if (timers_.empty()) {
+        wakeup_.wait(lock);
+        continue;
+      }
+      auto first = timers_.begin();
+      if (Clock::now() < first->first) {
+        wakeup_.wait_until(lock, first->first);
+        continue;
+      }
+      std::coroutine_handle<> handle = first->second;
+      timers_.erase(first);
+      lock.unlock();
+      handle.resume();
+      lock.lock();
+    }
+  }
+};
+
+}  // namespace
+
+TEST(AsyncExecutorTest, LookupsOverlap) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // Eight independent lookups, joined into one string
+  constexpr int kLookups = 8;
+  Op<std::string(int32_t)> lookup_op("lookup_op");
+  Op<std::string(Variadic<std::string>)> join_op("join_op");
+  std::vector<Var<int32_t>> keys;
+  std::vector<Var<std::string>> values;
+  for (int i = 0; i < kLookups; i++) {
+    keys.emplace_back(placeholder, "key_" + std::to_string(i));
+    values.emplace_back("value_" + std::to_string(i));
+  }
+  for (int i = 0; i < kLookups; i++) {
+    values[i] = lookup_op(keys[i]);
+  }
+  Var<std::string> output("output");
+  output = join_op(values[0], values[1], values[2], values[3], values[4],
+                   values[5], values[6], values[7]);
+
+  constexpr auto kDelay = 100ms;
+  FakeService service(kDelay);
+  KernelRegistry kernels;
+  kernels.add(lookup_op, [&](int32_t key) -> Async<std::string> {
+    co_return co_await service.lookup(key);
+  });
+  kernels.add(join_op, [](VariadicArgs<std::string> parts) {
+    std::string result;
+    for (size_t i = 0; i < parts.size(); i++) {
+      result += parts[i] + ";";
+    }
+    return result;
+  });
+
+  AsyncExecutor exec(prog.graph(), kernels);
+  for (int i = 0; i < kLookups; i++) {
+    exec.feed(keys[i], i);
+  }
+  auto start = Clock::now();
+  exec.run();
+  auto elapsed = Clock::now() - start;
+
+  EXPECT_EQ(exec.fetch(values[3]), "value_3");
+  EXPECT_EQ(exec.fetch(output),
+            "value_0;value_1;value_2;value_3;value_4;value_5;value_6;"
+            "value_7;");
+  // All lookups wait at the same time, instead of one after another
+  EXPECT_EQ(service.max_in_flight(), kLookups);
+  EXPECT_LT(elapsed, kDelay * kLookups / 2);
+}
+
+TEST(AsyncExecutorTest, ChainsAndErrors) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // key -> lookup -> length -> lookup
+  Op<std::string(int32_t)> lookup_op("lookup_op");
+  Op<int32_t(std::string)> length_op("length_op");
+  Var<int32_t> key(placeholder, "key");
+  Var<std::string> first("first"), second("second");
+  Var<int32_t> length("length");
+  first = lookup_op(key);
+  length = length_op(first);
+  second = lookup_op(length);
+
+  FakeService service(1ms);
+  KernelRegistry kernels;
+  kernels.add(lookup_op, [&](int32_t k) -> Async<std::string> {
+    std::string value = co_await service.lookup(k);
+    co_return value + "!";
+  });
+  kernels.add(length_op, [](const std::string& s) {
+    return static_cast<int32_t>(s.size());
+  });
+
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+  AsyncExecutor exec(plan);
+  exec.feed(key, 42);
+  exec.run();
+  EXPECT_EQ(exec.fetch(first), "value_42!");
+  EXPECT_EQ(exec.fetch(length), 9);
+  EXPECT_EQ(exec.fetch(second), "value_9!");
+
+  // an exception thrown while suspended surfaces from run()
+  exec.feed(key, -1);
+  EXPECT_THROW(exec.run(), std::runtime_error);
+  exec.feed(key, 7);
+  exec.run();
+  EXPECT_EQ(exec.fetch(second), "value_8!");
+
+  // other executors block on async kernels instead
+  SequentialExecutor sequential(plan);
+  sequential.feed(key, 42);
+  sequential.run();
+  EXPECT_EQ(sequential.fetch(second), "value_9!");
+}
+
+TEST(AsyncExecutorTest, DeadlineStopsNewCalls) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // key -> lookup -> length -> lookup -> length -> lookup
+  Op<std::string(int32_t)> lookup_op("lookup_op");
+  Op<int32_t(std::string)> length_op("length_op");
+  Var<int32_t> key(placeholder, "key");
+  Var<std::string> value("value");
+  Var<int32_t> length("length");
+  value = lookup_op(key);
+  for (int i = 0; i < 2; i++) {
+    length = length_op(value);
+    value = lookup_op(length);
+  }
+
+  FakeService service(50ms);
+  KernelRegistry kernels;
+  kernels.add(lookup_op, [&](int32_t k) -> Async<std::string> {
+    co_return co_await service.lookup(k);
+  });
+  kernels.add(length_op, [](const std::string& s) {
+    return static_cast<int32_t>(s.size());
+  });
+
+  // The deadline passes during the first lookup, which is still waited for
+  AsyncExecutor exec(prog.graph(), kernels);
+  exec.feed(key, 1);
+  CancellationToken token(Clock::now() + 10ms);
+  EXPECT_THROW(exec.run(token), CancelledError);
+  EXPECT_EQ(exec.run_stats().nodes_run, 1);
+  EXPECT_EQ(exec.run_stats().nodes_skipped, 4);
+
+  CancellationToken later(Clock::now() + 1h);
+  exec.run(later);
+  EXPECT_EQ(exec.fetch(value), "value_7");
+  EXPECT_EQ(exec.run_stats().nodes_run, 5);
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include "executor.h"
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Runs an ExecutionPlan over many rows at once, e.g. for offline scoring.
+// Every graph input is fed a column of N values, and every variable then
+// holds a Batch of N values: row i of the results is what a run over row i
+// of the inputs would give.
+//
+// Each node is dispatched once per batch rather than once per row. A
+// vectorized kernel (see Batch) is called once with whole columns; any other
+// is called once per row, its arguments copied out of their columns, or
+// moved when the plan allows it.
+//
+//   BatchExecutor exec(plan);
+//   exec.feed(x, Batch<float>(xs.begin(), xs.end()));
+//   exec.run();
+//   const Batch<float>& ys = exec.fetch(y);
+class BatchExecutor : public ExecutorBase {
+public:
+  explicit BatchExecutor(std::shared_ptr<const ExecutionPlan> plan)
+      : ExecutorBase(std::move(plan)), rows_(plan_->slot_count()) {}
+
+  BatchExecutor(const Graph& graph, const KernelRegistry& kernels)
+      : BatchExecutor(ExecutionPlan::compile(graph, kernels)) {}
+
+  // Sets the column of a graph input, for this and all later runs. Every
+  // input needs as many rows.
+  template <typename T>
+  void feed(const Var<T>& var, Batch<T> column) {
+    ValueId slot = plan_->input_slot(var.symbol());
+    if (slot == kNoValue) {
+      throw std::runtime_error(
+          "Not a graph input: " +
+          std::string(plan_->graph().symbols().name(var.symbol())));
+    }
+    rows_[slot] = column.size();
+    state_->feed<Batch<T>>(slot, std::move(column));
+  }
+
+  // The column of the last value `var` was assigned in the graph.
+  template <typename T>
+  const Batch<T>& fetch(const Var<T>& var) const {
+    ValueId slot = plan_->output_slot(var.symbol());
+    if (slot == kNoValue || !state_->slot(slot).has_value()) {
+      throw std::runtime_error(
+          "No value for: " +
+          std::string(plan_->graph().symbols().name(var.symbol())));
+    }
+    return state_->slot(slot).get<Batch<T>>();
+  }
+
+  // Rows of the last run.
+  size_t rows() const {
+    return num_rows_;
+  }
+
+  void run() {
+    check_inputs();
+    num_rows_ = check_rows();
+    ExecutionState& state = *state_;
+    state.clear_results();
+    RequestArena::Scope arena(state.arena());
+    Value* slots = state.slots();
+    const ExecutionPlan& plan = *plan_;
+    const auto& instructions = plan.instructions();
+    for (uint32_t i = 0; i < instructions.size(); i++) {
+      const auto& instr = instructions[i];
+      state.ran(i);
+      instr.kernel->run_batch(slots, plan.inputs(instr), plan.outputs(instr),
+                              plan.movable(i), num_rows_);
+    }
+    finish_run(instructions.size(), nullptr);
+  }
+
+private:
+  // Indexed by slot: rows of the column fed there
+  std::vector<size_t> rows_;
+  size_t num_rows_ = 0;
+
+  size_t check_rows() const {
+    Span<const ValueId> inputs = plan_->input_slots();
+    if (inputs.empty()) {
+      return 0;
+    }
+    size_t rows = rows_[inputs[0]];
+    for (ValueId slot : inputs) {
+      if (rows_[slot] != rows) {
+        throw std::runtime_error(
+            "Column " + std::string(plan_->slot_name(slot)) + " has " +
+            std::to_string(rows_[slot]) + " rows, " +
+            std::string(plan_->slot_name(inputs[0])) + " has " +
+            std::to_string(rows));
+      }
+    }
+    return rows;
+  }
+};
@@ -0,0 +1,185 @@
+#include "batch_executor.h"
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// A kernel with a vectorized overload, counting its calls of each kind
+struct Scale {
+  int* row_calls;
+  int* column_calls;
+
+  int32_t operator()(int32_t x) const {
+    ++*row_calls;
+    return x * 3;
+  }
+
+  Batch<int32_t> operator()(const Batch<int32_t>& xs) const {
+    ++*column_calls;
+    Batch<int32_t> result(xs.size());
+    for (size_t i = 0; i < xs.size(); i++) {
+      result[i] = xs[i] * 3;
+    }
+    return result;
+  }
+};
+
+}  // namespace
+
+TEST(BatchExecutorTest, MatchesRowByRowRuns) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // x, name -> scaled = scale(x); (half, rest) = split(scaled);
+  //   total = sum(x, half, rest); label = tag(name, total)
+  Op<int32_t(int32_t)> scale("scale");
+  Op<std::tuple<int32_t, int32_t>(int32_t)> split("split");
+  Op<int32_t(Variadic<int32_t>)> sum("sum");
+  Op<std::string(std::string, int32_t)> tag("tag");
+  Var<int32_t> x(placeholder, "x");
+  Var<std::string> name(placeholder, "name");
+  Var<int32_t> scaled("scaled"), half("half"), rest("rest"), total("total");
+  Var<std::string> label("label");
+  scaled = scale(x);
+  (half, rest) = split(scaled);
+  total = sum(x, half, rest);
+  label = tag(name, total);
+
+  int row_calls = 0, column_calls = 0, split_calls = 0;
+  KernelRegistry kernels;
+  kernels.add(scale, Scale{&row_calls, &column_calls});
+  kernels.add(split, [&](int32_t v) {
+    split_calls++;
+    return std::make_tuple(v / 2, v - v / 2);
+  });
+  kernels.add(sum, [](VariadicArgs<int32_t> values) {
+    int32_t result = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+      result += values[i];
+    }
+    return result;
+  });
+  kernels.add(tag, [](In<std::string> n, int32_t t) {
+    std::string result = n.take();
+    return result + "=" + std::to_string(t);
+  });
+  EXPECT_TRUE(kernels.kernel(kernels.find("scale"))->vectorized());
+  EXPECT_FALSE(kernels.kernel(kernels.find("split"))->vectorized());
+
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+  const std::vector<int32_t> xs = {0, 1, 2, 7, -5};
+  const std::vector<std::string> names = {"a", "b", "c", "d", "e"};
+
+  BatchExecutor batch(plan);
+  batch.feed(x, Batch<int32_t>(xs));
+  batch.feed(name, Batch<std::string>(names));
+  batch.run();
+  EXPECT_EQ(batch.rows(), xs.size());
+  EXPECT_EQ(column_calls, 1);
+  EXPECT_EQ(row_calls, 0);
+  EXPECT_EQ(split_calls, static_cast<int>(xs.size()));
+
+  SequentialExecutor sequential(plan);
+  for (size_t i = 0; i < xs.size(); i++) {
+    sequential.feed(x, xs[i]);
+    sequential.feed(name, names[i]);
+    sequential.run();
+    EXPECT_EQ(batch.fetch(scaled)[i], sequential.fetch(scaled));
+    EXPECT_EQ(batch.fetch(half)[i], sequential.fetch(half));
+    EXPECT_EQ(batch.fetch(total)[i], sequential.fetch(total));
+    EXPECT_EQ(batch.fetch(label)[i], sequential.fetch(label));
+  }
+  EXPECT_EQ(row_calls, static_cast<int>(xs.size()));
+  EXPECT_EQ(batch.fetch(label)[3], "d=28");
+  // fed columns are left alone
+  EXPECT_EQ(batch.fetch(name)[0], "a");
+}
+
+TEST(BatchExecutorTest, Errors) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Op<int32_t(int32_t)> shrink("shrink");
+  Var<int32_t> a(placeholder, "a"), b(placeholder, "b");
+  Var<int32_t> c("c"), d("d");
+  c = add(a, b);
+  d = shrink(c);
+
+  struct Shrink {
+    int32_t operator()(int32_t x) const {
+      return x;
+    }
+    // drops the last row
+    Batch<int32_t> operator()(const Batch<int32_t>& xs) const {
+      return Batch<int32_t>(xs.begin(), xs.end() - 1);
+    }
+  };
+  KernelRegistry kernels;
+  kernels.add(add, [](int32_t x, int32_t y) { return x + y; });
+  kernels.add(shrink, Shrink());
+
+  BatchExecutor exec(prog.graph(), kernels);
+  exec.feed(a, Batch<int32_t>{1, 2, 3});
+  exec.feed(b, Batch<int32_t>{1, 2});
+  try {
+    exec.run();
+    FAIL() << "columns of different lengths ran";
+  } catch (const std::runtime_error& e) {
+    EXPECT_STREQ(e.what(), "Column b has 2 rows, a has 3");
+  }
+
+  exec.feed(b, Batch<int32_t>{10, 20, 30});
+  try {
+    exec.run();
+    FAIL() << "a short column was accepted";
+  } catch (const std::runtime_error& e) {
+    EXPECT_STREQ(e.what(), "Vectorized kernel returned 2 rows, expected 3");
+  }
+  EXPECT_EQ(exec.fetch(c), Batch<int32_t>({11, 22, 33}));
+  EXPECT_THROW(exec.fetch(d), std::runtime_error);
+}
+
+TEST(BatchExecutorTest, ManyVariadicInputs) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // More movable inputs than the plan has bits for:
+  //   d_i = twice(x_i); total = sum(d_0, ..., d_69)
+  constexpr size_t kInputs = 70;
+  Op<int32_t(int32_t)> twice("twice");
+  Op<int32_t(Variadic<int32_t>)> sum("sum");
+  std::vector<Var<int32_t>> xs, doubled;
+  for (size_t i = 0; i < kInputs; i++) {
+    xs.emplace_back(placeholder, "x_" + std::to_string(i));
+    doubled.emplace_back();
+    doubled[i] = twice(xs[i]);
+  }
+  Var<int32_t> total("total");
+  total = [&]<size_t... I>(std::index_sequence<I...>) {
+    return sum(doubled[I]...);
+  }(std::make_index_sequence<kInputs>());
+
+  KernelRegistry kernels;
+  kernels.add(twice, [](int32_t x) { return 2 * x; });
+  kernels.add(sum, [](VariadicArgs<int32_t> values) {
+    int32_t result = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+      result += values[i];
+    }
+    return result;
+  });
+
+  BatchExecutor exec(prog.graph(), kernels);
+  for (size_t i = 0; i < kInputs; i++) {
+    int32_t x = static_cast<int32_t>(i);
+    exec.feed(xs[i], Batch<int32_t>{x, -x, 1});
+  }
+  exec.run();
+  // twice(0 + ... + 69), its negation, and 70 twos
+  EXPECT_EQ(exec.fetch(total), Batch<int32_t>({4830, -4830, 140}));
+}
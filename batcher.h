@@ -0,0 +1,235 @@
+#pragma once
+#include "kernel.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// When a Batcher flushes the invocations it has gathered.
+struct BatchOptions {
+  // A batch this large is run at once, by the request that filled it
+  size_t max_batch_size = 32;
+  // A smaller batch is run once its oldest invocation has waited this long
+  std::chrono::steady_clock::duration window = std::chrono::microseconds(500);
+};
+
+template <typename Signature>
+class Batcher;
+
+// Gathers invocations of one op, from any number of concurrent requests,
+// and runs them through a batch kernel together. An invocation is an
+// Async<R> that completes once its batch has run, so AsyncExecutor keeps
+// going meanwhile, and other executors block until the batch is flushed.
+//
+// The batch kernel takes one row per invocation, the argument itself for a
+// single-argument op and a std::tuple of the arguments otherwise, and
+// returns one result per row, in order. If it throws, every invocation of
+// the batch fails with its exception.
+template <typename R, typename... Args>
+class Batcher<R(Args...)> {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Row = std::conditional_t<sizeof...(Args) == 1,
+                                 std::tuple_element_t<0, std::tuple<Args...>>,
+                                 std::tuple<Args...>>;
+  using BatchKernel = std::function<std::vector<R>(const std::vector<Row>&)>;
+
+  Batcher(BatchKernel kernel, BatchOptions options)
+      : kernel_(std::move(kernel)), options_(options),
+        timer_([this] { timer_loop(); }) {}
+
+  // Runs what is still queued before returning.
+  ~Batcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    timer_.join();
+  }
+
+  Batcher(const Batcher&) = delete;
+  Batcher& operator=(const Batcher&) = delete;
+
+  Async<R> submit(Args... args) {
+    co_return co_await Enqueue{*this, Row(std::move(args)...)};
+  }
+
+  // Batches run, and invocations in them
+  size_t batches() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return batches_;
+  }
+
+  size_t rows() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return rows_;
+  }
+
+private:
+  // One invocation waiting in the queue. Lives in the suspended coroutine.
+  struct Enqueue {
+    Batcher& batcher;
+    Row row;
+    std::coroutine_handle<> handle;
+    std::optional<R> result;
+    std::exception_ptr error;
+
+    Enqueue(Batcher& batcher, Row row)
+        : batcher(batcher), row(std::move(row)) {}
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    // The invocation that fills a batch runs it, and then does not suspend.
+    bool await_suspend(std::coroutine_handle<> self) {
+      handle = self;
+      std::vector<Enqueue*> batch = batcher.enqueue(this);
+      if (batch.empty()) {
+        return true;
+      }
+      batcher.run_batch(batch, this);
+      return false;
+    }
+
+    R await_resume() {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      return std::move(*result);
+    }
+  };
+
+  BatchKernel kernel_;
+  BatchOptions options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::vector<Enqueue*> queue_;
+  // When the oldest invocation in `queue_` arrived
+  Clock::time_point oldest_;
+  size_t batches_ = 0;
+  size_t rows_ = 0;
+  bool stopping_ = false;
+  std::thread timer_;
+
+  // Queues `invocation`, and returns the queue if that filled a batch.
+  std::vector<Enqueue*> enqueue(Enqueue* invocation) {
+    std::vector<Enqueue*> batch;
+    bool first = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.empty()) {
+        oldest_ = Clock::now();
+        first = true;
+      }
+      queue_.push_back(invocation);
+      if (queue_.size() >= options_.max_batch_size) {
+        batch = take_batch();
+        first = false;
+      }
+    }
+    if (first) {
+      wakeup_.notify_one();
+    }
+    return batch;
+  }
+
+  // Under `mutex_`.
+  std::vector<Enqueue*> take_batch() {
+    std::vector<Enqueue*> batch;
+    batch.swap(queue_);
+    batches_++;
+    rows_ += batch.size();
+    return batch;
+  }
+
+  // Flushes batches whose window has passed.
+  void timer_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (queue_.empty()) {
+        if (stopping_) {
+          return;
+        }
+        wakeup_.wait(lock);
+        continue;
+      }
+      Clock::time_point due = oldest_ + options_.window;
+      if (!stopping_ && Clock::now() < due) {
+        wakeup_.wait_until(lock, due);
+        continue;
+      }
+      std::vector<Enqueue*> batch = take_batch();
+      lock.unlock();
+      run_batch(batch, nullptr);
+      lock.lock();
+    }
+  }
+
+  // Runs the batch kernel and resumes every invocation but `self`, which is
+  // running this.
+  void run_batch(const std::vector<Enqueue*>& batch, Enqueue* self) {
+    std::vector<Row> rows;
+    rows.reserve(batch.size());
+    for (Enqueue* invocation : batch) {
+      rows.push_back(std::move(invocation->row));
+    }
+    try {
+      std::vector<R> results = kernel_(rows);
+      if (results.size() != batch.size()) {
+        throw std::runtime_error(
+            "Batch kernel returned " + std::to_string(results.size()) +
+            " results for " + std::to_string(batch.size()) + " rows");
+      }
+      for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->result.emplace(std::move(results[i]));
+      }
+    } catch (...) {
+      for (Enqueue* invocation : batch) {
+        invocation->error = std::current_exception();
+      }
+    }
+    // A resumed invocation may finish and free itself: read nothing after
+    for (Enqueue* invocation : batch) {
+      if (invocation != self) {
+        invocation->handle.resume();
+      }
+    }
+  }
+};
+
+// Registers `batch_kernel` as the kernel of `op`: each invocation waits in
+// a Batcher for others, from this or concurrent requests, and the batch
+// runs together. Returns the Batcher, which the registry keeps alive.
+//
+//   add_batch_kernel(kernels, predict_op,
+//                    [](const std::vector<Features>& rows) {
+//                      return model.predict(rows);  // one score per row
+//                    },
+//                    {.max_batch_size = 64, .window = 200us});
+template <typename R, typename... Args, typename F>
+std::shared_ptr<Batcher<R(Args...)>>
+add_batch_kernel(KernelRegistry& kernels, const Op<R(Args...)>& op,
+                 F batch_kernel, BatchOptions options = {}) {
+  auto batcher = std::make_shared<Batcher<R(Args...)>>(
+      std::move(batch_kernel), options);
+  kernels.add(op, [batcher](In<Args>... args) {
+    return batcher->submit(args.take()...);
+  });
+  return batcher;
+}
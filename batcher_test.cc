@@ -0,0 +1,194 @@
+#include "batcher.h"
+#include "async_executor.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+TEST(BatcherTest, ConcurrentRequestsShareABatch) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> predict_op("predict_op");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> score("score");
+  score = predict_op(input);
+
+  // Only a full batch can run: the window is far away
+  constexpr int kRequests = 4;
+  std::vector<size_t> batch_sizes;
+  KernelRegistry kernels;
+  auto batcher = add_batch_kernel(
+      kernels, predict_op,
+      [&](const std::vector<int32_t>& rows) {
+        batch_sizes.push_back(rows.size());
+        std::vector<int32_t> scores;
+        for (int32_t row : rows) {
+          scores.push_back(row * 10);
+        }
+        return scores;
+      },
+      {.max_batch_size = kRequests, .window = 1h});
+
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+  std::vector<int32_t> scores(kRequests);
+  std::vector<std::thread> requests;
+  for (int i = 0; i < kRequests; i++) {
+    requests.emplace_back([&, i] {
+      SequentialExecutor exec(plan);
+      exec.feed(input, i);
+      exec.run();
+      scores[i] = exec.fetch(score);
+    });
+  }
+  for (auto& request : requests) {
+    request.join();
+  }
+
+  EXPECT_EQ(scores, std::vector<int32_t>({0, 10, 20, 30}));
+  EXPECT_EQ(batch_sizes, std::vector<size_t>({kRequests}));
+  EXPECT_EQ(batcher->batches(), 1);
+  EXPECT_EQ(batcher->rows(), kRequests);
+}
+
+TEST(BatcherTest, WindowFlushesPartialBatches) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<std::string(std::string, int32_t)> repeat_op("repeat_op");
+  Var<std::string> word(placeholder, "word");
+  Var<int32_t> times(placeholder, "times");
+  Var<std::string> output("output");
+  output = repeat_op(word, times);
+
+  constexpr auto kWindow = 5ms;
+  KernelRegistry kernels;
+  auto batcher = add_batch_kernel(
+      kernels, repeat_op,
+      [](const std::vector<std::tuple<std::string, int32_t>>& rows) {
+        std::vector<std::string> results;
+        for (const auto& [w, n] : rows) {
+          std::string repeated;
+          for (int32_t i = 0; i < n; i++) {
+            repeated += w;
+          }
+          results.push_back(repeated);
+        }
+        return results;
+      },
+      {.max_batch_size = 64, .window = kWindow});
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  exec.feed(word, std::string("ab"));
+  exec.feed(times, 3);
+  auto start = Clock::now();
+  exec.run();
+  EXPECT_GE(Clock::now() - start, kWindow);
+  EXPECT_EQ(exec.fetch(output), "ababab");
+  EXPECT_EQ(batcher->batches(), 1);
+  EXPECT_EQ(batcher->rows(), 1);
+}
+
+TEST(BatcherTest, AsyncExecutorBatchesWithinARequest) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // Three independent predictions of one request, then their sum
+  Op<int32_t(int32_t)> predict_op("predict_op");
+  Op<int32_t(Variadic<int32_t>)> sum_op("sum_op");
+  Var<int32_t> a(placeholder, "a"), b(placeholder, "b"), c(placeholder, "c");
+  Var<int32_t> pa("pa"), pb("pb"), pc("pc"), total("total");
+  pa = predict_op(a);
+  pb = predict_op(b);
+  pc = predict_op(c);
+  total = sum_op(pa, pb, pc);
+
+  KernelRegistry kernels;
+  auto batcher = add_batch_kernel(
+      kernels, predict_op,
+      [](const std::vector<int32_t>& rows) {
+        std::vector<int32_t> scores;
+        for (int32_t row : rows) {
+          scores.push_back(row + 1);
+        }
+        return scores;
+      },
+      {.max_batch_size = 8, .window = 1ms});
+  kernels.add(sum_op, [](VariadicArgs<int32_t> values) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+      sum += values[i];
+    }
+    return sum;
+  });
+
+  AsyncExecutor exec(prog.graph(), kernels);
+  exec.feed(a, 1);
+  exec.feed(b, 2);
+  exec.feed(c, 3);
+  exec.run();
+  EXPECT_EQ(exec.fetch(total), 9);
+  EXPECT_EQ(batcher->batches(), 1);
+  EXPECT_EQ(batcher->rows(), 3);
+}
+
+TEST(BatcherTest, ErrorsReachEveryRequestOfTheBatch) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> predict_op("predict_op");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> score("score");
+  score = predict_op(input);
+
+  // A negative row fails the whole batch; an empty one breaks the kernel
+  KernelRegistry kernels;
+  add_batch_kernel(
+      kernels, predict_op,
+      [](const std::vector<int32_t>& rows) {
+        std::vector<int32_t> scores;
+        for (int32_t row : rows) {
+          if (row < 0) {
+            throw std::runtime_error("negative");
+          }
+          if (row > 0) {
+            scores.push_back(row);
+          }
+        }
+        return scores;
+      },
+      {.max_batch_size = 2, .window = 1h});
+
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+  auto run_pair = [&](int32_t x, int32_t y) {
+    std::vector<std::string> errors(2);
+    std::vector<std::thread> requests;
+    for (int i = 0; i < 2; i++) {
+      requests.emplace_back([&, i] {
+        SequentialExecutor exec(plan);
+        exec.feed(input, i ? y : x);
+        try {
+          exec.run();
+        } catch (const std::runtime_error& e) {
+          errors[i] = e.what();
+        }
+      });
+    }
+    for (auto& request : requests) {
+      request.join();
+    }
+    return errors;
+  };
+
+  EXPECT_EQ(run_pair(1, -1), std::vector<std::string>(2, "negative"));
+  EXPECT_EQ(run_pair(1, 0),
+            std::vector<std::string>(
+                2, "Batch kernel returned 1 results for 2 rows"));
+  EXPECT_EQ(run_pair(1, 2), std::vector<std::string>(2, ""));
+}
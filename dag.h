@@ -1,11 +1,22 @@
 #pragma once
 #include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <limits>
+#include <memory_resource>
 #include <memory>
+#include <span>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -23,215 +34,1597 @@ class Graph;
 class IR;
 class Program;
 
+// Interned name. Symbols are dense per SymbolTable, starting at 0.
+using Symbol = uint32_t;
+constexpr Symbol kNoSymbol = std::numeric_limits<Symbol>::max();
+
+// Non-owning view over contiguous elements.
+template <typename T>
+using Span = std::span<T>;
+
+// Monotonic bump allocator. Memory is never freed piecemeal; everything
+// allocated from an arena is released at once when the arena is destroyed,
+// so only trivially destructible objects may live in it.
+class Arena {
+  std::pmr::monotonic_buffer_resource resource_;
+
+public:
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  template <typename T>
+  Span<T> allocate(size_t count) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "Arena memory is released without running destructors");
+    if (count == 0) {
+      return {};
+    }
+    void* p = resource_.allocate(count * sizeof(T), alignof(T));
+    return {static_cast<T*>(p), count};
+  }
+
+  template <typename T>
+  Span<T> copy(Span<const T> items) {
+    Span<T> result = allocate<T>(items.size());
+    std::copy(items.begin(), items.end(), result.begin());
+    return result;
+  }
+
+  template <typename T>
+  Span<T> copy(std::initializer_list<T> items) {
+    return copy(Span<const T>(items.begin(), items.size()));
+  }
+
+  std::string_view copy(std::string_view text) {
+    Span<char> chars = copy(Span<const char>(text.data(), text.size()));
+    return {chars.data(), chars.size()};
+  }
+
+  std::pmr::memory_resource* resource() {
+    return &resource_;
+  }
+};
+
+// Interns variable and op names so the IR and the Graph can store and compare
+// 32-bit ids instead of strings. Text is only needed again on export.
+//
+// Name text lives in the table's arena and the index is open-addressed, so
+// interning a new name costs no allocation beyond amortized table growth.
+class SymbolTable {
+  Arena text_;
+  std::vector<std::string_view> names_;
+  std::vector<uint32_t> hashes_;
+  std::vector<bool> anonymous_;
+  std::vector<bool> generated_;
+  // Whether the symbol can be found by its text.
+  std::vector<bool> indexed_;
+  // Power-of-two sized, linear probing, at most half full.
+  std::vector<Symbol> slots_;
+  size_t indexed_count_ = 0;
+  size_t anonymous_count_ = 0;
+
+public:
+  SymbolTable() = default;
+  SymbolTable(const SymbolTable&) = delete;
+  SymbolTable& operator=(const SymbolTable&) = delete;
+
+  Symbol intern(std::string_view text) {
+    if ((indexed_count_ + 1) * 2 > slots_.size()) {
+      rehash(slots_.empty() ? 64 : slots_.size() * 2);
+    }
+    uint32_t hash = hash_of(text);
+    size_t slot = probe(text, hash);
+    if (slots_[slot] != kNoSymbol) {
+      return slots_[slot];
+    }
+    Symbol sym = push(text_.copy(text), hash, true);
+    slots_[slot] = sym;
+    indexed_count_++;
+    return sym;
+  }
+
+  // Returns kNoSymbol if `text` was never interned.
+  Symbol find(std::string_view text) const {
+    return slots_.empty() ? kNoSymbol : slots_[probe(text, hash_of(text))];
+  }
+
+  // A fresh symbol for an unnamed variable. It is never returned by find(),
+  // so two unnamed variables can not alias each other.
+  Symbol make_anonymous() {
+    char buffer[32] = "__var_";
+    auto end = std::to_chars(buffer + 6, std::end(buffer), anonymous_count_++);
+    return push(text_.copy(std::string_view(buffer, end.ptr - buffer)), 0,
+                false);
+  }
+
+  std::string_view name(Symbol sym) const {
+    return names_[sym];
+  }
+
+  // Anonymous variables can not be observed from outside the program.
+  bool is_anonymous(Symbol sym) const {
+    return anonymous_[sym];
+  }
+
+  // Marks `sym` as a name the program made up for an op's result rather
+  // than one a Var was declared with.
+  void mark_generated(Symbol sym) {
+    generated_[sym] = true;
+  }
+
+  bool is_generated(Symbol sym) const {
+    return generated_[sym];
+  }
+
+  size_t size() const {
+    return names_.size();
+  }
+
+private:
+  static uint32_t hash_of(std::string_view text) {
+    return static_cast<uint32_t>(std::hash<std::string_view>()(text));
+  }
+
+  // The slot holding `text`, or the empty slot where it would go.
+  size_t probe(std::string_view text, uint32_t hash) const {
+    const size_t mask = slots_.size() - 1;
+    size_t slot = hash & mask;
+    while (slots_[slot] != kNoSymbol &&
+           (hashes_[slots_[slot]] != hash || names_[slots_[slot]] != text)) {
+      slot = (slot + 1) & mask;
+    }
+    return slot;
+  }
+
+  void rehash(size_t capacity) {
+    slots_.assign(capacity, kNoSymbol);
+    for (Symbol sym = 0; sym < names_.size(); sym++) {
+      if (indexed_[sym]) {
+        slots_[probe(names_[sym], hashes_[sym])] = sym;
+      }
+    }
+  }
+
+  Symbol push(std::string_view text, uint32_t hash, bool indexed) {
+    if (names_.size() >= kNoSymbol) {
+      throw std::runtime_error("Symbol table is full");
+    }
+    anonymous_.push_back(text.find("__var") != std::string_view::npos);
+    generated_.push_back(false);
+    indexed_.push_back(indexed);
+    names_.push_back(text);
+    hashes_.push_back(hash);
+    return static_cast<Symbol>(names_.size() - 1);
+  }
+};
+
+// Dense node index in a Graph.
+using NodeId = uint32_t;
+constexpr NodeId kNoNode = std::numeric_limits<NodeId>::max();
+
+// Dense value index in a FrozenGraph.
+using ValueId = uint32_t;
+constexpr ValueId kNoValue = std::numeric_limits<ValueId>::max();
+
+// Immutable, compressed-sparse-row form of a Graph for executors and analysis
+// passes. A value is one definition of a variable: either a graph input
+// (placeholder or free variable) or one output of a node. Nodes and values
+// use dense ids, and every adjacency list is a contiguous range of a flat
+// array, so walks over the graph touch memory sequentially.
+class FrozenGraph {
+  friend class Graph;
+
+  std::shared_ptr<SymbolTable> symbols_;
+
+  // per node
+  std::vector<Symbol> op_classes_;
+  std::vector<uint32_t> input_offsets_;
+  std::vector<ValueId> inputs_;
+  std::vector<uint32_t> output_offsets_;
+  std::vector<ValueId> outputs_;
+  std::vector<uint32_t> pred_offsets_;
+  std::vector<NodeId> preds_;
+  std::vector<uint32_t> succ_offsets_;
+  std::vector<NodeId> succs_;
+
+  // per value
+  std::vector<Symbol> value_symbols_;
+  std::vector<NodeId> producers_;
+  std::vector<bool> placeholders_;
+  std::vector<uint32_t> consumer_offsets_;
+  std::vector<NodeId> consumers_;
+  std::vector<ValueId> graph_inputs_;
+
+  // Indexed by Symbol: the last definition of each variable.
+  std::vector<ValueId> value_by_symbol_;
+
+  template <typename U>
+  static Span<const U> range(const std::vector<U>& items,
+                             const std::vector<uint32_t>& offsets, size_t i) {
+    return {items.data() + offsets[i], offsets[i + 1] - offsets[i]};
+  }
+
+public:
+  size_t node_count() const {
+    return op_classes_.size();
+  }
+
+  size_t value_count() const {
+    return value_symbols_.size();
+  }
+
+  size_t edge_count() const {
+    return preds_.size();
+  }
+
+  const SymbolTable& symbols() const {
+    return *symbols_;
+  }
+
+  Symbol op_class(NodeId node) const {
+    return op_classes_[node];
+  }
+
+  Span<const ValueId> inputs(NodeId node) const {
+    return range(inputs_, input_offsets_, node);
+  }
+
+  Span<const ValueId> outputs(NodeId node) const {
+    return range(outputs_, output_offsets_, node);
+  }
+
+  // Nodes reading a value this node produced, in program order.
+  Span<const NodeId> successors(NodeId node) const {
+    return range(succs_, succ_offsets_, node);
+  }
+
+  // Nodes producing a value this node reads.
+  Span<const NodeId> predecessors(NodeId node) const {
+    return range(preds_, pred_offsets_, node);
+  }
+
+  Symbol symbol(ValueId value) const {
+    return value_symbols_[value];
+  }
+
+  // kNoNode for graph inputs.
+  NodeId producer(ValueId value) const {
+    return producers_[value];
+  }
+
+  bool is_placeholder(ValueId value) const {
+    return placeholders_[value];
+  }
+
+  // Nodes reading this value, in program order, each listed once.
+  Span<const NodeId> consumers(ValueId value) const {
+    return range(consumers_, consumer_offsets_, value);
+  }
+
+  // Values read before being defined, i.e. what must be fed in.
+  Span<const ValueId> graph_inputs() const {
+    return graph_inputs_;
+  }
+
+  // The last definition of `var`, or kNoValue if the graph never touches it.
+  ValueId find_value(Symbol var) const {
+    return var < value_by_symbol_.size() ? value_by_symbol_[var] : kNoValue;
+  }
+
+  ValueId find_value(std::string_view var_name) const {
+    return find_value(symbols_->find(var_name));
+  }
+};
+
 // Graph representation
 class Graph {
-  struct NodeInfo {
-    std::string name;
-    std::string op_class;
-    std::vector<std::string> inputs;
-    std::vector<std::string> outputs;
-  };
-  std::vector<NodeInfo> nodes_;
-  std::unordered_set<std::string> placeholders_;
+  std::shared_ptr<SymbolTable> symbols_;
+  // Nodes are append-only, so they are stored as offset + flat arrays.
+  std::vector<Symbol> op_classes_;
+  std::vector<uint32_t> input_offsets_{0};
+  std::vector<Symbol> inputs_;
+  std::vector<uint32_t> output_offsets_{0};
+  std::vector<Symbol> outputs_;
+  std::unordered_set<Symbol> placeholders_;
+
+  // Built by finalize(); dropped when a node is added.
+  std::shared_ptr<const FrozenGraph> frozen_;
 
 public:
+  Graph() : symbols_(std::make_shared<SymbolTable>()) {}
+
+  explicit Graph(std::shared_ptr<SymbolTable> symbols)
+      : symbols_(std::move(symbols)) {}
+
+  void add_node(Symbol op_class, Span<const Symbol> inputs,
+                Span<const Symbol> outputs,
+                Span<const Symbol> placeholder_inputs = {}) {
+    if (op_classes_.size() >= kNoNode) {
+      throw std::runtime_error("Graph is full");
+    }
+    op_classes_.push_back(op_class);
+    inputs_.insert(inputs_.end(), inputs.begin(), inputs.end());
+    input_offsets_.push_back(static_cast<uint32_t>(inputs_.size()));
+    outputs_.insert(outputs_.end(), outputs.begin(), outputs.end());
+    output_offsets_.push_back(static_cast<uint32_t>(outputs_.size()));
+    placeholders_.insert(placeholder_inputs.begin(), placeholder_inputs.end());
+    frozen_.reset();
+  }
+
   void add_node(const std::string& op_class,
                 const std::vector<std::string>& inputs,
                 const std::vector<std::string>& outputs,
                 const std::vector<std::string>& placeholder_inputs = {}) {
-    std::string op_name = op_class + "_" + std::to_string(nodes_.size());
-    nodes_.push_back({op_name, op_class, inputs, outputs});
-    for (const auto& input : placeholder_inputs) {
-      placeholders_.insert(input);
-    }
+    add_node(symbols_->intern(op_class), intern_all(inputs),
+             intern_all(outputs), intern_all(placeholder_inputs));
+  }
+
+  void add_placeholder(Symbol var) {
+    placeholders_.insert(var);
+    frozen_.reset();
+  }
+
+  // Builds the frozen form that backs the producer/consumer and
+  // successor/predecessor queries. Adding a node afterwards drops it again.
+  void finalize() {
+    frozen_ = build_frozen();
+  }
+
+  bool finalized() const {
+    return frozen_ != nullptr;
+  }
+
+  // Returns the CSR form of this graph. It is shared with the graph when the
+  // graph is finalized and built on the spot otherwise.
+  std::shared_ptr<const FrozenGraph> freeze() const {
+    return frozen_ ? frozen_ : build_frozen();
+  }
+
+  const SymbolTable& symbols() const {
+    return *symbols_;
   }
 
   bool is_placeholder(const std::string& var_name) const {
-    return placeholders_.find(var_name) != placeholders_.end();
+    Symbol sym = symbols_->find(var_name);
+    return sym != kNoSymbol && placeholders_.count(sym) > 0;
   }
 
   size_t node_count() const {
-    return nodes_.size();
+    return op_classes_.size();
   }
 
-  bool has_node(const std::string& node_name) const {
-    return std::any_of(nodes_.begin(), nodes_.end(), [&](const NodeInfo& node) {
-      return node.name == node_name;
-    });
+  // Node names are "<op_class>_<index>"; they are rendered on demand rather
+  // than stored, and find_node() parses the index back out in O(1).
+  std::string node_name(NodeId node) const {
+    return std::string(symbols_->name(op_classes_[node])) + "_" +
+           std::to_string(node);
   }
 
-  bool consumes(const std::string& node_name, const std::string& input) const {
-    for (const auto& node : nodes_) {
-      if (node.name == node_name) {
-        return std::find(node.inputs.begin(), node.inputs.end(), input) !=
-               node.inputs.end();
+  NodeId find_node(std::string_view node_name) const {
+    size_t sep = node_name.rfind('_');
+    if (sep == std::string_view::npos || sep + 1 == node_name.size()) {
+      return kNoNode;
+    }
+    size_t index = 0;
+    for (char c : node_name.substr(sep + 1)) {
+      if (c < '0' || c > '9' || index > node_count()) {
+        return kNoNode;
       }
+      index = index * 10 + static_cast<size_t>(c - '0');
     }
-    return false;
+    if (index >= node_count() ||
+        op_classes_[index] != symbols_->find(node_name.substr(0, sep))) {
+      return kNoNode;
+    }
+    return static_cast<NodeId>(index);
+  }
+
+  Symbol op_class(NodeId node) const {
+    return op_classes_[node];
+  }
+
+  Span<const Symbol> inputs(NodeId node) const {
+    return {inputs_.data() + input_offsets_[node],
+            input_offsets_[node + 1] - input_offsets_[node]};
+  }
+
+  Span<const Symbol> outputs(NodeId node) const {
+    return {outputs_.data() + output_offsets_[node],
+            output_offsets_[node + 1] - output_offsets_[node]};
+  }
+
+  // The last node writing `var`, or kNoNode for placeholders and free vars.
+  NodeId producer_of(Symbol var) const {
+    const FrozenGraph& frozen = checked_frozen();
+    ValueId value = frozen.find_value(var);
+    return value == kNoValue ? kNoNode : frozen.producer(value);
+  }
+
+  NodeId producer_of(const std::string& var_name) const {
+    return producer_of(symbols_->find(var_name));
+  }
+
+  // Nodes reading the last definition of `var`, in program order.
+  Span<const NodeId> consumers_of(Symbol var) const {
+    const FrozenGraph& frozen = checked_frozen();
+    ValueId value = frozen.find_value(var);
+    return value == kNoValue ? Span<const NodeId>() : frozen.consumers(value);
+  }
+
+  Span<const NodeId> consumers_of(const std::string& var_name) const {
+    return consumers_of(symbols_->find(var_name));
+  }
+
+  // Nodes reading a value this node produced, in program order.
+  Span<const NodeId> successors(NodeId node) const {
+    return checked_frozen().successors(node);
+  }
+
+  // Nodes producing a value this node reads.
+  Span<const NodeId> predecessors(NodeId node) const {
+    return checked_frozen().predecessors(node);
+  }
+
+  bool has_node(const std::string& node_name) const {
+    return find_node(node_name) != kNoNode;
+  }
+
+  bool consumes(const std::string& node_name, const std::string& input) const {
+    NodeId node = find_node(node_name);
+    return node != kNoNode && contains(inputs(node), input);
   }
 
   bool consumes(const std::string& node_name,
                 const std::vector<std::string>& inputs) const {
-    for (const auto& node : nodes_) {
-      if (node.name == node_name) {
-        return std::all_of(
-            inputs.begin(), inputs.end(), [&](const std::string& input) {
-              return std::find(node.inputs.begin(), node.inputs.end(), input) !=
-                     node.inputs.end();
-            });
-      }
-    }
-    return false;
+    NodeId node = find_node(node_name);
+    return node != kNoNode &&
+           std::all_of(inputs.begin(), inputs.end(),
+                       [&](const std::string& input) {
+                         return contains(this->inputs(node), input);
+                       });
   }
 
   bool produces(const std::string& node_name, const std::string& output) const {
-    for (const auto& node : nodes_) {
-      if (node.name == node_name) {
-        return std::find(node.outputs.begin(), node.outputs.end(), output) !=
-               node.outputs.end();
-      }
-    }
-    return false;
+    NodeId node = find_node(node_name);
+    return node != kNoNode && contains(outputs(node), output);
   }
 
   void print() const {
     std::cout << "Graph Structure (node_count=" << node_count()
               << "):" << std::endl;
-    for (const auto& node : nodes_) {
-      std::cout << " + Node: " << node.name << std::endl;
+    for (NodeId i = 0; i < node_count(); i++) {
+      std::cout << " + Node: " << node_name(i) << std::endl;
       std::cout << "   - Inputs: ";
-      for (const auto& input : node.inputs)
-        std::cout << input << " ";
+      for (Symbol input : inputs(i))
+        std::cout << symbols_->name(input) << " ";
       std::cout << std::endl << "   - Outputs: ";
-      for (const auto& output : node.outputs)
-        std::cout << output << " ";
+      for (Symbol output : outputs(i))
+        std::cout << symbols_->name(output) << " ";
       std::cout << std::endl;
     }
   }
+
+private:
+  const FrozenGraph& checked_frozen() const {
+    if (!frozen_) {
+      throw std::runtime_error("Graph is not finalized");
+    }
+    return *frozen_;
+  }
+
+  // Each input is wired to the closest earlier definition of its variable,
+  // so nodes must have been added in program order.
+  std::shared_ptr<const FrozenGraph> build_frozen() const {
+    auto frozen = std::make_shared<FrozenGraph>();
+    FrozenGraph& f = *frozen;
+    const NodeId count = static_cast<NodeId>(node_count());
+    const size_t var_count = symbols_->size();
+
+    f.symbols_ = symbols_;
+    f.op_classes_ = op_classes_;
+    f.input_offsets_ = input_offsets_;
+    f.output_offsets_ = output_offsets_;
+    f.inputs_.reserve(inputs_.size());
+    f.outputs_.reserve(outputs_.size());
+    f.value_by_symbol_.assign(var_count, kNoValue);
+    f.pred_offsets_.reserve(count + 1);
+    f.pred_offsets_.push_back(0);
+
+    auto new_value = [&](Symbol sym, NodeId producer) {
+      ValueId value = static_cast<ValueId>(f.value_symbols_.size());
+      f.value_symbols_.push_back(sym);
+      f.producers_.push_back(producer);
+      f.placeholders_.push_back(producer == kNoNode &&
+                                placeholders_.count(sym) > 0);
+      f.value_by_symbol_[sym] = value;
+      return value;
+    };
+
+    // last node that recorded a given predecessor
+    std::vector<NodeId> pred_seen(count, kNoNode);
+    for (NodeId i = 0; i < count; i++) {
+      for (Symbol input : inputs(i)) {
+        ValueId value = f.value_by_symbol_[input];
+        if (value == kNoValue) {
+          value = new_value(input, kNoNode);
+          f.graph_inputs_.push_back(value);
+        }
+        f.inputs_.push_back(value);
+        NodeId def = f.producers_[value];
+        if (def != kNoNode && pred_seen[def] != i) {
+          pred_seen[def] = i;
+          f.preds_.push_back(def);
+        }
+      }
+      f.pred_offsets_.push_back(static_cast<uint32_t>(f.preds_.size()));
+      for (Symbol output : outputs(i)) {
+        f.outputs_.push_back(new_value(output, i));
+      }
+    }
+
+    // Transpose value->node reads into consumer lists, and node->node
+    // predecessor lists into successor lists.
+    const size_t value_count = f.value_count();
+    std::vector<NodeId> value_seen(value_count, kNoNode);
+    f.consumer_offsets_.assign(value_count + 1, 0);
+    for (NodeId i = 0; i < count; i++) {
+      for (ValueId value : f.inputs(i)) {
+        if (value_seen[value] != i) {
+          value_seen[value] = i;
+          f.consumer_offsets_[value + 1]++;
+        }
+      }
+    }
+    for (size_t v = 0; v < value_count; v++) {
+      f.consumer_offsets_[v + 1] += f.consumer_offsets_[v];
+    }
+    f.consumers_.resize(f.consumer_offsets_[value_count]);
+    std::vector<uint32_t> cursor(f.consumer_offsets_.begin(),
+                                 f.consumer_offsets_.end() - 1);
+    std::fill(value_seen.begin(), value_seen.end(), kNoNode);
+    for (NodeId i = 0; i < count; i++) {
+      for (ValueId value : f.inputs(i)) {
+        if (value_seen[value] != i) {
+          value_seen[value] = i;
+          f.consumers_[cursor[value]++] = i;
+        }
+      }
+    }
+
+    f.succ_offsets_.assign(count + 1, 0);
+    for (NodeId pred : f.preds_) {
+      f.succ_offsets_[pred + 1]++;
+    }
+    for (NodeId i = 0; i < count; i++) {
+      f.succ_offsets_[i + 1] += f.succ_offsets_[i];
+    }
+    f.succs_.resize(f.preds_.size());
+    cursor.assign(f.succ_offsets_.begin(), f.succ_offsets_.end() - 1);
+    for (NodeId i = 0; i < count; i++) {
+      for (NodeId pred : f.predecessors(i)) {
+        f.succs_[cursor[pred]++] = i;
+      }
+    }
+    return frozen;
+  }
+
+  std::vector<Symbol> intern_all(const std::vector<std::string>& names) {
+    std::vector<Symbol> result;
+    result.reserve(names.size());
+    for (const auto& name : names) {
+      result.push_back(symbols_->intern(name));
+    }
+    return result;
+  }
+
+  bool contains(Span<const Symbol> syms, const std::string& var_name) const {
+    Symbol sym = symbols_->find(var_name);
+    return sym != kNoSymbol &&
+           std::find(syms.begin(), syms.end(), sym) != syms.end();
+  }
 };
 
+// The op of a node fusing invocations of `op`; see IR::horizontal_fusion().
+inline std::string fused_op_name(std::string_view op) {
+  return "fused:" + std::string(op);
+}
+
+// One op of a chain fused by IR::vertical_fusion(). Every stage but the
+// first reads the result of the one before as its argument `chained`.
+struct ChainStage {
+  std::string_view op;
+  size_t chained = 0;
+};
+
+// The op of a node running `stages` back to back, e.g. "chain:f>g@1>h" for
+// h(g(x, f(y))). Ops whose names hold '>' or '@' cannot be chained.
+inline std::string chain_op_name(const std::vector<ChainStage>& stages) {
+  std::string name = "chain:";
+  for (size_t i = 0; i < stages.size(); i++) {
+    if (i) {
+      name += '>';
+    }
+    name += stages[i].op;
+    if (stages[i].chained) {
+      name += '@' + std::to_string(stages[i].chained);
+    }
+  }
+  return name;
+}
+
+// The stages of a chain_op_name(), or none if `name` is not one.
+inline std::vector<ChainStage> parse_chain_op(std::string_view name) {
+  constexpr std::string_view kPrefix = "chain:";
+  std::vector<ChainStage> stages;
+  if (name.substr(0, kPrefix.size()) != kPrefix) {
+    return stages;
+  }
+  name.remove_prefix(kPrefix.size());
+  while (!name.empty()) {
+    std::string_view stage = name.substr(0, name.find('>'));
+    name.remove_prefix(std::min(name.size(), stage.size() + 1));
+    ChainStage parsed{stage, 0};
+    size_t at = stage.find('@');
+    if (at != std::string_view::npos) {
+      parsed.op = stage.substr(0, at);
+      std::from_chars(stage.data() + at + 1, stage.data() + stage.size(),
+                      parsed.chained);
+    }
+    stages.push_back(parsed);
+  }
+  return stages;
+}
+
 // IR Node Types
 enum class IRNodeType { PLACEHOLDER, OPERATION, VARIABLE };
 
-// IR Node representing operations before they're compiled into the final graph
+// IR Node representing operations before they're compiled into the final graph.
+// Input and output lists point into the owning Program's arena.
 struct IRNode {
   IRNodeType type;
-  std::string name;
-  std::string op_class;
-  std::vector<std::string> inputs;
-  std::vector<std::string> outputs;
+  // Position in the IR; assigned by IR::add_node().
+  size_t id = 0;
+  Symbol op_class;
+  Span<Symbol> inputs;
+  Span<Symbol> outputs;
   bool is_dead = false;
 
-  IRNode(const std::string& op, const std::vector<std::string>& ins,
-         const std::vector<std::string>& outs)
-      : type(IRNodeType::OPERATION), op_class(op), inputs(ins), outputs(outs) {
-    name = op + "_" + std::to_string(get_next_id());
-  }
+  IRNode(Symbol op, Span<Symbol> ins, Span<Symbol> outs)
+      : type(IRNodeType::OPERATION), op_class(op), inputs(ins), outputs(outs) {}
 
-  static IRNode create_placeholder(const std::string& name) {
-    IRNode node("", {}, {name});
+  static IRNode create_placeholder(Span<Symbol> name) {
+    IRNode node(kNoSymbol, {}, name);
     node.type = IRNodeType::PLACEHOLDER;
-    node.name = name;
     return node;
   }
-
-private:
-  static size_t get_next_id() {
-    static size_t next_id = 0;
-    return next_id++;
-  }
 };
 
 // Intermediate Representation
+//
+// Liveness is maintained incrementally as nodes are appended: every node keeps
+// a count of its live uses (live consumers plus the variables it is the root
+// definition of), and a node is dead exactly when that count is zero.
 class IR {
 private:
-  std::vector<IRNode> nodes_;
-  std::unordered_map<std::string, size_t> var_to_last_def_;
-  std::unordered_set<std::string> placeholders_;
+  std::shared_ptr<SymbolTable> symbols_;
+  Arena& arena_;
+  // A deque never relocates its nodes, and takes its blocks from the arena.
+  std::pmr::deque<IRNode> nodes_;
+  // Indexed by Symbol; kNoDef when the variable was never defined.
+  std::vector<size_t> var_to_last_def_;
+  std::vector<bool> placeholders_;
+  // Per input of every node, in offset + flat form: the node defining that
+  // input at the point it was read, or kNoDef for free variables. Use
+  // defs_of(), since a pass may shrink a node's inputs and leave slots unused.
+  std::vector<size_t> def_offsets_{0};
+  std::vector<size_t> defs_;
+  std::vector<uint32_t> live_counts_;
+  std::vector<size_t> worklist_;
+  // Indexed by op Symbol
+  std::vector<bool> impure_ops_;
+  size_t version_ = 0;
+
+  static constexpr size_t kNoDef = std::numeric_limits<size_t>::max();
 
 public:
+  IR(std::shared_ptr<SymbolTable> symbols, Arena& arena)
+      : symbols_(std::move(symbols)), arena_(arena),
+        nodes_(arena.resource()) {}
+
+  // Copies `other` so that passes can rewrite the copy while `other` keeps
+  // growing. Node lists stay shared until a pass rewrites them into `arena`.
+  IR(const IR& other, Arena& arena)
+      : symbols_(other.symbols_), arena_(arena),
+        nodes_(other.nodes_.begin(), other.nodes_.end(), arena.resource()),
+        var_to_last_def_(other.var_to_last_def_),
+        placeholders_(other.placeholders_), def_offsets_(other.def_offsets_),
+        defs_(other.defs_), live_counts_(other.live_counts_),
+        impure_ops_(other.impure_ops_), version_(other.version_) {}
+
+  // Catches up with `source`, the IR this one was copied from, by adding the
+  // nodes it gained from index `from` on, as add_node() would. Fails, leaving
+  // this IR unusable, when a new node reads a value the passes run here have
+  // renamed away or let die: that needs a fresh copy.
+  bool append_from(const IR& source, size_t from) {
+    for (size_t i = from; i < source.size(); i++) {
+      const IRNode& node = source.nodes_[i];
+      grow();
+      for (size_t k = 0; k < node.inputs.size(); k++) {
+        size_t def = var_to_last_def_[node.inputs[k]];
+        bool defined = source.defs_[source.def_offsets_[i] + k] != kNoDef;
+        if (defined != (def != kNoDef) ||
+            (def != kNoDef &&
+             (nodes_[def].is_dead ||
+              std::find(nodes_[def].outputs.begin(),
+                        nodes_[def].outputs.end(),
+                        node.inputs[k]) == nodes_[def].outputs.end()))) {
+          return false;
+        }
+      }
+      if (source.is_impure(node.op_class)) {
+        mark_impure(node.op_class);
+      }
+      if (node.type == IRNodeType::PLACEHOLDER) {
+        placeholders_[node.outputs[0]] = true;
+      }
+      add_node(node);
+    }
+    return true;
+  }
+
+  // The arena that node input and output lists must be allocated from.
+  Arena& arena() {
+    return arena_;
+  }
+
   void add_node(IRNode node) {
-    for (const auto& output : node.outputs) {
-      var_to_last_def_[output] = nodes_.size();
+    const size_t index = nodes_.size();
+    grow();
+    for (Symbol input : node.inputs) {
+      defs_.push_back(var_to_last_def_[input]);
     }
+    def_offsets_.push_back(defs_.size());
+    node.id = index;
+    node.is_dead = true;
     nodes_.push_back(std::move(node));
+    live_counts_.push_back(0);
+
+    // Take the new roots before dropping the old ones, so that `x = f(x)`
+    // does not kill and revive the previous definition of x.
+    const auto& outputs = nodes_[index].outputs;
+    for (Symbol output : outputs) {
+      if (is_root(output)) {
+        retain(index);
+      }
+    }
+    for (Symbol output : outputs) {
+      size_t previous = var_to_last_def_[output];
+      var_to_last_def_[output] = index;
+      if (previous != kNoDef && is_root(output)) {
+        release(previous);
+      }
+    }
+    version_++;
+  }
+
+  void add_placeholder(Symbol name) {
+    grow();
+    placeholders_[name] = true;
+    add_node(IRNode::create_placeholder(arena_.copy({name})));
   }
 
-  void add_placeholder(const std::string& name) {
-    placeholders_.insert(name);
-    add_node(IRNode::create_placeholder(name));
+  // Invocations of an impure op are never merged with each other.
+  void mark_impure(Symbol op) {
+    if (op >= impure_ops_.size()) {
+      impure_ops_.resize(symbols_->size(), false);
+    }
+    impure_ops_[op] = true;
   }
 
-  void optimize() {
-    dead_store_elimination();
+  // Bumped by every add_node(); lets callers cache what they derive from it.
+  size_t version() const {
+    return version_;
   }
 
-  void dead_store_elimination() {
-    std::unordered_set<size_t> live_nodes;
-    std::unordered_set<std::string> live_vars;
+  size_t size() const {
+    return nodes_.size();
+  }
+
+  IRNode& node(size_t index) {
+    return nodes_[index];
+  }
+
+  const IRNode& node(size_t index) const {
+    return nodes_[index];
+  }
+
+  // The node defining each input of `node` at the point it was read, or
+  // kNoDef for free variables. A pass that rewires an input must update its
+  // definition too; it may also shrink a node's inputs, but never grow them.
+  Span<size_t> defs_of(size_t node) {
+    return {defs_.data() + def_offsets_[node], nodes_[node].inputs.size()};
+  }
+
+  SymbolTable& symbols() {
+    return *symbols_;
+  }
+
+  size_t live_count() const {
+    return std::count_if(nodes_.begin(), nodes_.end(),
+                         [](const IRNode& node) { return !node.is_dead; });
+  }
 
-    for (const auto& [var, idx] : var_to_last_def_) {
-      if (placeholders_.count(var) > 0 ||
-          var.find("__var") == std::string::npos) {
-        live_vars.insert(var);
-        live_nodes.insert(idx);
+  // Runs the standard pipeline; see PassManager::standard().
+  void optimize();
+
+  // Merges invocations of the same pure op on the same definitions. Readers
+  // of a duplicate are rewired to the first invocation's outputs wherever
+  // those still reach them; a duplicate that is the last definition of a
+  // named variable becomes a copy of the first invocation instead. Returns
+  // the number of nodes rewritten. Keeps liveness up to date.
+  size_t common_subexpression_elimination() {
+    const Symbol copy = symbols_->intern("copy");
+    grow();
+
+    std::vector<size_t> reaching(var_to_last_def_.size(), kNoDef);
+    std::vector<size_t> merged_into(nodes_.size(), kNoDef);
+    // First node of every distinct invocation. Power-of-two sized, linear
+    // probing, at most half full.
+    size_t capacity = 64;
+    while (capacity < nodes_.size() * 2) {
+      capacity *= 2;
+    }
+    std::vector<size_t> firsts(capacity, kNoDef);
+    size_t rewritten = 0;
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      IRNode& node = nodes_[i];
+      if (node.is_dead) {
+        continue;
+      }
+      // Rewiring first lets merges cascade down a chain of duplicates.
+      Span<size_t> defs = defs_of(i);
+      bool owned = false;
+      for (size_t k = 0; k < defs.size(); k++) {
+        if (defs[k] == kNoDef || merged_into[defs[k]] == kNoDef) {
+          continue;
+        }
+        size_t first = merged_into[defs[k]];
+        size_t index = output_index(defs[k], node.inputs[k]);
+        Symbol output = nodes_[first].outputs[index];
+        if (reaching[output] != first) {
+          continue;
+        }
+        if (!owned) {
+          node.inputs = arena_.copy<Symbol>(node.inputs);
+          owned = true;
+        }
+        node.inputs[k] = output;
+        move_use(defs[k], first);
+        defs[k] = first;
+      }
+
+      bool changed = owned;
+      if (node.type == IRNodeType::OPERATION && node.op_class != copy &&
+          !is_impure(node.op_class)) {
+        size_t slot = invocation_hash(i) & (capacity - 1);
+        while (firsts[slot] != kNoDef && !same_invocation(firsts[slot], i)) {
+          slot = (slot + 1) & (capacity - 1);
+        }
+        if (firsts[slot] == kNoDef) {
+          firsts[slot] = i;
+        } else {
+          merged_into[i] = firsts[slot];
+          changed |= replace_with_copy(i, firsts[slot], copy, reaching);
+        }
+      }
+      rewritten += changed;
+
+      for (Symbol output : node.outputs) {
+        reaching[output] = i;
       }
     }
+    return rewritten;
+  }
 
-    bool changed;
-    do {
-      changed = false;
-      for (size_t i = nodes_.size(); i-- > 0;) {
-        if (live_nodes.count(i) > 0) {
-          for (const auto& input : nodes_[i].inputs) {
-            if (live_vars.insert(input).second) {
-              auto it = var_to_last_def_.find(input);
-              if (it != var_to_last_def_.end()) {
-                live_nodes.insert(it->second);
-                changed = true;
-              }
-            }
+  // Removes "copy" nodes. A named copy of an anonymous temporary is folded
+  // into the temporary's producer, which then writes the named variable
+  // directly; readers of any other copy are rewired to the copied definition
+  // wherever it still reaches them. Returns the number of nodes rewritten.
+  // Keeps liveness up to date: a bypassed copy dies with its last reader.
+  size_t copy_propagation() {
+    const Symbol copy = symbols_->find("copy");
+    if (copy == kNoSymbol) {
+      return 0;
+    }
+    grow();
+    size_t rewritten = fold_named_copies(copy);
+
+    // Forward walk over live nodes. `reaching` is the definition of each
+    // variable at the current node, which a read through a copy must agree
+    // with to be rewired.
+    std::vector<size_t> reaching(var_to_last_def_.size(), kNoDef);
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      IRNode& node = nodes_[i];
+      if (node.is_dead) {
+        continue;
+      }
+      Span<size_t> defs = defs_of(i);
+      bool owned = false;
+      for (size_t k = 0; k < defs.size(); k++) {
+        size_t def = defs[k];
+        if (def == kNoDef || nodes_[def].op_class != copy) {
+          continue;
+        }
+        Symbol source = nodes_[def].inputs[0];
+        size_t source_def = defs_of(def)[0];
+        if (reaching[source] != source_def) {
+          continue;
+        }
+        if (!owned) {
+          node.inputs = arena_.copy<Symbol>(node.inputs);
+          owned = true;
+        }
+        node.inputs[k] = source;
+        move_use(def, source_def);
+        defs[k] = source_def;
+      }
+      rewritten += owned;
+      for (Symbol output : node.outputs) {
+        reaching[output] = i;
+      }
+    }
+    return rewritten;
+  }
+
+  // Fuses sibling invocations of one op that read a common definition, such
+  // as several heads over one embedding, into one node of op
+  // fused_op_name(op) whose inputs and outputs are its members', in order.
+  // Only ops for which `fusible(name)` holds take part, and impure ones
+  // never. Members move up to the first one, so a node joins a group only
+  // if everything it reads, graph inputs aside, is defined before the group
+  // starts and nothing from there on touches what it writes. Returns the number of nodes fused
+  // away. Leaves liveness stale, so run dead_store_elimination() afterwards.
+  size_t horizontal_fusion(
+      const std::function<bool(std::string_view op)>& fusible) {
+    grow();
+    FusibleOps is_fusible(*this, fusible);
+
+    // The open group of each (op, input, definition): its first member
+    struct Key {
+      Symbol op;
+      Symbol input;
+      size_t def;
+
+      bool operator==(const Key& other) const {
+        return op == other.op && input == other.input && def == other.def;
+      }
+    };
+    struct KeyHash {
+      size_t operator()(const Key& key) const {
+        return (key.op * 1000003 ^ key.input) * 1000003 ^ key.def;
+      }
+    };
+    std::unordered_map<Key, size_t, KeyHash> open;
+    // Members of each group chain from its first member, in order
+    std::vector<size_t> next_member(nodes_.size(), kNoDef);
+    std::vector<size_t> last_member(nodes_.size(), kNoDef);
+    std::vector<size_t> last_touch(var_to_last_def_.size(), kNoDef);
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      const IRNode& node = nodes_[i];
+      if (node.is_dead) {
+        continue;
+      }
+      if (node.type == IRNodeType::OPERATION && !node.inputs.empty() &&
+          is_fusible(node.op_class)) {
+        Span<size_t> defs = defs_of(i);
+        size_t group = kNoDef;
+        for (size_t k = 0; k < defs.size() && group == kNoDef; k++) {
+          auto it = open.find({node.op_class, node.inputs[k], defs[k]});
+          if (it != open.end() && can_join(i, it->second, last_touch)) {
+            group = it->second;
           }
         }
+        if (group == kNoDef) {
+          group = i;
+        } else {
+          next_member[last_member[group]] = i;
+        }
+        last_member[group] = i;
+        for (size_t k = 0; k < defs.size(); k++) {
+          open[{node.op_class, node.inputs[k], defs[k]}] = group;
+        }
       }
-    } while (changed);
+      for (Symbol input : node.inputs) {
+        last_touch[input] = i;
+      }
+      for (Symbol output : node.outputs) {
+        last_touch[output] = i;
+      }
+    }
 
+    std::vector<size_t> fused_into(nodes_.size(), kNoDef);
+    size_t fused = 0;
+    for (size_t first = 0; first < nodes_.size(); first++) {
+      if (last_member[first] == kNoDef || last_member[first] == first) {
+        continue;
+      }
+      size_t members = 0;
+      for (size_t m = first; m != kNoDef; m = next_member[m]) {
+        members++;
+      }
+      IRNode& head = nodes_[first];
+      const size_t arity = head.inputs.size();
+      const size_t results = head.outputs.size();
+      Span<Symbol> inputs = arena_.allocate<Symbol>(members * arity);
+      Span<Symbol> outputs = arena_.allocate<Symbol>(members * results);
+      std::vector<size_t> defs(members * arity);
+      size_t n = 0;
+      for (size_t m = first; m != kNoDef; m = next_member[m], n++) {
+        const IRNode& member = nodes_[m];
+        Span<size_t> member_defs = defs_of(m);
+        for (size_t k = 0; k < arity; k++) {
+          inputs[n * arity + k] = member.inputs[k];
+          size_t def = member_defs[k];
+          defs[n * arity + k] =
+              def != kNoDef && fused_into[def] != kNoDef ? fused_into[def]
+                                                         : def;
+        }
+        for (size_t k = 0; k < results; k++) {
+          outputs[n * results + k] = member.outputs[k];
+          if (var_to_last_def_[member.outputs[k]] == m) {
+            var_to_last_def_[member.outputs[k]] = first;
+          }
+        }
+        if (m != first) {
+          fused_into[m] = first;
+          nodes_[m].is_dead = true;
+          fused++;
+        }
+      }
+      head.op_class = symbols_->intern(fused_op_name(symbols_->name(
+          head.op_class)));
+      head.outputs = outputs;
+      set_inputs(first, inputs, defs);
+    }
+    if (fused == 0) {
+      return 0;
+    }
     for (size_t i = 0; i < nodes_.size(); i++) {
-      nodes_[i].is_dead = (live_nodes.count(i) == 0);
+      for (size_t& def : defs_of(i)) {
+        if (def != kNoDef && fused_into[def] != kNoDef) {
+          def = fused_into[def];
+        }
+      }
+    }
+    return fused;
+  }
+
+  // Collapses chains of invocations, each the only reader of the one
+  // before, into one node running them back to back, of op
+  // chain_op_name(stages). Stages follow each other in program order, have
+  // one output and an op for which `fusible(name)` holds; a stage's result
+  // must not be observable, except the last one's. The node reads the
+  // inputs of every stage but the ones chained, in order, and writes the
+  // last stage's output. Returns the number of nodes fused away. Leaves
+  // liveness stale, so run dead_store_elimination() afterwards.
+  size_t vertical_fusion(
+      const std::function<bool(std::string_view op)>& fusible) {
+    grow();
+    FusibleOps is_fusible(*this, fusible);
+    std::vector<uint32_t> readers(nodes_.size(), 0);
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      if (nodes_[i].is_dead) {
+        continue;
+      }
+      for (size_t def : defs_of(i)) {
+        if (def != kNoDef) {
+          readers[def]++;
+        }
+      }
+    }
+
+    // The stage before each chained node, and the argument it fills
+    std::vector<size_t> previous(nodes_.size(), kNoDef);
+    std::vector<size_t> chained_at(nodes_.size(), 0);
+    std::vector<bool> has_next(nodes_.size(), false);
+    size_t last_op = kNoDef;
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      const IRNode& node = nodes_[i];
+      if (node.is_dead || node.type != IRNodeType::OPERATION) {
+        continue;
+      }
+      if (node.outputs.size() != 1 || !is_fusible(node.op_class)) {
+        last_op = kNoDef;
+        continue;
+      }
+      if (last_op != kNoDef && readers[last_op] == 1 &&
+          !is_root_def(last_op)) {
+        Span<size_t> defs = defs_of(i);
+        auto it = std::find(defs.begin(), defs.end(), last_op);
+        if (it != defs.end()) {
+          previous[i] = last_op;
+          chained_at[i] = it - defs.begin();
+          has_next[last_op] = true;
+        }
+      }
+      last_op = i;
+    }
+
+    size_t fused = 0;
+    std::vector<size_t> stages;
+    std::vector<ChainStage> names;
+    std::vector<size_t> defs;
+    for (size_t tail = 0; tail < nodes_.size(); tail++) {
+      if (previous[tail] == kNoDef || has_next[tail]) {
+        continue;
+      }
+      stages.clear();
+      for (size_t n = tail; n != kNoDef; n = previous[n]) {
+        stages.push_back(n);
+      }
+      std::reverse(stages.begin(), stages.end());
+
+      size_t arity = 0;
+      for (size_t stage : stages) {
+        arity += nodes_[stage].inputs.size();
+      }
+      arity -= stages.size() - 1;
+      Span<Symbol> inputs = arena_.allocate<Symbol>(arity);
+      names.clear();
+      defs.clear();
+      for (size_t stage : stages) {
+        const IRNode& node = nodes_[stage];
+        Span<size_t> stage_defs = defs_of(stage);
+        size_t skip = previous[stage] == kNoDef ? kNoDef : chained_at[stage];
+        for (size_t k = 0; k < node.inputs.size(); k++) {
+          if (k != skip) {
+            inputs[defs.size()] = node.inputs[k];
+            defs.push_back(stage_defs[k]);
+          }
+        }
+        names.push_back({symbols_->name(node.op_class),
+                         skip == kNoDef ? 0 : skip});
+        if (stage != tail) {
+          nodes_[stage].is_dead = true;
+          fused++;
+        }
+      }
+      nodes_[tail].op_class = symbols_->intern(chain_op_name(names));
+      set_inputs(tail, inputs, defs);
+    }
+    return fused;
+  }
+
+  // Recomputes liveness from scratch. Roots are the last definitions of
+  // placeholders and named variables; liveness then flows backwards along
+  // def-use edges, visiting each edge once.
+  void dead_store_elimination() {
+    std::fill(live_counts_.begin(), live_counts_.end(), 0);
+    worklist_.clear();
+    for (Symbol var = 0; var < var_to_last_def_.size(); var++) {
+      size_t def = var_to_last_def_[var];
+      if (def != kNoDef && is_root(var) && live_counts_[def]++ == 0) {
+        worklist_.push_back(def);
+      }
+    }
+    while (!worklist_.empty()) {
+      size_t node = worklist_.back();
+      worklist_.pop_back();
+      for (size_t def : defs_of(node)) {
+        if (def != kNoDef && live_counts_[def]++ == 0) {
+          worklist_.push_back(def);
+        }
+      }
+    }
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      nodes_[i].is_dead = live_counts_[i] == 0;
     }
   }
 
   Graph to_graph() const {
-    Graph g;
+    Graph g(symbols_);
     for (const auto& node : nodes_) {
       if (!node.is_dead && node.type == IRNodeType::OPERATION) {
-        g.add_node(node.op_class, node.inputs, node.outputs,
-                   get_placeholder_inputs(node.inputs));
+        g.add_node(node.op_class, node.inputs, node.outputs);
+        for (Symbol input : node.inputs) {
+          if (is_placeholder(input)) {
+            g.add_placeholder(input);
+          }
+        }
       }
     }
+    g.finalize();
     return g;
   }
 
 private:
-  std::vector<std::string>
-  get_placeholder_inputs(const std::vector<std::string>& inputs) const {
-    std::vector<std::string> result;
-    for (const auto& input : inputs) {
-      if (placeholders_.count(input) > 0) {
-        result.push_back(input);
+  bool is_impure(Symbol op) const {
+    return op < impure_ops_.size() && impure_ops_[op];
+  }
+
+  size_t invocation_hash(size_t node) {
+    size_t hash = nodes_[node].op_class;
+    Span<size_t> defs = defs_of(node);
+    for (size_t k = 0; k < defs.size(); k++) {
+      hash = hash * 1000003 ^ nodes_[node].inputs[k];
+      hash = hash * 1000003 ^ defs[k];
+    }
+    return hash;
+  }
+
+  // Same op reading the same definitions of the same variables.
+  bool same_invocation(size_t a, size_t b) {
+    const IRNode& x = nodes_[a];
+    const IRNode& y = nodes_[b];
+    Span<size_t> x_defs = defs_of(a);
+    Span<size_t> y_defs = defs_of(b);
+    return x.op_class == y.op_class && x.inputs.size() == y.inputs.size() &&
+           x.outputs.size() == y.outputs.size() &&
+           std::equal(x.inputs.begin(), x.inputs.end(), y.inputs.begin()) &&
+           std::equal(x_defs.begin(), x_defs.end(), y_defs.begin());
+  }
+
+  // Caches `fusible(name)` by op Symbol; impure ops never pass.
+  class FusibleOps {
+  public:
+    FusibleOps(const IR& ir,
+               const std::function<bool(std::string_view op)>& fusible)
+        : ir_(ir), fusible_(fusible) {}
+
+    bool operator()(Symbol op) {
+      if (op >= known_.size()) {
+        known_.resize(ir_.symbols_->size(), 0);
+      }
+      if (known_[op] == 0) {
+        known_[op] =
+            !ir_.is_impure(op) && fusible_(ir_.symbols_->name(op)) ? 1 : 2;
+      }
+      return known_[op] == 1;
+    }
+
+  private:
+    const IR& ir_;
+    const std::function<bool(std::string_view op)>& fusible_;
+    // Indexed by op Symbol: 0 not asked yet, 1 fusible, 2 not
+    std::vector<uint8_t> known_;
+  };
+
+  // Whether `node` is the last definition of an observable variable.
+  bool is_root_def(size_t node) const {
+    for (Symbol output : nodes_[node].outputs) {
+      if (is_root(output) && var_to_last_def_[output] == node) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Whether `node` can move up to `first` and join its fusion group.
+  bool can_join(size_t node, size_t first,
+                const std::vector<size_t>& last_touch) {
+    const IRNode& x = nodes_[node];
+    const IRNode& y = nodes_[first];
+    if (x.inputs.size() != y.inputs.size() ||
+        x.outputs.size() != y.outputs.size()) {
+      return false;
+    }
+    // A graph input may be declared after `first`: it is fed, not computed
+    for (size_t def : defs_of(node)) {
+      if (def != kNoDef && def >= first &&
+          nodes_[def].type != IRNodeType::PLACEHOLDER) {
+        return false;
+      }
+    }
+    for (Symbol output : x.outputs) {
+      if (last_touch[output] != kNoDef && last_touch[output] >= first) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Gives `node` new inputs, possibly more than it had, defined by `defs`.
+  void set_inputs(size_t node, Span<Symbol> inputs,
+                  const std::vector<size_t>& defs) {
+    def_offsets_[node] = defs_.size();
+    defs_.insert(defs_.end(), defs.begin(), defs.end());
+    def_offsets_.back() = defs_.size();
+    nodes_[node].inputs = inputs;
+  }
+
+  size_t output_index(size_t node, Symbol output) {
+    const auto& outputs = nodes_[node].outputs;
+    return std::find(outputs.begin(), outputs.end(), output) - outputs.begin();
+  }
+
+  // A merged duplicate that still defines a named variable for good turns
+  // into a copy of the first invocation's output, when that reaches it.
+  bool replace_with_copy(size_t duplicate, size_t first, Symbol copy,
+                         const std::vector<size_t>& reaching) {
+    IRNode& node = nodes_[duplicate];
+    bool observed = std::any_of(
+        node.outputs.begin(), node.outputs.end(), [&](Symbol output) {
+          return is_root(output) && var_to_last_def_[output] == duplicate;
+        });
+    if (!observed) {
+      return false;
+    }
+    Symbol source = nodes_[first].outputs[0];
+    if (node.outputs.size() != 1 || reaching[source] != first) {
+      return false;
+    }
+    retain(first);
+    for (size_t def : defs_of(duplicate)) {
+      if (def != kNoDef) {
+        release(def);
+      }
+    }
+    node.op_class = copy;
+    node.inputs = arena_.copy({source});
+    defs_of(duplicate)[0] = first;
+    return true;
+  }
+
+  // `b = a`, where `a` is an anonymous temporary whose producer has no other
+  // reader, becomes the producer writing `b`, provided nothing in between
+  // touches `b`. Returns the number of copies folded, which die once their
+  // readers have moved over.
+  size_t fold_named_copies(Symbol copy) {
+    std::vector<uint32_t> readers(nodes_.size(), 0);
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      if (nodes_[i].is_dead) {
+        continue;
+      }
+      for (size_t def : defs_of(i)) {
+        if (def != kNoDef) {
+          readers[def]++;
+        }
+      }
+    }
+
+    // Copies folded into their producer; later readers are moved over.
+    std::vector<size_t> folded_into(nodes_.size(), kNoDef);
+    std::vector<size_t> last_touch(var_to_last_def_.size(), kNoDef);
+    size_t folded = 0;
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      IRNode& node = nodes_[i];
+      if (node.is_dead) {
+        continue;
+      }
+      for (size_t& def : defs_of(i)) {
+        if (def != kNoDef && folded_into[def] != kNoDef) {
+          move_use(def, folded_into[def]);
+          def = folded_into[def];
+        }
+      }
+      if (node.op_class == copy && try_fold(i, readers, last_touch)) {
+        folded_into[i] = defs_of(i)[0];
+        folded++;
+      }
+      for (Symbol input : node.inputs) {
+        last_touch[input] = i;
+      }
+      for (Symbol output : node.outputs) {
+        last_touch[output] = i;
+      }
+    }
+    return folded;
+  }
+
+  bool try_fold(size_t copy_node, const std::vector<uint32_t>& readers,
+                const std::vector<size_t>& last_touch) {
+    Symbol source = nodes_[copy_node].inputs[0];
+    Symbol target = nodes_[copy_node].outputs[0];
+    size_t producer = defs_of(copy_node)[0];
+    if (producer == kNoDef || is_root(source) || !is_root(target) ||
+        is_placeholder(target) || readers[producer] != 1 ||
+        nodes_[producer].type != IRNodeType::OPERATION) {
+      return false;
+    }
+    IRNode& node = nodes_[producer];
+    size_t touched = last_touch[target];
+    if (touched != kNoDef &&
+        (touched > producer ||
+         std::find(node.outputs.begin(), node.outputs.end(), target) !=
+             node.outputs.end())) {
+      return false;
+    }
+    node.outputs = arena_.copy<Symbol>(node.outputs);
+    std::replace(node.outputs.begin(), node.outputs.end(), source, target);
+    if (var_to_last_def_[target] == copy_node) {
+      var_to_last_def_[target] = producer;
+      move_use(copy_node, producer);
+    }
+    if (var_to_last_def_[source] == producer) {
+      var_to_last_def_[source] = kNoDef;
+    }
+    return true;
+  }
+
+  void grow() {
+    if (var_to_last_def_.size() < symbols_->size()) {
+      var_to_last_def_.resize(symbols_->size(), kNoDef);
+      placeholders_.resize(symbols_->size(), false);
+    }
+  }
+
+  bool is_placeholder(Symbol sym) const {
+    return sym < placeholders_.size() && placeholders_[sym];
+  }
+
+  // Whether the last definition of `var` is observable, and so live.
+  bool is_root(Symbol var) const {
+    return placeholders_[var] || !symbols_->is_anonymous(var);
+  }
+
+  // Adds a live use to `node`; a node gaining its first use makes the
+  // definitions it reads live in turn.
+  void retain(size_t node) {
+    worklist_.assign(1, node);
+    while (!worklist_.empty()) {
+      size_t n = worklist_.back();
+      worklist_.pop_back();
+      if (live_counts_[n]++ == 0) {
+        nodes_[n].is_dead = false;
+        push_defs(n);
       }
     }
-    return result;
   }
+
+  // Drops a live use from `node`; a node losing its last use releases the
+  // definitions it reads in turn.
+  void release(size_t node) {
+    worklist_.assign(1, node);
+    while (!worklist_.empty()) {
+      size_t n = worklist_.back();
+      worklist_.pop_back();
+      if (--live_counts_[n] == 0) {
+        nodes_[n].is_dead = true;
+        push_defs(n);
+      }
+    }
+  }
+
+  // Moves one live use from `from` to `to`, either of which may be kNoDef.
+  // Taking the new use first keeps a node both lose and gain alive.
+  void move_use(size_t from, size_t to) {
+    if (to != kNoDef) {
+      retain(to);
+    }
+    if (from != kNoDef) {
+      release(from);
+    }
+  }
+
+  void push_defs(size_t node) {
+    for (size_t def : defs_of(node)) {
+      if (def != kNoDef) {
+        worklist_.push_back(def);
+      }
+    }
+  }
+
 };
 
-// Context for managing program scopes
+// What one pass did during a PassManager::run(), summed over all rounds.
+struct PassStats {
+  std::string name;
+  size_t runs = 0;
+  std::chrono::nanoseconds wall_time{0};
+  size_t nodes_removed = 0;
+  size_t nodes_rewritten = 0;
+};
+
+// Tag for passes that keep the IR's liveness up to date themselves
+struct keeps_liveness_t {};
+[[maybe_unused]] static constexpr keeps_liveness_t keeps_liveness{};
+
+// Runs an ordered list of IR passes, once or until a fixed point.
+//
+// A pass returns the number of nodes it rewrote. Unless it was added as
+// `keeps_liveness`, liveness is recomputed after a pass that rewrote
+// anything, counted as part of its wall time; the nodes that died are the
+// ones the pass removed.
+class PassManager {
+public:
+  using Pass = std::function<size_t(IR&)>;
+
+  // Common subexpression elimination, then copy propagation, run once.
+  static PassManager standard() {
+    PassManager passes;
+    passes.add(keeps_liveness, "cse", [](IR& ir) {
+      return ir.common_subexpression_elimination();
+    });
+    passes.add(keeps_liveness, "copy_propagation",
+               [](IR& ir) { return ir.copy_propagation(); });
+    return passes;
+  }
+
+  // Appends a pass; passes run in the order they were added.
+  PassManager& add(std::string name, Pass pass) {
+    passes_.push_back({std::move(name), std::move(pass), false});
+    return *this;
+  }
+
+  // Appends a pass that updates liveness as it rewrites, as add_node() does,
+  // so no dead_store_elimination() has to follow it.
+  PassManager& add(keeps_liveness_t, std::string name, Pass pass) {
+    passes_.push_back({std::move(name), std::move(pass), true});
+    return *this;
+  }
+
+  // Repeats the whole pipeline while a round still changes the IR, for at
+  // most `max_rounds` rounds.
+  PassManager& run_to_fixed_point(size_t max_rounds = 8) {
+    max_rounds_ = max_rounds;
+    return *this;
+  }
+
+  void run(IR& ir) {
+    stats_.assign(passes_.size(), {});
+    for (size_t p = 0; p < passes_.size(); p++) {
+      stats_[p].name = passes_[p].name;
+    }
+    rounds_ = 0;
+    bool changed = true;
+    while (changed && rounds_ < max_rounds_) {
+      changed = false;
+      for (size_t p = 0; p < passes_.size(); p++) {
+        size_t live = ir.live_count();
+        auto start = std::chrono::steady_clock::now();
+        size_t rewritten = passes_[p].run(ir);
+        if (rewritten > 0 && !passes_[p].keeps_liveness) {
+          ir.dead_store_elimination();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        size_t removed = live - ir.live_count();
+
+        PassStats& stats = stats_[p];
+        stats.runs++;
+        stats.wall_time += elapsed;
+        stats.nodes_removed += removed;
+        stats.nodes_rewritten += rewritten;
+        changed |= rewritten > 0 || removed > 0;
+      }
+      rounds_++;
+    }
+  }
+
+  // Per pass, in pipeline order, for the last run().
+  const std::vector<PassStats>& stats() const {
+    return stats_;
+  }
+
+  size_t rounds() const {
+    return rounds_;
+  }
+
+private:
+  struct Entry {
+    std::string name;
+    Pass run;
+    bool keeps_liveness;
+  };
+
+  std::vector<Entry> passes_;
+  size_t max_rounds_ = 1;
+  std::vector<PassStats> stats_;
+  size_t rounds_ = 0;
+};
+
+inline void IR::optimize() {
+  PassManager::standard().run(*this);
+}
+
+// Context for managing program scopes. Each thread has its own stack, so
+// threads can build separate Programs concurrently.
 class Context {
 private:
   std::stack<Program*> program_stack_;
 
   static Context& instance() {
-    static Context ctx;
+    thread_local Context ctx;
     return ctx;
   }
 
@@ -304,16 +1697,33 @@ public:
 // Program to build the graph
 class Program {
 private:
+  // Owns all IR node storage and is released in one shot with the Program,
+  // so it is declared first.
+  Arena arena_;
+  std::shared_ptr<SymbolTable> symbols_;
   IR ir_;
-  std::unordered_set<std::string> var_names_;
+  // Indexed by Symbol
+  std::vector<bool> var_names_;
+  // Indexed by op Symbol: how many results of that op were named so far.
+  std::vector<size_t> op_counters_;
+  std::string name_buffer_;
+  mutable PassManager passes_ = PassManager::standard();
+  // What graph() optimizes: a copy of ir_ kept up with it, and the arena
+  // the passes allocate from. Reset when the pipeline changes.
+  mutable std::unique_ptr<Arena> scratch_;
+  mutable std::unique_ptr<IR> optimized_;
+  mutable Graph graph_;
+  mutable size_t graph_version_ = std::numeric_limits<size_t>::max();
 
 public:
-  Program() = default;
+  Program()
+      : symbols_(std::make_shared<SymbolTable>()), ir_(symbols_, arena_) {}
 
+  // Input and output lists are allocated from the Program's arena.
   struct PendingNode {
-    std::string op_name;
-    std::vector<std::string> inputs;
-    std::vector<std::string> outputs;
+    Symbol op_name = kNoSymbol;
+    Span<Symbol> inputs;
+    Span<Symbol> outputs;
   };
 
   template <typename T>
@@ -328,22 +1738,101 @@ public:
     ir_.add_node(IRNode(pending.op_name, pending.inputs, pending.outputs));
   }
 
-  Graph graph() const {
-    auto ir_copy = ir_;
-    ir_copy.optimize();
-    return ir_copy.to_graph();
+  Arena& arena() {
+    return arena_;
+  }
+
+  const SymbolTable& symbols() const {
+    return *symbols_;
+  }
+
+  Symbol intern(std::string_view text) {
+    return symbols_->intern(text);
   }
 
-  void register_var_name(const std::string& name) {
-    if (name != "__var" && var_names_.find(name) != var_names_.end()) {
+  // Interns an op name; invocations of an impure op are never merged.
+  Symbol register_op(std::string_view name, bool pure) {
+    Symbol op = symbols_->intern(name);
+    if (!pure) {
+      ir_.mark_impure(op);
+    }
+    return op;
+  }
+
+  // The optimized graph. It is cached and only rebuilt after nodes were
+  // added; liveness is kept up to date by the IR as nodes come in, so
+  // rebuilding only runs the rewriting passes.
+  //
+  // Passes rewrite a copy, so the IR itself can keep growing. The copy is
+  // kept, and a rebuild only appends the nodes added since to it, unless
+  // they read what the passes optimized away.
+  const Graph& graph() const {
+    if (graph_version_ != ir_.version()) {
+      if (!optimized_ || !optimized_->append_from(ir_, optimized_->size())) {
+        optimized_.reset();
+        scratch_ = std::make_unique<Arena>();
+        optimized_ = std::make_unique<IR>(ir_, *scratch_);
+      }
+      passes_.run(*optimized_);
+      graph_ = optimized_->to_graph();
+      graph_version_ = ir_.version();
+    }
+    return graph_;
+  }
+
+  // The passes graph() runs. Getting them invalidates the cached graph, so
+  // the next graph() call runs the changed pipeline on a fresh copy.
+  PassManager& passes() {
+    graph_version_ = std::numeric_limits<size_t>::max();
+    optimized_.reset();
+    return passes_;
+  }
+
+  // What each pass did the last time graph() was rebuilt.
+  const std::vector<PassStats>& pass_stats() const {
+    return passes_.stats();
+  }
+
+  // "__var" names an anonymous variable, which gets a fresh symbol each time.
+  Symbol register_var_name(const std::string& name) {
+    if (name == "__var") {
+      return symbols_->make_anonymous();
+    }
+    Symbol sym = symbols_->intern(name);
+    if (sym >= var_names_.size()) {
+      var_names_.resize(symbols_->size(), false);
+    }
+    if (var_names_[sym]) {
       throw std::runtime_error("Var name already exists: " + name);
     }
-    var_names_.insert(name);
+    var_names_[sym] = true;
+    return sym;
+  }
+
+  // Registers "<op>_<n>/output" for the n-th result of `op` in this program,
+  // the name an op result carries until it is assigned to a variable. The
+  // text is formatted into a reused buffer, so this does not allocate per
+  // call.
+  Symbol register_output_name(Symbol op) {
+    if (op >= op_counters_.size()) {
+      op_counters_.resize(symbols_->size(), 0);
+    }
+    char digits[24];
+    auto end = std::to_chars(std::begin(digits), std::end(digits),
+                             op_counters_[op]++);
+    name_buffer_.assign(symbols_->name(op));
+    name_buffer_ += '_';
+    name_buffer_.append(digits, end.ptr);
+    name_buffer_ += "/output";
+    Symbol sym = register_var_name(name_buffer_);
+    symbols_->mark_generated(sym);
+    return sym;
   }
 
-  void register_placeholder(const std::string& name) {
-    register_var_name(name);
-    ir_.add_placeholder(name);
+  Symbol register_placeholder(const std::string& name) {
+    Symbol sym = register_var_name(name);
+    ir_.add_placeholder(sym);
+    return sym;
   }
 };
 
@@ -351,23 +1840,37 @@ public:
 struct placeholder_t {};
 [[maybe_unused]] static constexpr placeholder_t placeholder{};
 
+// Tag for ops that must run once per invocation, e.g. because they have side
+// effects or are nondeterministic
+struct impure_t {};
+[[maybe_unused]] static constexpr impure_t impure{};
+
 // Variable wrapper class
 template <typename T>
 class Var {
 private:
-  std::string name_;
+  Symbol symbol_;
+  // The table of the Program the variable was declared in
+  const SymbolTable* symbols_;
   Program::PendingNode pending_node_;
   bool has_pending_ = false;
 
+  struct registered_t {};
+  Var(registered_t, Symbol symbol)
+      : symbol_(symbol), symbols_(&Context::current_program().symbols()) {}
+
 public:
-  explicit Var(const std::string& name = "__var") : name_(name) {
-    if (name != "__var") {
-      Context::current_program().register_var_name(name);
-    }
-  }
+  explicit Var(const std::string& name = "__var")
+      : symbol_(Context::current_program().register_var_name(name)),
+        symbols_(&Context::current_program().symbols()) {}
+
+  Var(placeholder_t, const std::string& name)
+      : symbol_(Context::current_program().register_placeholder(name)),
+        symbols_(&Context::current_program().symbols()) {}
 
-  Var(placeholder_t, const std::string& name) : name_(name) {
-    Context::current_program().register_placeholder(name);
+  // Wraps a symbol that is already registered with the current program.
+  static Var from_symbol(Symbol symbol) {
+    return Var(registered_t{}, symbol);
   }
 
   // Make copy constructor not available
@@ -377,20 +1880,22 @@ public:
   Var(Var&& other) = default;
 
   Var& operator=(const Var& other) {
+    Program& prog = Context::current_program();
     pending_node_ = other.pending_node_;
     if (pending_node_.outputs.empty()) {
-      pending_node_ = {"copy", {other.name()}, {name_}};
-    } else {
-      pending_node_.outputs = {name_};
+      pending_node_ = {prog.intern("copy"), prog.arena().copy({other.symbol()}),
+                       {}};
     }
+    // other's output list is shared, so allocate our own
+    pending_node_.outputs = prog.arena().copy({symbol_});
     has_pending_ = true;
     Context::current_program().add(*this);
     return *this;
   }
 
   Var& operator=(Var&& other) {
-    pending_node_ = std::move(other.pending_node_);
-    pending_node_.outputs = {name_};
+    pending_node_ = std::exchange(other.pending_node_, {});
+    pending_node_.outputs = Context::current_program().arena().copy({symbol_});
     has_pending_ = other.has_pending_;
     if (has_pending_) {
       Context::current_program().add(*this);
@@ -398,8 +1903,13 @@ public:
     return *this;
   }
 
-  const std::string& name() const {
-    return name_;
+  Symbol symbol() const {
+    return symbol_;
+  }
+
+  // Valid while the Program the variable was declared in is alive.
+  std::string_view name() const {
+    return symbols_->name(symbol_);
   }
 
   bool has_pending_node() const {
@@ -408,12 +1918,12 @@ public:
 
   Program::PendingNode take_pending_node() {
     has_pending_ = false;
-    return std::move(pending_node_);
+    return std::exchange(pending_node_, {});
   }
 
-  void set_pending_node(const std::string& op_name,
-                      const std::vector<std::string>& inputs) {
-    pending_node_ = {op_name, inputs, {name_}};
+  void set_pending_node(Symbol op_name, Span<Symbol> inputs) {
+    pending_node_ = {op_name, inputs,
+                     Context::current_program().arena().copy({symbol_})};
     has_pending_ = true;
   }
 
@@ -441,20 +1951,19 @@ public:
     if (has_pending_) {
       throw std::runtime_error("VarTuple already assigned");
     }
+    Arena& arena = Context::current_program().arena();
     pending_node_ = result.take_pending_node();
-    pending_node_.outputs.clear();
-    std::apply(
-        [&](auto&... vars) {
-          (pending_node_.outputs.push_back(vars.name()), ...);
-        },
+    pending_node_.outputs = std::apply(
+        [&](auto&... vars) { return arena.copy<Symbol>({vars.symbol()...}); },
         vars_);
     has_pending_ = true;
+    Context::current_program().add(*this);
     return *this;
   }
 
   Program::PendingNode take_pending_node() {
     has_pending_ = false;
-    return std::move(pending_node_);
+    return std::exchange(pending_node_, {});
   }
 
   template <typename OpType>
@@ -478,32 +1987,37 @@ class Op;
 template <typename R, typename... Args>
 class Op<R(Args...)> {
   std::string op_name_;
+  bool pure_ = true;
 
 public:
   explicit Op(const std::string& name) : op_name_(name) {}
+  Op(impure_t, const std::string& name) : op_name_(name), pure_(false) {}
 
   const std::string& name() const {
     return op_name_;
   }
 
-  static std::string get_next_var_name(const std::string& op_name) {
-    static std::unordered_map<std::string, size_t> op_counters;
-    return op_name + "_" + std::to_string(op_counters[op_name]++) + "/output";
+  // False for ops declared `impure`.
+  bool pure() const {
+    return pure_;
   }
 
   Var<R> operator()(const Var<Args>&... inputs) const {
-    std::vector<std::string> input_names{inputs.name()...};
-    Var<R> result(get_next_var_name(op_name_));
-    result.set_pending_node(op_name_, input_names);
+    Program& prog = Context::current_program();
+    Symbol op = prog.register_op(op_name_, pure_);
+    auto result = Var<R>::from_symbol(prog.register_output_name(op));
+    result.set_pending_node(op,
+                            prog.arena().copy<Symbol>({inputs.symbol()...}));
     return result;
   }
 
   Var<R> operator()(Var<R>&& input) const {
-    std::vector<std::string> input_names{input.name()};
-    Var<R> result(get_next_var_name(op_name_));
-    result.set_pending_node(op_name_, input_names);
+    Program& prog = Context::current_program();
+    Symbol op = prog.register_op(op_name_, pure_);
+    auto result = Var<R>::from_symbol(prog.register_output_name(op));
+    result.set_pending_node(op, prog.arena().copy({input.symbol()}));
     if (input.has_pending_node()) {
-      Context::current_program().add(input);
+      prog.add(input);
     }
     return result;
   }
@@ -512,17 +2026,19 @@ public:
 template <typename R, typename ArgT>
 class Op<R(Variadic<ArgT>)> {
   std::string op_name_;
+  bool pure_ = true;
 
 public:
   Op(const std::string& name) : op_name_(name) {}
+  Op(impure_t, const std::string& name) : op_name_(name), pure_(false) {}
 
   const std::string& name() const {
     return op_name_;
   }
 
-  static std::string get_next_var_name(const std::string& op_name) {
-    static std::unordered_map<std::string, size_t> op_counters;
-    return op_name + "_" + std::to_string(op_counters[op_name]++) + "/output";
+  // False for ops declared `impure`.
+  bool pure() const {
+    return pure_;
   }
 
   template <typename... Args>
@@ -530,12 +2046,10 @@ public:
     static_assert((std::is_same_v<Args, Var<ArgT>> && ...),
                   "All arguments must be of the same type Var<ArgT>");
 
-    std::vector<std::string> input_names;
-    input_names.reserve(sizeof...(args));
-    (input_names.push_back(args.name()), ...);
-
-    Var<R> result(get_next_var_name(op_name_));
-    result.set_pending_node(op_name_, input_names);
+    Program& prog = Context::current_program();
+    Symbol op = prog.register_op(op_name_, pure_);
+    auto result = Var<R>::from_symbol(prog.register_output_name(op));
+    result.set_pending_node(op, prog.arena().copy<Symbol>({args.symbol()...}));
     return result;
   }
 };
@@ -543,17 +2057,19 @@ public:
 template <typename R, typename FixedArgT, typename VarArgT>
 class Op<R(FixedArgT, Variadic<VarArgT>)> {
   std::string op_name_;
+  bool pure_ = true;
 
 public:
   Op(const std::string& name) : op_name_(name) {}
+  Op(impure_t, const std::string& name) : op_name_(name), pure_(false) {}
   
   const std::string& name() const {
     return op_name_;
   }
 
-  static std::string get_next_var_name(const std::string& op_name) {
-    static std::unordered_map<std::string, size_t> op_counters;
-    return op_name + "_" + std::to_string(op_counters[op_name]++) + "/output";
+  // False for ops declared `impure`.
+  bool pure() const {
+    return pure_;
   }
 
   template <typename... Args>
@@ -562,13 +2078,12 @@ public:
     static_assert((std::is_same_v<Args, Var<VarArgT>> && ...),
                   "All variadic arguments must be of type Var<VarArgT>");
 
-    std::vector<std::string> input_names;
-    input_names.reserve(1 + sizeof...(args));
-    input_names.push_back(fixed_arg.name());
-    (input_names.push_back(args.name()), ...);
-
-    Var<R> result(get_next_var_name(op_name_));
-    result.set_pending_node(op_name_, input_names);
+    Program& prog = Context::current_program();
+    Symbol op = prog.register_op(op_name_, pure_);
+    auto result = Var<R>::from_symbol(prog.register_output_name(op));
+    result.set_pending_node(
+        op,
+        prog.arena().copy<Symbol>({fixed_arg.symbol(), args.symbol()...}));
     return result;
   }
 };
@@ -577,17 +2092,19 @@ template <typename R, typename FixedArg1T, typename FixedArg2T,
           typename VarArgT>
 class Op<R(FixedArg1T, FixedArg2T, Variadic<VarArgT>)> {
   std::string op_name_;
+  bool pure_ = true;
 
 public:
   Op(const std::string& name) : op_name_(name) {}
+  Op(impure_t, const std::string& name) : op_name_(name), pure_(false) {}
   
   const std::string& name() const {
     return op_name_;
   }
 
-  static std::string get_next_var_name(const std::string& op_name) {
-    static std::unordered_map<std::string, size_t> op_counters;
-    return op_name + "_" + std::to_string(op_counters[op_name]++) + "/output";
+  // False for ops declared `impure`.
+  bool pure() const {
+    return pure_;
   }
 
   template <typename... Args>
@@ -597,14 +2114,12 @@ public:
     static_assert((std::is_same_v<Args, Var<VarArgT>> && ...),
                   "All variadic arguments must be of type Var<VarArgT>");
 
-    std::vector<std::string> input_names;
-    input_names.reserve(2 + sizeof...(args));
-    input_names.push_back(fixed_arg1.name());
-    input_names.push_back(fixed_arg2.name());
-    (input_names.push_back(args.name()), ...);
-
-    Var<R> result(get_next_var_name(op_name_));
-    result.set_pending_node(op_name_, input_names);
+    Program& prog = Context::current_program();
+    Symbol op = prog.register_op(op_name_, pure_);
+    auto result = Var<R>::from_symbol(prog.register_output_name(op));
+    result.set_pending_node(
+        op, prog.arena().copy<Symbol>(
+                {fixed_arg1.symbol(), fixed_arg2.symbol(), args.symbol()...}));
     return result;
   }
 };
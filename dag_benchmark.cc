@@ -1,20 +1,87 @@
+#include "batch_executor.h"
+#include "batcher.h"
 #include "dag.h"
+#include "executor.h"
+#include "memo.h"
+#include "parallel_executor.h"
+#include "scheduler.h"
+#include <algorithm>
+#include <atomic>
 #include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
 #include <string>
+#include <vector>
+
+// Count heap allocations so benchmarks can report allocations per node
+static std::atomic<size_t> g_allocations{0};
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+// std::pmr::new_delete_resource() allocates through the aligned forms
+__attribute__((noinline)) void* operator new(size_t size,
+                                             std::align_val_t align) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  size_t alignment = std::max(static_cast<size_t>(align), sizeof(void*));
+  size = (size + alignment - 1) / alignment * alignment;
+  if (void* p = std::aligned_alloc(alignment, size == 0 ? alignment : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p,
+                                               std::align_val_t) noexcept {
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t,
+                                               std::align_val_t) noexcept {
+  std::free(p);
+}
+
+// Reports heap allocations per built node since `start`
+static void ReportAllocations(benchmark::State& state, size_t start,
+                              size_t nodes_per_iteration) {
+  size_t allocations = g_allocations.load(std::memory_order_relaxed) - start;
+  state.counters["allocs_per_node"] = benchmark::Counter(
+      static_cast<double>(allocations) /
+      static_cast<double>(state.iterations() * nodes_per_iteration));
+}
 
 // Benchmark creating a simple linear DAG
 static void BM_LinearDAG(benchmark::State& state) {
   for (auto _ : state) {
+    Program p;
+    Context::Scope scope(&p);
+
     Op<int32_t(int32_t)> op1("op1"), op2("op2"), op3("op3");
-    Var<int32_t> input("input");
+    Var<int32_t> input(placeholder, "input");
     Var<int32_t> v1("v1"), v2("v2"), output("output");
 
-    Program p;
-    p.add(v1 = op1(input));
-    p.add(v2 = op2(v1));
-    p.add(output = op3(v2));
+    v1 = op1(input);
+    v2 = op2(v1);
+    output = op3(v2);
 
-    Graph g = p.graph();
+    const Graph& g = p.graph();
+    benchmark::DoNotOptimize(&g);
   }
 }
 BENCHMARK(BM_LinearDAG);
@@ -22,18 +89,21 @@ BENCHMARK(BM_LinearDAG);
 // Benchmark creating a DAG with multiple outputs
 static void BM_MultipleOutputsDAG(benchmark::State& state) {
   for (auto _ : state) {
+    Program p;
+    Context::Scope scope(&p);
+
     Op<std::tuple<int32_t, int32_t>(int32_t)> split_op("split_op");
     Op<int32_t(int32_t)> process_op("process_op");
 
-    Var<int32_t> input("input");
+    Var<int32_t> input(placeholder, "input");
     Var<int32_t> out1("out1"), out2("out2");
     Var<int32_t> final_out("final_out");
 
-    Program p;
-    p.add((out1, out2) = split_op(input));
-    p.add(final_out = process_op(out1));
+    (out1, out2) = split_op(input);
+    final_out = process_op(out1);
 
-    Graph g = p.graph();
+    const Graph& g = p.graph();
+    benchmark::DoNotOptimize(&g);
   }
 }
 BENCHMARK(BM_MultipleOutputsDAG);
@@ -41,43 +111,940 @@ BENCHMARK(BM_MultipleOutputsDAG);
 // Benchmark creating a wide DAG (many parallel operations)
 static void BM_WideDAG(benchmark::State& state) {
   const int width = state.range(0);
+  size_t allocations = g_allocations.load(std::memory_order_relaxed);
 
   for (auto _ : state) {
-    Op<int32_t(int32_t)> op("op");
-    Var<int32_t> input("input");
     Program p;
+    Context::Scope scope(&p);
+
+    Op<int32_t(int32_t)> op("op");
+    Var<int32_t> input(placeholder, "input");
 
     std::vector<Var<int32_t>> outputs;
+    outputs.reserve(width);
     for (int i = 0; i < width; ++i) {
       outputs.emplace_back("output_" + std::to_string(i));
-      p.add(outputs.back() = op(input));
+      outputs.back() = op(input);
     }
 
-    Graph g = p.graph();
+    const Graph& g = p.graph();
+    benchmark::DoNotOptimize(&g);
   }
+  state.SetItemsProcessed(state.iterations() * width);
+  ReportAllocations(state, allocations, width);
 }
 BENCHMARK(BM_WideDAG)->Range(8, 1024);
 
 // Benchmark creating a deep DAG (long chain of operations)
 static void BM_DeepDAG(benchmark::State& state) {
   const int depth = state.range(0);
+  size_t allocations = g_allocations.load(std::memory_order_relaxed);
 
   for (auto _ : state) {
-    Op<int32_t(int32_t)> op("op");
     Program p;
+    Context::Scope scope(&p);
 
-    Var<int32_t> input("input");
-    Var<int32_t> current = input;
+    Op<int32_t(int32_t)> op("op");
 
+    std::vector<Var<int32_t>> chain;
+    chain.reserve(depth + 1);
+    chain.emplace_back(placeholder, "input");
     for (int i = 0; i < depth; ++i) {
-      Var<int32_t> next("v_" + std::to_string(i));
-      p.add(next = op(current));
-      current = next;
+      chain.emplace_back("v_" + std::to_string(i));
+      chain.back() = op(chain[i]);
     }
 
-    Graph g = p.graph();
+    const Graph& g = p.graph();
+    benchmark::DoNotOptimize(&g);
   }
+  state.SetItemsProcessed(state.iterations() * depth);
+  ReportAllocations(state, allocations, depth);
 }
 BENCHMARK(BM_DeepDAG)->Range(8, 1024);
 
-BENCHMARK_MAIN();
\ No newline at end of file
+// Benchmark calling Program::graph() again without adding nodes
+static void BM_CachedGraph(benchmark::State& state) {
+  Program p;
+  Context::Scope scope(&p);
+  Op<int32_t(int32_t)> op("op");
+  Var<int32_t> input(placeholder, "input");
+  std::vector<Var<int32_t>> outputs;
+  outputs.reserve(1024);
+  for (int i = 0; i < 1024; ++i) {
+    outputs.emplace_back("output_" + std::to_string(i));
+    outputs.back() = op(input);
+  }
+  p.graph();
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(&p.graph());
+  }
+}
+BENCHMARK(BM_CachedGraph);
+
+// Benchmark rebuilding the graph of a program with `size` nodes after one
+// more node was added to it
+static void BM_GraphRebuild(benchmark::State& state) {
+  const int size = state.range(0);
+  Op<int32_t(int32_t)> op("op");
+  for (auto _ : state) {
+    state.PauseTiming();
+    {
+      Program p;
+      Context::Scope scope(&p);
+      Var<int32_t> input(placeholder, "input");
+      std::vector<Var<int32_t>> outputs;
+      outputs.reserve(size);
+      for (int i = 0; i < size; ++i) {
+        outputs.emplace_back("output_" + std::to_string(i));
+        outputs.back() = op(input);
+      }
+      p.graph();
+      Var<int32_t> last("last");
+      last = op(outputs[0]);
+      state.ResumeTiming();
+      benchmark::DoNotOptimize(&p.graph());
+      state.PauseTiming();
+    }
+    state.ResumeTiming();
+  }
+}
+BENCHMARK(BM_GraphRebuild)->Range(1 << 8, 1 << 14);
+
+// Benchmark the indexed Graph queries, visiting every node and edge once
+static void BM_GraphQueries(benchmark::State& state) {
+  const int width = state.range(0);
+
+  Program p;
+  Context::Scope scope(&p);
+  Op<int32_t(int32_t)> op("op");
+  Op<int32_t(int32_t, int32_t)> join("join");
+  Var<int32_t> input(placeholder, "input");
+  std::vector<Var<int32_t>> heads;
+  heads.reserve(width);
+  for (int i = 0; i < width; ++i) {
+    heads.emplace_back("head_" + std::to_string(i));
+    heads.back() = op(input);
+  }
+  std::vector<Var<int32_t>> joins;
+  joins.reserve(width);
+  for (int i = 0; i < width; ++i) {
+    joins.emplace_back("join_" + std::to_string(i));
+    joins.back() = join(heads[i], heads[(i + 1) % width]);
+  }
+  const Graph& g = p.graph();
+
+  for (auto _ : state) {
+    size_t edges = 0;
+    for (NodeId node = 0; node < g.node_count(); ++node) {
+      edges += g.successors(node).size() + g.predecessors(node).size();
+      for (Symbol input : g.inputs(node)) {
+        benchmark::DoNotOptimize(g.producer_of(input));
+        edges += g.consumers_of(input).size();
+      }
+    }
+    benchmark::DoNotOptimize(edges);
+  }
+  state.SetItemsProcessed(state.iterations() * g.node_count());
+}
+BENCHMARK(BM_GraphQueries)->Range(1 << 10, 1 << 14);
+
+// Benchmark dead store elimination alone on a deep chain of anonymous
+// temporaries, which should scale linearly with the number of nodes
+static void BM_DeadStoreElimination(benchmark::State& state) {
+  const int depth = state.range(0);
+
+  auto symbols = std::make_shared<SymbolTable>();
+  Arena arena;
+  IR ir(symbols, arena);
+  Symbol op = symbols->intern("op");
+  Symbol prev = symbols->intern("input");
+  ir.add_placeholder(prev);
+  for (int i = 0; i < depth; ++i) {
+    Symbol next =
+        i + 1 == depth ? symbols->intern("output") : symbols->make_anonymous();
+    ir.add_node(IRNode(op, arena.copy({prev}), arena.copy({next})));
+    prev = next;
+  }
+
+  for (auto _ : state) {
+    ir.dead_store_elimination();
+  }
+  state.SetItemsProcessed(state.iterations() * depth);
+  state.SetComplexityN(depth);
+}
+BENCHMARK(BM_DeadStoreElimination)
+    ->RangeMultiplier(4)
+    ->Range(1 << 10, 1 << 20)
+    ->Complexity(benchmark::oN);
+
+// Benchmark the standard pass pipeline on a graph where most invocations are
+// duplicates and every result is copied into a named output. Reports the time
+// each pass takes per node.
+static void BM_OptimizePasses(benchmark::State& state) {
+  const int width = state.range(0);
+  const int distinct = width / 4;
+
+  auto symbols = std::make_shared<SymbolTable>();
+  Arena arena;
+  IR base(symbols, arena);
+  Symbol op = symbols->intern("op");
+  Symbol copy = symbols->intern("copy");
+  std::vector<Symbol> inputs;
+  for (int i = 0; i < distinct; ++i) {
+    inputs.push_back(symbols->intern("input_" + std::to_string(i)));
+    base.add_placeholder(inputs.back());
+  }
+  for (int i = 0; i < width; ++i) {
+    Symbol tmp = symbols->make_anonymous();
+    Symbol output = symbols->intern("output_" + std::to_string(i));
+    base.add_node(IRNode(op, arena.copy({inputs[i % distinct]}),
+                         arena.copy({tmp})));
+    base.add_node(IRNode(copy, arena.copy({tmp}), arena.copy({output})));
+  }
+
+  PassManager passes = PassManager::standard();
+  std::vector<double> nanos;
+  for (auto _ : state) {
+    Arena scratch;
+    IR ir(base, scratch);
+    passes.run(ir);
+    nanos.resize(passes.stats().size());
+    for (size_t p = 0; p < nanos.size(); ++p) {
+      nanos[p] += passes.stats()[p].wall_time.count();
+    }
+  }
+  const double nodes = static_cast<double>(state.iterations()) * base.size();
+  for (size_t p = 0; p < nanos.size(); ++p) {
+    state.counters[passes.stats()[p].name + "_ns_per_node"] = nanos[p] / nodes;
+  }
+  state.SetItemsProcessed(state.iterations() * base.size());
+}
+BENCHMARK(BM_OptimizePasses)->Range(1 << 8, 1 << 14);
+
+// Benchmark running the BM_LinearDAG graph on the sequential executor, one
+// request per iteration
+static void BM_SequentialExecutor(benchmark::State& state) {
+  Program p;
+  Context::Scope scope(&p);
+
+  Op<int32_t(int32_t)> op1("op1"), op2("op2"), op3("op3");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> v1("v1"), v2("v2"), output("output");
+  v1 = op1(input);
+  v2 = op2(v1);
+  output = op3(v2);
+
+  KernelRegistry kernels;
+  kernels.add(op1, [](int32_t x) { return x + 1; });
+  kernels.add(op2, [](int32_t x) { return x * 2; });
+  kernels.add(op3, [](int32_t x) { return x - 3; });
+  SequentialExecutor exec(p.graph(), kernels);
+
+  int32_t i = 0;
+  for (auto _ : state) {
+    exec.feed(input, i++);
+    exec.run();
+    benchmark::DoNotOptimize(exec.fetch(output));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SequentialExecutor);
+
+// Benchmark kernels producing containers of strings, allocating from the
+// executor's RequestArena (arena:1) or from the default resource (arena:0).
+// Reports heap allocations per request.
+static void BM_RequestArena(benchmark::State& state) {
+  using Words = std::pmr::vector<std::pmr::string>;
+  const bool use_arena = state.range(0);
+  Program p;
+  Context::Scope scope(&p);
+
+  Op<Words(int32_t)> make_words("make_words");
+  Op<int32_t(Words)> count_chars("count_chars");
+  Var<int32_t> input(placeholder, "input");
+  Var<Words> words("words");
+  Var<int32_t> output("output");
+  words = make_words(input);
+  output = count_chars(words);
+
+  KernelRegistry kernels;
+  kernels.add(make_words, [use_arena](int32_t n) {
+    Words result(use_arena ? RequestArena::current()
+                           : std::pmr::get_default_resource());
+    for (int i = 0; i < 16; ++i) {
+      result.emplace_back("a string too long for the small string buffer");
+      result.back() += std::to_string(n + i);
+    }
+    return result;
+  });
+  kernels.add(count_chars, [](const Words& w) {
+    int32_t total = 0;
+    for (const auto& word : w) {
+      total += static_cast<int32_t>(word.size());
+    }
+    return total;
+  });
+  SequentialExecutor exec(p.graph(), kernels);
+
+  int32_t i = 0;
+  size_t allocations = 0;
+  for (auto _ : state) {
+    exec.feed(input, i++);
+    size_t before = g_allocations.load(std::memory_order_relaxed);
+    exec.run();
+    allocations += g_allocations.load(std::memory_order_relaxed) - before;
+    benchmark::DoNotOptimize(exec.fetch(output));
+  }
+  state.counters["allocs_per_request"] = benchmark::Counter(
+      static_cast<double>(allocations) / state.iterations());
+}
+BENCHMARK(BM_RequestArena)->ArgName("arena")->Arg(0)->Arg(1);
+
+// Benchmark a chain of 8 kernels that each modify a 64K element vector,
+// taking it with In<T>::take() (move:1), which moves it along the chain, or
+// copying it from a `const T&` (move:0).
+static void BM_LastUseMove(benchmark::State& state) {
+  using Gids = std::vector<int64_t>;
+  const bool move = state.range(0);
+  Program p;
+  Context::Scope scope(&p);
+
+  Op<Gids(int32_t)> make_gids("make_gids");
+  Op<Gids(Gids)> bump("bump");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  Var<Gids> gids;
+  gids = make_gids(input);
+  for (int i = 0; i < 8; ++i) {
+    Var<Gids> next;
+    next = bump(gids);
+    gids = next;
+  }
+  Op<int32_t(Gids)> size_op("size_op");
+  output = size_op(gids);
+
+  KernelRegistry kernels;
+  kernels.add(make_gids, [](int32_t n) { return Gids(1 << 16, n); });
+  if (move) {
+    kernels.add(bump, [](In<Gids> in) {
+      Gids result = in.take();
+      result[0]++;
+      return result;
+    });
+  } else {
+    kernels.add(bump, [](const Gids& in) {
+      Gids result = in;
+      result[0]++;
+      return result;
+    });
+  }
+  kernels.add(size_op,
+              [](const Gids& in) { return static_cast<int32_t>(in.size()); });
+  SequentialExecutor exec(p.graph(), kernels);
+
+  int32_t i = 0;
+  size_t allocations = 0;
+  for (auto _ : state) {
+    exec.feed(input, i++);
+    size_t before = g_allocations.load(std::memory_order_relaxed);
+    exec.run();
+    allocations += g_allocations.load(std::memory_order_relaxed) - before;
+    benchmark::DoNotOptimize(exec.fetch(output));
+  }
+  state.counters["allocs_per_request"] = benchmark::Counter(
+      static_cast<double>(allocations) / state.iterations());
+}
+BENCHMARK(BM_LastUseMove)->ArgName("move")->Arg(0)->Arg(1);
+
+// Benchmark serving each request with a new executor, built on a state
+// leased from an ExecutionStatePool (pool:1) or on a fresh state (pool:0).
+// The graph only produces ints, so with the pool a request should not
+// allocate at all.
+static void BM_PooledRequest(benchmark::State& state) {
+  const bool pooled = state.range(0);
+  Program p;
+  Context::Scope scope(&p);
+
+  Op<int32_t(int32_t)> op1("op1"), op2("op2");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> v1("v1"), v2("v2"), output("output");
+  v1 = op1(input);
+  v2 = op2(input);
+  output = add(v1, v2);
+
+  KernelRegistry kernels;
+  kernels.add(op1, [](int32_t x) { return x + 1; });
+  kernels.add(op2, [](int32_t x) { return x * 2; });
+  kernels.add(add, [](int32_t a, int32_t b) { return a + b; });
+  auto plan = ExecutionPlan::compile(p.graph(), kernels);
+  ExecutionStatePool pool(plan);
+
+  int32_t i = 0;
+  size_t allocations = g_allocations.load(std::memory_order_relaxed);
+  for (auto _ : state) {
+    std::optional<SequentialExecutor> exec;
+    if (pooled) {
+      exec.emplace(pool);
+    } else {
+      exec.emplace(plan);
+    }
+    exec->feed(input, i++);
+    exec->run();
+    benchmark::DoNotOptimize(exec->fetch(output));
+  }
+  allocations = g_allocations.load(std::memory_order_relaxed) - allocations;
+  state.counters["allocs_per_request"] = benchmark::Counter(
+      static_cast<double>(allocations) / state.iterations());
+}
+BENCHMARK(BM_PooledRequest)->ArgName("pool")->Arg(0)->Arg(1);
+
+// Benchmark many threads serving requests from one shared ExecutionPlan, each
+// with its own executor. Items/s should grow with the thread count.
+static void BM_SharedPlan(benchmark::State& state) {
+  constexpr int kDepth = 64;
+  struct Shared {
+    Op<int32_t(int32_t)> op{"op"};
+    Program p;
+    KernelRegistry kernels;
+    std::optional<Var<int32_t>> input, output;
+    std::shared_ptr<const ExecutionPlan> plan;
+  };
+  // Compiled once, by whichever thread gets here first
+  static const Shared* shared = [] {
+    auto* s = new Shared;
+    Context::Scope scope(&s->p);
+    s->input.emplace(placeholder, "input");
+    s->output.emplace("output");
+    *s->output = *s->input;
+    for (int i = 0; i < kDepth; ++i) {
+      *s->output = s->op(*s->output);
+    }
+    s->kernels.add(s->op, [](int32_t x) { return x + 1; });
+    s->plan = ExecutionPlan::compile(s->p.graph(), s->kernels);
+    return s;
+  }();
+
+  SequentialExecutor exec(shared->plan);
+  int32_t i = 0;
+  for (auto _ : state) {
+    exec.feed(*shared->input, i++);
+    exec.run();
+    benchmark::DoNotOptimize(exec.fetch(*shared->output));
+  }
+  state.SetItemsProcessed(state.iterations() * kDepth);
+}
+BENCHMARK(BM_SharedPlan)->ThreadRange(1, 8)->UseRealTime();
+
+// About half a microsecond of work for one kernel call
+static int32_t Spin(int32_t x) {
+  uint32_t h = static_cast<uint32_t>(x);
+  for (int i = 0; i < 400; ++i) {
+    h = h * 2654435761u + 1;
+  }
+  benchmark::DoNotOptimize(h);
+  return x + 1;
+}
+
+enum GraphShape { kWide, kDeep, kDiamond };
+
+// Builds a graph of about `nodes` Spin nodes
+static std::shared_ptr<const ExecutionPlan>
+BuildShape(GraphShape shape, int nodes, const Var<int32_t>& input) {
+  // Impure, so that identical invocations are not merged
+  static const Op<int32_t(int32_t)> work(impure, "work");
+  static const Op<int32_t(int32_t, int32_t)> join("join");
+  static const KernelRegistry* kernels = [] {
+    auto* registry = new KernelRegistry;
+    registry->add(work, Spin);
+    registry->add(join, [](int32_t a, int32_t b) { return Spin(a + b); });
+    return registry;
+  }();
+
+  std::vector<Var<int32_t>> outputs;
+  outputs.reserve(nodes);
+  if (shape == kWide) {
+    for (int i = 0; i < nodes; ++i) {
+      outputs.emplace_back("output_" + std::to_string(i));
+      outputs.back() = work(input);
+    }
+  } else if (shape == kDeep) {
+    outputs.emplace_back("output");
+    outputs.back() = input;
+    for (int i = 0; i < nodes; ++i) {
+      outputs.back() = work(outputs.back());
+    }
+  } else {
+    // input -> (work, work) -> join -> (work, work) -> join ...
+    outputs.emplace_back("output");
+    outputs.back() = input;
+    for (int i = 0; i < nodes / 3; ++i) {
+      Var<int32_t> left, right;
+      left = work(outputs.back());
+      right = work(outputs.back());
+      outputs.back() = join(left, right);
+    }
+  }
+  return ExecutionPlan::compile(Context::current_program().graph(), *kernels);
+}
+
+// Benchmark the work-stealing executor on wide, deep and diamond graphs of
+// 256 Spin nodes, from 1 to 8 threads. Wide and diamond graphs
+// should scale with the thread count up to the number of cores; a deep
+// chain cannot, and shows the scheduling overhead instead.
+static void BM_ParallelExecutor(benchmark::State& state) {
+  constexpr int kNodes = 256;
+  Program p;
+  Context::Scope scope(&p);
+  Var<int32_t> input(placeholder, "input");
+  auto plan = BuildShape(static_cast<GraphShape>(state.range(0)), kNodes,
+                         input);
+
+  ParallelExecutor exec(plan, state.range(1));
+  int32_t i = 0;
+  for (auto _ : state) {
+    exec.feed(input, i++);
+    exec.run();
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          plan->instructions().size());
+}
+BENCHMARK(BM_ParallelExecutor)
+    ->ArgNames({"shape", "threads"})
+    ->ArgsProduct({{kWide, kDeep, kDiamond}, {1, 2, 4, 8}})
+    ->UseRealTime();
+
+// Benchmark the scheduler alone, without kernels: one root fanning out to
+// `fan_out` nodes, every node taken with next() and finished with complete()
+// on one worker. Reports the scheduling cost per node.
+static void BM_SchedulerFanOut(benchmark::State& state) {
+  const int fan_out = state.range(0);
+  Program p;
+  Context::Scope scope(&p);
+
+  static const Op<int32_t(int32_t)> root("root");
+  // Impure, so that identical invocations are not merged
+  static const Op<int32_t(int32_t)> leaf(impure, "leaf");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> spread("spread");
+  spread = root(input);
+  std::vector<Var<int32_t>> outputs;
+  outputs.reserve(fan_out);
+  for (int i = 0; i < fan_out; ++i) {
+    outputs.emplace_back("output_" + std::to_string(i));
+    outputs.back() = leaf(spread);
+  }
+
+  KernelRegistry kernels;
+  kernels.add(root, [](int32_t x) { return x; });
+  kernels.add(leaf, [](int32_t x) { return x; });
+  auto plan = ExecutionPlan::compile(p.graph(), kernels);
+  Scheduler scheduler(*plan, 1);
+
+  for (auto _ : state) {
+    scheduler.reset();
+    uint32_t instr;
+    while (scheduler.next(0, instr)) {
+      scheduler.complete(0, instr);
+    }
+    benchmark::DoNotOptimize(scheduler.done());
+  }
+  const double nodes = plan->instructions().size();
+  state.SetItemsProcessed(state.iterations() * nodes);
+  state.counters["ns_per_node"] = benchmark::Counter(
+      state.iterations() * nodes,
+      benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+BENCHMARK(BM_SchedulerFanOut)->Range(16, 4096);
+
+// Benchmark a 64-node chain of Spin kernels run without a token (0), with a
+// token that never fires (1), and with one cancelled by the 16th kernel (2).
+// 1 against 0 is the cost of checking the token before every node; 2 shows
+// the time saved by skipping the rest.
+static void BM_Cancellation(benchmark::State& state) {
+  constexpr int kDepth = 64;
+  const int mode = state.range(0);
+  Program p;
+  Context::Scope scope(&p);
+
+  Op<int32_t(int32_t)> op("op");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  output = input;
+  for (int i = 0; i < kDepth; ++i) {
+    output = op(output);
+  }
+
+  CancellationToken* token = nullptr;
+  int calls = 0;
+  KernelRegistry kernels;
+  kernels.add(op, [&](int32_t x) {
+    if (mode == 2 && ++calls == kDepth / 4) {
+      token->cancel();
+    }
+    return Spin(x);
+  });
+  SequentialExecutor exec(p.graph(), kernels);
+
+  int32_t i = 0;
+  size_t skipped = 0;
+  for (auto _ : state) {
+    exec.feed(input, i++);
+    if (mode == 0) {
+      exec.run();
+      continue;
+    }
+    CancellationToken request;
+    token = &request;
+    calls = 0;
+    try {
+      exec.run(request);
+    } catch (const CancelledError&) {
+    }
+    skipped += exec.run_stats().nodes_skipped;
+  }
+  state.counters["skipped_per_run"] = benchmark::Counter(
+      static_cast<double>(skipped) / state.iterations());
+}
+BENCHMARK(BM_Cancellation)->ArgName("mode")->DenseRange(0, 2);
+
+// A model call: a fixed cost per call, about 10us, and a small one per row
+static std::vector<int32_t> PredictBatch(const std::vector<int32_t>& rows) {
+  int32_t warmup = 0;
+  for (int i = 0; i < 20; ++i) {
+    warmup = Spin(warmup);
+  }
+  std::vector<int32_t> scores;
+  for (int32_t row : rows) {
+    scores.push_back(Spin(row) + warmup);
+  }
+  return scores;
+}
+
+// Benchmark requests from 1 to 8 threads calling a model op one request at
+// a time (batch:0), or through a Batcher of up to 8 rows with a 200us
+// window (batch:1). Items/s is the throughput; time per iteration is the
+// latency of a request, which a partial batch pays the window for.
+static void BM_Batching(benchmark::State& state) {
+  struct Shared {
+    Op<int32_t(int32_t)> predict{"predict"};
+    Program p;
+    KernelRegistry unbatched, batched;
+    std::optional<Var<int32_t>> input, score;
+    std::shared_ptr<const ExecutionPlan> plans[2];
+  };
+  static const Shared* shared = [] {
+    auto* s = new Shared;
+    Context::Scope scope(&s->p);
+    s->input.emplace(placeholder, "input");
+    s->score.emplace("score");
+    *s->score = s->predict(*s->input);
+    s->unbatched.add(s->predict,
+                     [](int32_t x) { return PredictBatch({x})[0]; });
+    add_batch_kernel(s->batched, s->predict, PredictBatch,
+                     {.max_batch_size = 8,
+                      .window = std::chrono::microseconds(200)});
+    s->plans[0] = ExecutionPlan::compile(s->p.graph(), s->unbatched);
+    s->plans[1] = ExecutionPlan::compile(s->p.graph(), s->batched);
+    return s;
+  }();
+
+  SequentialExecutor exec(shared->plans[state.range(0)]);
+  int32_t i = 0;
+  for (auto _ : state) {
+    exec.feed(*shared->input, i++);
+    exec.run();
+    benchmark::DoNotOptimize(exec.fetch(*shared->score));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Batching)
+    ->ArgName("batch")
+    ->Arg(0)
+    ->Arg(1)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// An affine kernel with a vectorized overload
+struct Affine {
+  float a, b;
+
+  float operator()(float x) const {
+    return a * x + b;
+  }
+
+  Batch<float> operator()(const Batch<float>& xs) const {
+    Batch<float> ys(xs.size());
+    const float* in = xs.data();
+    float* out = ys.data();
+    for (size_t i = 0; i < xs.size(); i++) {
+      out[i] = a * in[i] + b;
+    }
+    return ys;
+  }
+};
+
+// Benchmark scoring 4096 rows through a 16-node chain of cheap float ops:
+// one SequentialExecutor run per row (mode:0), a BatchExecutor calling the
+// kernels row by row (mode:1), and a BatchExecutor calling their vectorized
+// overloads (mode:2).
+static void BM_BatchExecutor(benchmark::State& state) {
+  constexpr int kDepth = 16;
+  constexpr size_t kRows = 4096;
+  const int mode = state.range(0);
+  Program p;
+  Context::Scope scope(&p);
+
+  std::vector<Op<float(float)>> ops;
+  for (int i = 0; i < kDepth; ++i) {
+    ops.emplace_back("affine_" + std::to_string(i));
+  }
+  Var<float> input(placeholder, "input");
+  Var<float> output("output");
+  output = input;
+  for (int i = 0; i < kDepth; ++i) {
+    output = ops[i](output);
+  }
+
+  KernelRegistry kernels;
+  for (int i = 0; i < kDepth; ++i) {
+    Affine affine{1.0f + i * 0.01f, 0.5f};
+    if (mode == 2) {
+      kernels.add(ops[i], affine);
+    } else {
+      kernels.add(ops[i], [affine](float x) { return affine(x); });
+    }
+  }
+  auto plan = ExecutionPlan::compile(p.graph(), kernels);
+
+  Batch<float> column(kRows);
+  for (size_t i = 0; i < kRows; ++i) {
+    column[i] = static_cast<float>(i);
+  }
+  if (mode == 0) {
+    SequentialExecutor exec(plan);
+    for (auto _ : state) {
+      for (float x : column) {
+        exec.feed(input, x);
+        exec.run();
+        benchmark::DoNotOptimize(exec.fetch(output));
+      }
+    }
+  } else {
+    BatchExecutor exec(plan);
+    exec.feed(input, column);
+    for (auto _ : state) {
+      exec.run();
+      benchmark::DoNotOptimize(exec.fetch(output).data());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kRows);
+}
+BENCHMARK(BM_BatchExecutor)->ArgName("mode")->DenseRange(0, 2);
+
+// A weighting kernel with a vectorized overload
+struct Weigh {
+  float operator()(float x, float w) const {
+    return x * w;
+  }
+
+  Batch<float> operator()(const Batch<float>& xs,
+                          const Batch<float>& ws) const {
+    Batch<float> ys(xs.size());
+    for (size_t i = 0; i < xs.size(); i++) {
+      ys[i] = xs[i] * ws[i];
+    }
+    return ys;
+  }
+};
+
+// Benchmark running a wide graph of 1024 op(embedding, weight_i) heads: one
+// node per head (mode:0), the heads fused into one node calling the kernel
+// per head (mode:1), and fused into one vectorized call (mode:2).
+static void BM_HorizontalFusion(benchmark::State& state) {
+  constexpr int kWidth = 1024;
+  const int mode = state.range(0);
+  Program p;
+  Context::Scope scope(&p);
+
+  Op<float(float)> embed("embed");
+  Op<float(float, float)> weigh("weigh");
+  Var<float> input(placeholder, "input");
+  Var<float> embedding("embedding");
+  embedding = embed(input);
+  std::vector<Var<float>> weights, heads;
+  weights.reserve(kWidth);
+  heads.reserve(kWidth);
+  for (int i = 0; i < kWidth; ++i) {
+    weights.emplace_back(placeholder, "weight_" + std::to_string(i));
+    heads.emplace_back("head_" + std::to_string(i));
+    heads.back() = weigh(embedding, weights.back());
+  }
+
+  auto kernels = std::make_shared<KernelRegistry>();
+  kernels->add(embed, [](float x) { return x + 1.0f; });
+  if (mode == 2) {
+    kernels->add(weigh, Weigh());
+  } else {
+    kernels->add(weigh, [](float x, float w) { return Weigh()(x, w); });
+  }
+  if (mode != 0) {
+    p.passes().add("horizontal_fusion", horizontal_fusion(kernels));
+  }
+
+  SequentialExecutor exec(p.graph(), *kernels);
+  exec.feed(input, 1.0f);
+  for (int i = 0; i < kWidth; ++i) {
+    exec.feed(weights[i], static_cast<float>(i));
+  }
+  for (auto _ : state) {
+    exec.run();
+    benchmark::DoNotOptimize(exec.fetch(heads.back()));
+  }
+  state.counters["nodes"] = p.graph().node_count();
+  state.SetItemsProcessed(state.iterations() * kWidth);
+}
+BENCHMARK(BM_HorizontalFusion)->ArgName("mode")->DenseRange(0, 2);
+
+// Benchmark running a 64-deep chain of add_one steps, as in the AddOne
+// loop, one node per step (fused:0) and fused into one chained node
+// (fused:1), on the SequentialExecutor (threads:0) and on the
+// ParallelExecutor, whose scheduler every node goes through.
+static void BM_VerticalFusion(benchmark::State& state) {
+  constexpr int kDepth = 64;
+  const bool fused = state.range(0);
+  const int threads = state.range(1);
+  Program p;
+  Context::Scope scope(&p);
+
+  Op<int32_t(int32_t)> add_one("add_one");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  output = input;
+  for (int i = 0; i < kDepth; ++i) {
+    output = add_one(output);
+  }
+
+  auto kernels = std::make_shared<KernelRegistry>();
+  kernels->add(add_one, [](int32_t x) { return x + 1; });
+  if (fused) {
+    p.passes().add("vertical_fusion", vertical_fusion(kernels));
+  }
+  auto plan = ExecutionPlan::compile(p.graph(), *kernels);
+
+  if (threads == 0) {
+    SequentialExecutor exec(plan);
+    exec.feed(input, 0);
+    for (auto _ : state) {
+      exec.run();
+      benchmark::DoNotOptimize(exec.fetch(output));
+    }
+  } else {
+    ParallelExecutor exec(plan, threads);
+    exec.feed(input, 0);
+    for (auto _ : state) {
+      exec.run();
+      benchmark::DoNotOptimize(exec.fetch(output));
+    }
+  }
+  state.counters["nodes"] = plan->instructions().size();
+  state.SetItemsProcessed(state.iterations() * kDepth);
+}
+BENCHMARK(BM_VerticalFusion)
+    ->ArgNames({"fused", "threads"})
+    ->ArgsProduct({{0, 1}, {0, 1}});
+
+// A config parser expensive enough to be worth caching
+static std::vector<int32_t> ParseConfig(const std::string& config) {
+  std::vector<int32_t> fields;
+  int32_t field = 0;
+  for (char c : config) {
+    field = Spin(field + c);
+    if (c == ';') {
+      fields.push_back(field);
+      field = 0;
+    }
+  }
+  return fields;
+}
+
+// Benchmark requests from 1 to 8 threads parsing one of 64 configs each,
+// without a cache (memo:0) and through a MemoCache (memo:1).
+static void BM_Memoization(benchmark::State& state) {
+  constexpr int kConfigs = 64;
+  struct Shared {
+    Op<std::vector<int32_t>(std::string)> parse{"parse"};
+    Program p;
+    KernelRegistry plain, memoized;
+    std::optional<Var<std::string>> config;
+    std::optional<Var<std::vector<int32_t>>> fields;
+    std::shared_ptr<const ExecutionPlan> plans[2];
+    std::shared_ptr<MemoCache<std::vector<int32_t>(std::string)>> cache;
+    std::vector<std::string> configs;
+  };
+  static Shared* shared = [] {
+    auto* s = new Shared;
+    Context::Scope scope(&s->p);
+    s->config.emplace(placeholder, "config");
+    s->fields.emplace("fields");
+    *s->fields = s->parse(*s->config);
+    s->plain.add(s->parse, ParseConfig);
+    s->cache = add_memoized_kernel(s->memoized, s->parse, ParseConfig,
+                                   {.max_entries = 256});
+    s->plans[0] = ExecutionPlan::compile(s->p.graph(), s->plain);
+    s->plans[1] = ExecutionPlan::compile(s->p.graph(), s->memoized);
+    for (int i = 0; i < kConfigs; ++i) {
+      s->configs.push_back("model=" + std::to_string(i) +
+                           ";threshold=0.5;features=a,b,c,d;");
+    }
+    return s;
+  }();
+
+  SequentialExecutor exec(shared->plans[state.range(0)]);
+  size_t i = state.thread_index();
+  for (auto _ : state) {
+    exec.feed(*shared->config, shared->configs[i++ % kConfigs]);
+    exec.run();
+    benchmark::DoNotOptimize(exec.fetch(*shared->fields).data());
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.range(0) && state.thread_index() == 0) {
+    MemoStats stats = shared->cache->stats();
+    state.counters["hit_rate"] = stats.hit_rate();
+    state.counters["bytes"] = stats.bytes;
+  }
+}
+BENCHMARK(BM_Memoization)
+    ->ArgName("memo")
+    ->Arg(0)
+    ->Arg(1)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// Benchmark building one Program per thread at the same time, sharing the
+// Op objects. Items/s should grow with the thread count.
+static void BM_ConcurrentBuild(benchmark::State& state) {
+  static const Op<int32_t(int32_t)> op("op");
+  constexpr int kWidth = 256;
+
+  for (auto _ : state) {
+    Program p;
+    Context::Scope scope(&p);
+
+    Var<int32_t> input(placeholder, "input");
+    std::vector<Var<int32_t>> outputs;
+    outputs.reserve(kWidth);
+    for (int i = 0; i < kWidth; ++i) {
+      outputs.emplace_back("output_" + std::to_string(i));
+      outputs.back() = op(input);
+    }
+
+    const Graph& g = p.graph();
+    benchmark::DoNotOptimize(&g);
+  }
+  state.SetItemsProcessed(state.iterations() * kWidth);
+}
+BENCHMARK(BM_ConcurrentBuild)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
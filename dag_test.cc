@@ -1,6 +1,10 @@
 #include "dag.h"
 #include <gtest/gtest.h>
+#include <memory>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 TEST(DagTest, AddOne1) {
   Program prog;
@@ -365,6 +369,469 @@ TEST(DagTest, IfElse) {
   EXPECT_TRUE(g.produces("double_op:0", "output"));
 }
 
+TEST(DagTest, GraphQueries) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> add_one("add_one"), sub_one("sub_one");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> left("left"), right("right"), output("output");
+  left = add_one(input);
+  right = sub_one(input);
+  output = add(left, right);
+
+  Graph g = prog.graph();
+  g.print();
+  // expect
+  // input -> [add_one_0] -> left
+  // input -> [sub_one_1] -> right
+  // left, right -> [add_2] -> output
+  NodeId left_node = g.find_node("add_one_0");
+  NodeId right_node = g.find_node("sub_one_1");
+  NodeId add_node = g.find_node("add_2");
+  ASSERT_NE(left_node, kNoNode);
+  ASSERT_NE(right_node, kNoNode);
+  ASSERT_NE(add_node, kNoNode);
+  EXPECT_EQ(g.find_node("add_one_2"), kNoNode);
+
+  EXPECT_EQ(g.producer_of("input"), kNoNode);
+  EXPECT_EQ(g.producer_of("left"), left_node);
+  EXPECT_EQ(g.producer_of("output"), add_node);
+  EXPECT_EQ(g.producer_of("no_such_var"), kNoNode);
+
+  auto input_consumers = g.consumers_of("input");
+  ASSERT_EQ(input_consumers.size(), 2);
+  EXPECT_EQ(input_consumers[0], left_node);
+  EXPECT_EQ(input_consumers[1], right_node);
+  EXPECT_TRUE(g.consumers_of("output").empty());
+
+  ASSERT_EQ(g.successors(left_node).size(), 1);
+  EXPECT_EQ(g.successors(left_node)[0], add_node);
+  EXPECT_TRUE(g.successors(add_node).empty());
+  EXPECT_TRUE(g.predecessors(left_node).empty());
+  ASSERT_EQ(g.predecessors(add_node).size(), 2);
+  EXPECT_EQ(g.predecessors(add_node)[0], left_node);
+  EXPECT_EQ(g.predecessors(add_node)[1], right_node);
+}
+
+TEST(DagTest, FrozenGraph) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<std::string(std::string)> upper_op("upper_op");
+  Op<std::string(std::string, std::string)> concat_op("concat_op");
+  Var<std::string> a("a");
+  Var<std::string> b(placeholder, "b");
+  Var<std::string> output("output");
+  a = upper_op(a);
+  output = concat_op(a, b);
+
+  Graph g = prog.graph();
+  auto frozen = g.freeze();
+  // expect
+  // a -> [upper_op_0] -> a'
+  // a', b -> [concat_op_1] -> output
+  ASSERT_EQ(frozen->node_count(), 2);
+  EXPECT_EQ(frozen->value_count(), 4);
+  EXPECT_EQ(frozen->edge_count(), 1);
+
+  // `a` is read before it is redefined, so it has two values
+  ASSERT_EQ(frozen->graph_inputs().size(), 2);
+  ValueId a_in = frozen->graph_inputs()[0];
+  ValueId b_in = frozen->graph_inputs()[1];
+  EXPECT_EQ(frozen->symbols().name(frozen->symbol(a_in)), "a");
+  EXPECT_FALSE(frozen->is_placeholder(a_in));
+  EXPECT_TRUE(frozen->is_placeholder(b_in));
+  ValueId a_out = frozen->find_value("a");
+  EXPECT_NE(a_out, a_in);
+  EXPECT_EQ(frozen->producer(a_out), 0);
+  EXPECT_EQ(frozen->producer(a_in), kNoNode);
+
+  ASSERT_EQ(frozen->inputs(0).size(), 1);
+  EXPECT_EQ(frozen->inputs(0)[0], a_in);
+  ASSERT_EQ(frozen->outputs(0).size(), 1);
+  EXPECT_EQ(frozen->outputs(0)[0], a_out);
+  ASSERT_EQ(frozen->inputs(1).size(), 2);
+  EXPECT_EQ(frozen->inputs(1)[0], a_out);
+  EXPECT_EQ(frozen->inputs(1)[1], b_in);
+
+  ASSERT_EQ(frozen->consumers(a_out).size(), 1);
+  EXPECT_EQ(frozen->consumers(a_out)[0], 1);
+  ASSERT_EQ(frozen->successors(0).size(), 1);
+  EXPECT_EQ(frozen->successors(0)[0], 1);
+  EXPECT_EQ(frozen->find_value("no_such_var"), kNoValue);
+
+  // a finalized graph hands out the frozen form it already built
+  EXPECT_EQ(g.freeze(), frozen);
+}
+
+TEST(DagTest, GraphIsCached) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> add_one("add_one");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  output = add_one(input);
+
+  const Graph& g1 = prog.graph();
+  const Graph& g2 = prog.graph();
+  EXPECT_EQ(&g1, &g2);
+  EXPECT_EQ(g1.freeze(), g2.freeze());
+  EXPECT_EQ(g1.node_count(), 1);
+
+  Var<int32_t> output2("output2");
+  output2 = add_one(output);
+  EXPECT_EQ(prog.graph().node_count(), 2);
+}
+
+TEST(DagTest, IncrementalLiveness) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> add_one("add_one");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  Var<int32_t> tmp;
+
+  // nothing observes tmp yet
+  tmp = add_one(input);
+  EXPECT_EQ(prog.graph().node_count(), 0);
+
+  // reading tmp into a named var revives its producer
+  output = add_one(tmp);
+  EXPECT_EQ(prog.graph().node_count(), 2);
+  EXPECT_TRUE(prog.graph().consumes("add_one_0", "input"));
+  EXPECT_TRUE(prog.graph().produces("add_one_1", "output"));
+
+  // overwriting output kills both of them again
+  output = add_one(input);
+  Graph g = prog.graph();
+  g.print();
+  EXPECT_EQ(g.node_count(), 1);
+  EXPECT_TRUE(g.consumes("add_one_0", "input"));
+  EXPECT_TRUE(g.produces("add_one_0", "output"));
+}
+
+TEST(DagTest, ConcurrentPrograms) {
+  // Ops are shared; every thread builds its own Program
+  Op<int32_t(int32_t)> add_one("add_one");
+  Op<int32_t(int32_t, int32_t)> add("add");
+
+  constexpr int kThreads = 8;
+  std::vector<size_t> node_counts(kThreads);
+  std::vector<char> names_match(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      Program prog;
+      Context::Scope scope(&prog);
+      Var<int32_t> input(placeholder, "input");
+      Var<int32_t> output("output");
+      Var<int32_t> sum;
+      sum = add_one(input);
+      for (int i = 0; i < 100; ++i) {
+        Var<int32_t> one;
+        one = add_one(sum);
+        sum = add(sum, one);
+      }
+      output = add_one(sum);
+
+      const Graph& g = prog.graph();
+      node_counts[t] = g.node_count();
+      // counters are per Program, so every thread sees the same names
+      names_match[t] = g.has_node("add_one_0") && g.has_node("add_2") &&
+                       g.produces(g.node_name(g.node_count() - 1), "output");
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 0; t < kThreads; ++t) {
+    EXPECT_EQ(node_counts[t], 202);
+    EXPECT_TRUE(names_match[t]);
+  }
+}
+
+TEST(DagTest, VarNameOutsideItsProgram) {
+  Program first, second;
+  std::optional<Var<int32_t>> output;
+  {
+    Context::Scope scope(&first);
+    output.emplace("output");
+  }
+  // resolved against the program the Var was declared in, in any scope
+  EXPECT_EQ(output->name(), "output");
+  Context::Scope scope(&second);
+  Var<int32_t> other("other");
+  EXPECT_EQ(output->name(), "output");
+  EXPECT_EQ(other.name(), "other");
+}
+
+TEST(DagTest, CopyPropagation) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> add_one("add_one");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output"), twice("twice"), alias("alias");
+  Var<int32_t> tmp;
+  tmp = add_one(input);
+  output = tmp;
+  twice = add_one(output);
+  alias = input;
+
+  // expect
+  // input -> [add_one_0] -> output -> [add_one_1] -> twice
+  // input -> [copy_2] -> alias
+  Graph g = prog.graph();
+  g.print();
+  EXPECT_EQ(g.node_count(), 3);
+  EXPECT_TRUE(g.consumes("add_one_0", "input"));
+  EXPECT_TRUE(g.produces("add_one_0", "output"));
+  EXPECT_TRUE(g.consumes("add_one_1", "output"));
+  EXPECT_TRUE(g.produces("add_one_1", "twice"));
+  EXPECT_TRUE(g.produces("copy_2", "alias"));
+
+  // tmp is still usable after the copy was folded away
+  Var<int32_t> again("again");
+  again = add_one(tmp);
+  g = prog.graph();
+  g.print();
+  EXPECT_EQ(g.node_count(), 5);
+  EXPECT_TRUE(g.produces("copy_1", "output"));
+  EXPECT_EQ(g.inputs(4)[0], g.inputs(2)[0]);
+  EXPECT_EQ(g.producer_of(g.inputs(4)[0]), 0);
+}
+
+TEST(DagTest, CommonSubexpressionElimination) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> lookup("lookup");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Op<int32_t(int32_t)> sample(impure, "sample");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> sum("sum"), named("named"), first("first"), second("second");
+  Var<int32_t> a, b;
+  a = lookup(input);
+  b = lookup(input);
+  sum = add(a, b);
+  named = lookup(input);
+  first = sample(input);
+  second = sample(input);
+
+  // expect
+  // input -> [lookup_0] -> a -> [add_1] -> sum
+  // a -> [copy_2] -> named
+  // input -> [sample_3] -> first
+  // input -> [sample_4] -> second
+  Graph g = prog.graph();
+  g.print();
+  EXPECT_EQ(g.node_count(), 5);
+  EXPECT_TRUE(g.consumes("lookup_0", "input"));
+  EXPECT_EQ(g.inputs(1)[0], g.outputs(0)[0]);
+  EXPECT_EQ(g.inputs(1)[1], g.outputs(0)[0]);
+  EXPECT_TRUE(g.produces("add_1", "sum"));
+  EXPECT_TRUE(g.produces("copy_2", "named"));
+  EXPECT_EQ(g.producer_of(g.inputs(2)[0]), 0);
+  EXPECT_TRUE(g.produces("sample_3", "first"));
+  EXPECT_TRUE(g.produces("sample_4", "second"));
+}
+
+TEST(DagTest, StandardPassesKeepLiveness) {
+  // a, b = op(input), twice; c = copy(b); named = copy(a); out = op(c);
+  // dup = op(input), a third time; kept = copy(dup)
+  auto symbols = std::make_shared<SymbolTable>();
+  Arena arena;
+  IR ir(symbols, arena);
+  Symbol op = symbols->intern("op");
+  Symbol copy = symbols->intern("copy");
+  Symbol input = symbols->intern("input");
+  Symbol named = symbols->intern("named");
+  Symbol out = symbols->intern("out");
+  Symbol kept = symbols->intern("kept");
+  Symbol a = symbols->make_anonymous(), b = symbols->make_anonymous();
+  Symbol c = symbols->make_anonymous(), dup = symbols->make_anonymous();
+  ir.add_placeholder(input);
+  ir.add_node(IRNode(op, arena.copy({input}), arena.copy({a})));
+  ir.add_node(IRNode(op, arena.copy({input}), arena.copy({b})));
+  ir.add_node(IRNode(copy, arena.copy({b}), arena.copy({c})));
+  ir.add_node(IRNode(copy, arena.copy({a}), arena.copy({named})));
+  ir.add_node(IRNode(op, arena.copy({c}), arena.copy({out})));
+  ir.add_node(IRNode(op, arena.copy({input}), arena.copy({dup})));
+  ir.add_node(IRNode(copy, arena.copy({dup}), arena.copy({kept})));
+
+  ir.optimize();
+  std::vector<bool> dead;
+  for (size_t i = 0; i < ir.size(); i++) {
+    dead.push_back(ir.node(i).is_dead);
+  }
+  EXPECT_EQ(ir.live_count(), 5);
+  // recomputing from scratch finds the same live nodes
+  ir.dead_store_elimination();
+  for (size_t i = 0; i < ir.size(); i++) {
+    EXPECT_EQ(ir.node(i).is_dead, dead[i]) << "node " << i;
+  }
+}
+
+// A custom pass: lowers every "slow_op" node to "fast_op"
+static size_t LowerSlowOps(IR& ir) {
+  Symbol slow = ir.symbols().find("slow_op");
+  Symbol fast = ir.symbols().intern("fast_op");
+  size_t rewritten = 0;
+  for (size_t i = 0; i < ir.size(); i++) {
+    IRNode& node = ir.node(i);
+    if (slow != kNoSymbol && !node.is_dead && node.op_class == slow) {
+      node.op_class = fast;
+      rewritten++;
+    }
+  }
+  return rewritten;
+}
+
+TEST(DagTest, PassManager) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> f("f"), slow_op("slow_op");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output"), slow("slow");
+  Var<int32_t> a, b, c;
+  a = f(input);
+  b = input;
+  c = f(b);
+  output = add(a, c);
+  slow = slow_op(input);
+
+  // c only turns into a duplicate of a once copy propagation ran
+  Graph g = prog.graph();
+  g.print();
+  EXPECT_EQ(g.node_count(), 4);
+  auto stats = prog.pass_stats();
+  ASSERT_EQ(stats.size(), 2);
+  EXPECT_EQ(stats[0].name, "cse");
+  EXPECT_EQ(stats[0].runs, 1);
+  EXPECT_EQ(stats[0].nodes_rewritten, 0);
+  EXPECT_EQ(stats[1].name, "copy_propagation");
+  EXPECT_EQ(stats[1].nodes_rewritten, 1);
+  EXPECT_EQ(stats[1].nodes_removed, 1);
+
+  prog.passes().run_to_fixed_point().add("lower", LowerSlowOps);
+  g = prog.graph();
+  g.print();
+  // expect
+  // input -> [f_0] -> a
+  // a, a -> [add_1] -> output
+  // input -> [fast_op_2] -> slow
+  EXPECT_EQ(g.node_count(), 3);
+  EXPECT_TRUE(g.produces("add_1", "output"));
+  EXPECT_EQ(g.inputs(1)[0], g.outputs(0)[0]);
+  EXPECT_EQ(g.inputs(1)[1], g.outputs(0)[0]);
+  EXPECT_TRUE(g.produces("fast_op_2", "slow"));
+
+  stats = prog.pass_stats();
+  ASSERT_EQ(stats.size(), 3);
+  // the last round changed nothing
+  EXPECT_EQ(stats[0].runs, 3);
+  EXPECT_EQ(stats[0].nodes_rewritten, 1);
+  EXPECT_EQ(stats[0].nodes_removed, 1);
+  EXPECT_EQ(stats[2].name, "lower");
+  EXPECT_EQ(stats[2].nodes_rewritten, 1);
+}
+
+TEST(DagTest, HorizontalFusion) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> embed("embed");
+  Op<int32_t(int32_t, int32_t)> head("head"), other("other");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> w1(placeholder, "w1"), w2(placeholder, "w2");
+  Var<int32_t> emb("emb"), s1("s1"), s2("s2"), s3("s3"), s4("s4"), s5("s5");
+  emb = embed(input);
+  s1 = head(emb, w1);
+  s2 = head(emb, w2);
+  Var<int32_t> w3(placeholder, "w3");
+  s3 = head(s1, w3);
+  s4 = head(emb, w3);
+  s5 = other(emb, w1);
+  prog.passes().add("horizontal_fusion", [](IR& ir) {
+    return ir.horizontal_fusion(
+        [](std::string_view op) { return op == "head"; });
+  });
+
+  // s3 reads s1, so it stays out of the group; s4 moves up to join it.
+  // expect
+  // input -> [embed_0] -> emb
+  // emb, w1, emb, w2, emb, w3 -> [fused:head_1] -> s1, s2, s4
+  // s1, w3 -> [head_2] -> s3
+  // emb, w1 -> [other_3] -> s5
+  Graph g = prog.graph();
+  g.print();
+  EXPECT_EQ(g.node_count(), 4);
+  EXPECT_EQ(g.inputs(1).size(), 6);
+  EXPECT_TRUE(g.produces("fused:head_1", "s1"));
+  EXPECT_TRUE(g.produces("fused:head_1", "s2"));
+  EXPECT_TRUE(g.produces("fused:head_1", "s4"));
+  EXPECT_TRUE(g.consumes("fused:head_1", "w3"));
+  EXPECT_TRUE(g.produces("head_2", "s3"));
+  EXPECT_EQ(g.producer_of(g.inputs(2)[0]), 1);
+  EXPECT_TRUE(g.produces("other_3", "s5"));
+
+  auto stats = prog.pass_stats();
+  ASSERT_EQ(stats.size(), 3);
+  EXPECT_EQ(stats[2].name, "horizontal_fusion");
+  EXPECT_EQ(stats[2].nodes_rewritten, 2);
+}
+
+TEST(DagTest, VerticalFusion) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> f("f"), g("g");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Var<int32_t> input(placeholder, "input"), w(placeholder, "w");
+  Var<int32_t> out("out"), named("named"), side("side");
+  Var<int32_t> a, b, c, d;
+  a = f(input);
+  b = add(w, a);
+  c = g(b);
+  out = f(c);
+  // `out` and `named` are observable, and `d` is read twice
+  named = g(out);
+  d = f(named);
+  side = add(d, d);
+  prog.passes().add("vertical_fusion", [](IR& ir) {
+    return ir.vertical_fusion(
+        [](std::string_view op) { return op != "copy"; });
+  });
+
+  // expect
+  // input, w -> [chain:f>add@1>g>f_0] -> out
+  // out -> [g_1] -> named
+  // named -> [f_2] -> d
+  // d, d -> [add_3] -> side
+  Graph graph = prog.graph();
+  graph.print();
+  EXPECT_EQ(graph.node_count(), 4);
+  EXPECT_TRUE(graph.consumes("chain:f>add@1>g>f_0", "input"));
+  EXPECT_TRUE(graph.consumes("chain:f>add@1>g>f_0", "w"));
+  EXPECT_TRUE(graph.produces("chain:f>add@1>g>f_0", "out"));
+  EXPECT_TRUE(graph.produces("g_1", "named"));
+  EXPECT_EQ(graph.producer_of(graph.inputs(3)[0]), 2);
+
+  auto stages = parse_chain_op("chain:f>add@1>g>f");
+  ASSERT_EQ(stages.size(), 4);
+  EXPECT_EQ(stages[1].op, "add");
+  EXPECT_EQ(stages[1].chained, 1);
+  EXPECT_EQ(stages[3].chained, 0);
+  EXPECT_TRUE(parse_chain_op("f").empty());
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,718 @@
+#pragma once
+#include "dag.h"
+#include "kernel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The kernel of a node IR::vertical_fusion() made of a chain of ops. It runs
+// the stages' kernels back to back on the calling thread. The result of
+// each stage but the last goes to one of two scratch slots only this node
+// uses, is moved into the next stage and dropped, so the executor neither
+// schedules nor keeps it. Built by ExecutionPlan, one per chained node.
+class ChainKernel {
+public:
+  struct Stage {
+    const Kernel* kernel;
+    // Argument of the stage that the previous stage's result fills
+    size_t chained;
+  };
+
+  // `inputs` and `output` are the slots of the node; `scratch` holds the
+  // first of its scratch slots, and one more follows it if there are more
+  // than two stages.
+  static std::unique_ptr<const Kernel> make(std::string name,
+                                            const std::vector<Stage>& stages,
+                                            Span<const uint32_t> inputs,
+                                            uint32_t output,
+                                            uint32_t scratch) {
+    auto chain = std::make_shared<ChainKernel>();
+    std::vector<TypeId> input_types;
+    size_t next_input = 0;
+    for (size_t k = 0; k < stages.size(); k++) {
+      const Kernel& kernel = *stages[k].kernel;
+      const auto& types = kernel.input_types();
+      if (kernel.variadic() || kernel.async() || kernel.fused() ||
+          kernel.output_types().size() != 1 ||
+          (k && stages[k].chained >= types.size())) {
+        throw std::runtime_error("Op cannot be chained: " + kernel.name());
+      }
+      if (k && types[stages[k].chained] != chain->stages_.back().type) {
+        throw std::runtime_error("Type mismatch at input " +
+                                 std::to_string(stages[k].chained) +
+                                 " of op: " + kernel.name());
+      }
+      Step step;
+      step.kernel = &kernel;
+      step.chained = k ? stages[k].chained : kNoChain;
+      step.chained_bit =
+          step.chained < 64 ? uint64_t{1} << step.chained : 0;
+      step.first_input = next_input;
+      step.type = kernel.output_types()[0];
+      step.output = k + 1 == stages.size() ? output : scratch + k % 2;
+      for (size_t i = 0; i < types.size(); i++) {
+        if (i == step.chained) {
+          step.inputs.push_back(scratch + (k - 1) % 2);
+        } else if (next_input < inputs.size()) {
+          step.inputs.push_back(inputs[next_input++]);
+          input_types.push_back(types[i]);
+        }
+      }
+      chain->stages_.push_back(std::move(step));
+    }
+    chain->scratch_ = scratch;
+    return std::make_unique<const Kernel>(
+        std::move(name), &invoke, nullptr, &invoke_batch, false,
+        std::move(chain), std::move(input_types),
+        std::vector<TypeId>{stages.back().kernel->output_types()[0]}, false);
+  }
+
+private:
+  static constexpr size_t kNoChain = SIZE_MAX;
+
+  struct Step {
+    const Kernel* kernel;
+    size_t chained;
+    uint64_t chained_bit;
+    // Of the node's inputs, the first this stage reads
+    size_t first_input;
+    TypeId type;
+    std::vector<uint32_t> inputs;
+    uint32_t output;
+  };
+  std::vector<Step> stages_;
+  uint32_t scratch_;
+
+  // The movable bits of `step` out of the node's: its own inputs', with
+  // the chained result always movable.
+  static uint64_t step_movable(const Step& step, uint64_t movable) {
+    if (movable == 0) {
+      return step.chained_bit;
+    }
+    uint64_t bits = step.first_input < 64 ? movable >> step.first_input : 0;
+    if (step.chained == kNoChain || step.chained >= 64) {
+      return bits;
+    }
+    uint64_t low = bits & (step.chained_bit - 1);
+    uint64_t high = step.chained < 63 ? bits >> step.chained
+                                                << (step.chained + 1)
+                                      : 0;
+    return low | step.chained_bit | high;
+  }
+
+  // Calls `run(step, movable)` for each stage, dropping every intermediate
+  // once read, and all of them on error.
+  template <typename Run>
+  void run_steps(Value* slots, uint64_t movable, Run run) const {
+    try {
+      for (size_t k = 0; k < stages_.size(); k++) {
+        run(stages_[k], step_movable(stages_[k], movable));
+        if (k) {
+          slots[scratch_ + (k - 1) % 2].reset();
+        }
+      }
+    } catch (...) {
+      slots[scratch_].reset();
+      if (stages_.size() > 2) {
+        slots[scratch_ + 1].reset();
+      }
+      throw;
+    }
+  }
+
+  static void invoke(const void* fn, Value* slots, Span<const uint32_t>,
+                     Span<const uint32_t>, uint64_t movable) {
+    static_cast<const ChainKernel*>(fn)->run_steps(
+        slots, movable, [&](const Step& step, uint64_t bits) {
+          (*step.kernel)(slots, step.inputs, {&step.output, 1}, bits);
+        });
+  }
+
+  static void invoke_batch(const void* fn, Value* slots, Span<const uint32_t>,
+                           Span<const uint32_t>, uint64_t movable,
+                           size_t rows) {
+    static_cast<const ChainKernel*>(fn)->run_steps(
+        slots, movable, [&](const Step& step, uint64_t bits) {
+          step.kernel->run_batch(slots, step.inputs, {&step.output, 1}, bits,
+                                 rows);
+        });
+  }
+};
+
+// A Graph compiled for execution: kernels resolved, types checked and every
+// node flattened into a fixed-size instruction. Values become slot indexes,
+// one slot per FrozenGraph value. A plan is immutable once compiled, so one
+// plan can be shared by every executor and thread, and reused for every
+// request.
+class ExecutionPlan {
+public:
+  // Two instructions per cache line, and none straddles one. Slot and
+  // successor lists are offsets into one flat index array.
+  struct alignas(32) Instruction {
+    const Kernel* kernel;
+    uint32_t inputs;
+    uint32_t outputs;
+    uint32_t successors;
+    uint32_t successor_count;
+    uint16_t input_count;
+    uint16_t output_count;
+    // Distinct instructions that must finish before this one can run
+    uint32_t dependencies;
+  };
+  static_assert(sizeof(Instruction) == 32);
+
+  static std::shared_ptr<const ExecutionPlan>
+  compile(const Graph& graph, const KernelRegistry& kernels) {
+    return std::shared_ptr<const ExecutionPlan>(
+        new ExecutionPlan(graph.freeze(), kernels));
+  }
+
+  // In program order, which is topological.
+  const std::vector<Instruction>& instructions() const {
+    return instructions_;
+  }
+
+  Span<const uint32_t> inputs(const Instruction& instr) const {
+    return {indexes_.data() + instr.inputs, instr.input_count};
+  }
+
+  Span<const uint32_t> outputs(const Instruction& instr) const {
+    return {indexes_.data() + instr.outputs, instr.output_count};
+  }
+
+  // Instructions reading a slot this one writes, each listed once.
+  Span<const uint32_t> successors(const Instruction& instr) const {
+    return {indexes_.data() + instr.successors, instr.successor_count};
+  }
+
+  // Bit i is set if instruction `instr` may move from its input i: the
+  // instruction is the value's only reader and the value is not observable,
+  // i.e. neither fed nor the last value of a named variable.
+  uint64_t movable(uint32_t instr) const {
+    return movable_[instr];
+  }
+
+  // Instructions without dependencies, where every run starts.
+  Span<const uint32_t> roots() const {
+    return roots_;
+  }
+
+  // One per FrozenGraph value, then the scratch slots of chained nodes.
+  size_t slot_count() const {
+    return graph_->value_count() + scratch_slots_;
+  }
+
+  // Slots that must be fed before a run.
+  Span<const ValueId> input_slots() const {
+    return graph_->graph_inputs();
+  }
+
+  // The slot `var` is fed through, or kNoValue if it is not a graph input.
+  ValueId input_slot(Symbol var) const {
+    return var < input_by_symbol_.size() ? input_by_symbol_[var] : kNoValue;
+  }
+
+  // The slot holding the last value of `var`, or kNoValue.
+  ValueId output_slot(Symbol var) const {
+    return graph_->find_value(var);
+  }
+
+  std::string_view slot_name(ValueId slot) const {
+    return graph_->symbols().name(graph_->symbol(slot));
+  }
+
+  const FrozenGraph& graph() const {
+    return *graph_;
+  }
+
+private:
+  std::shared_ptr<const FrozenGraph> graph_;
+  std::vector<Instruction> instructions_;
+  // Input, output and successor lists of all instructions
+  std::vector<uint32_t> indexes_;
+  std::vector<uint32_t> roots_;
+  // Indexed by instruction
+  std::vector<uint64_t> movable_;
+  // Indexed by Symbol: the graph input a variable is fed through.
+  std::vector<ValueId> input_by_symbol_;
+  // The kernels of chained nodes, and their scratch slots
+  std::vector<std::unique_ptr<const Kernel>> chain_kernels_;
+  size_t scratch_slots_ = 0;
+
+  ExecutionPlan(std::shared_ptr<const FrozenGraph> graph,
+                const KernelRegistry& kernels)
+      : graph_(std::move(graph)) {
+    const FrozenGraph& g = *graph_;
+    const SymbolTable& symbols = g.symbols();
+
+    input_by_symbol_.assign(symbols.size(), kNoValue);
+    for (ValueId value : g.graph_inputs()) {
+      input_by_symbol_[g.symbol(value)] = value;
+    }
+
+    // Types of values produced so far, or nullptr if only known at runtime
+    std::vector<TypeId> value_types(g.value_count(), nullptr);
+    instructions_.reserve(g.node_count());
+    for (NodeId node = 0; node < g.node_count(); node++) {
+      std::string_view op_name = symbols.name(g.op_class(node));
+      Span<const ValueId> inputs = g.inputs(node);
+      Span<const ValueId> outputs = g.outputs(node);
+      const Kernel* kernel = kernels.kernel(kernels.find(op_name));
+      if (!kernel) {
+        kernel = chain_kernel(op_name, kernels, inputs, outputs);
+      }
+      if (inputs.size() > UINT16_MAX || outputs.size() > UINT16_MAX) {
+        throw std::runtime_error("Too many inputs or outputs for op: " +
+                                 kernel->name());
+      }
+      check_types(*kernel, inputs, outputs, value_types);
+
+      Instruction instr{};
+      instr.kernel = kernel;
+      instr.inputs = append(inputs);
+      instr.input_count = static_cast<uint16_t>(inputs.size());
+      instr.outputs = append(outputs);
+      instr.output_count = static_cast<uint16_t>(outputs.size());
+      instr.successors = append(g.successors(node));
+      instr.successor_count = static_cast<uint32_t>(g.successors(node).size());
+      instr.dependencies = static_cast<uint32_t>(g.predecessors(node).size());
+      if (instr.dependencies == 0) {
+        roots_.push_back(node);
+      }
+      instructions_.push_back(instr);
+      movable_.push_back(movable_inputs(g, inputs));
+    }
+  }
+
+  // The kernel of a chained node, or an error if `op_name` is no chain.
+  const Kernel* chain_kernel(std::string_view op_name,
+                             const KernelRegistry& kernels,
+                             Span<const ValueId> inputs,
+                             Span<const ValueId> outputs) {
+    std::vector<ChainStage> parsed = parse_chain_op(op_name);
+    if (parsed.size() < 2 || outputs.size() != 1) {
+      throw std::runtime_error("No kernel registered for op: " +
+                               std::string(op_name));
+    }
+    std::vector<ChainKernel::Stage> stages;
+    for (const ChainStage& stage : parsed) {
+      const Kernel* kernel = kernels.kernel(kernels.find(stage.op));
+      if (!kernel) {
+        throw std::runtime_error("No kernel registered for op: " +
+                                 std::string(stage.op));
+      }
+      stages.push_back({kernel, stage.chained});
+    }
+    uint32_t scratch = static_cast<uint32_t>(slot_count());
+    scratch_slots_ += std::min<size_t>(stages.size() - 1, 2);
+    chain_kernels_.push_back(ChainKernel::make(std::string(op_name), stages,
+                                               inputs, outputs[0], scratch));
+    return chain_kernels_.back().get();
+  }
+
+  static uint64_t movable_inputs(const FrozenGraph& g,
+                                 Span<const ValueId> inputs) {
+    const SymbolTable& symbols = g.symbols();
+    uint64_t movable = 0;
+    for (size_t i = 0; i < inputs.size() && i < 64; i++) {
+      ValueId value = inputs[i];
+      Symbol var = g.symbol(value);
+      // Results named after their op only exist as nested temporaries
+      bool observable =
+          g.producer(value) == kNoNode ||
+          (g.find_value(var) == value && !symbols.is_anonymous(var) &&
+           !symbols.is_generated(var));
+      if (observable || g.consumers(value).size() != 1 ||
+          std::count(inputs.begin(), inputs.end(), value) != 1) {
+        continue;
+      }
+      movable |= uint64_t{1} << i;
+    }
+    return movable;
+  }
+
+  uint32_t append(Span<const uint32_t> items) {
+    uint32_t offset = static_cast<uint32_t>(indexes_.size());
+    indexes_.insert(indexes_.end(), items.begin(), items.end());
+    return offset;
+  }
+
+  // Checks arities and, where the producing kernel declares them, that value
+  // types match what the consuming kernel expects.
+  static void check_types(const Kernel& kernel, Span<const ValueId> inputs,
+                          Span<const ValueId> outputs,
+                          std::vector<TypeId>& value_types) {
+    if (kernel.fused()) {
+      check_fused_types(kernel, inputs, outputs, value_types);
+      return;
+    }
+    const auto& expected = kernel.input_types();
+    if (!expected.empty()) {
+      size_t fixed = expected.size() - kernel.variadic();
+      if (inputs.size() < fixed ||
+          (!kernel.variadic() && inputs.size() != fixed)) {
+        throw std::runtime_error("Wrong number of inputs for op: " +
+                                 kernel.name());
+      }
+      for (size_t i = 0; i < inputs.size(); i++) {
+        TypeId type = value_types[inputs[i]];
+        if (type && type != expected[std::min(i, expected.size() - 1)]) {
+          throw std::runtime_error("Type mismatch at input " +
+                                   std::to_string(i) +
+                                   " of op: " + kernel.name());
+        }
+      }
+    }
+
+    const auto& produced = kernel.output_types();
+    if (produced.empty()) {
+      // Passes its input through, e.g. "copy"
+      for (ValueId output : outputs) {
+        value_types[output] = inputs.empty() ? nullptr : value_types[inputs[0]];
+      }
+      return;
+    }
+    if (outputs.size() != produced.size()) {
+      throw std::runtime_error("Wrong number of outputs for op: " +
+                               kernel.name());
+    }
+    for (size_t i = 0; i < outputs.size(); i++) {
+      value_types[outputs[i]] = produced[i];
+    }
+  }
+
+  // Every member of a fused node has the kernel's input and output types.
+  static void check_fused_types(const Kernel& kernel,
+                                Span<const ValueId> inputs,
+                                Span<const ValueId> outputs,
+                                std::vector<TypeId>& value_types) {
+    const auto& expected = kernel.input_types();
+    const auto& produced = kernel.output_types();
+    size_t members = inputs.size() / expected.size();
+    if (inputs.size() % expected.size() != 0) {
+      throw std::runtime_error("Wrong number of inputs for op: " +
+                               kernel.name());
+    }
+    if (outputs.size() != members * produced.size()) {
+      throw std::runtime_error("Wrong number of outputs for op: " +
+                               kernel.name());
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+      TypeId type = value_types[inputs[i]];
+      if (type && type != expected[i % expected.size()]) {
+        throw std::runtime_error("Type mismatch at input " +
+                                 std::to_string(i) +
+                                 " of op: " + kernel.name());
+      }
+    }
+    for (size_t i = 0; i < outputs.size(); i++) {
+      value_types[outputs[i]] = produced[i % produced.size()];
+    }
+  }
+};
+
+// Everything one request of a plan needs besides the plan itself: one value
+// slot per plan slot, the dependency counters, and the RequestArena its
+// kernels allocate from. Buffers are sized once; resetting the state only
+// visits the slots the request touched.
+class ExecutionState {
+public:
+  explicit ExecutionState(const ExecutionPlan& plan)
+      : plan_(plan), slots_(plan.slot_count()),
+        pending_(plan.instructions().size()) {
+    fed_.reserve(plan.input_slots().size());
+    ran_.reserve(plan.instructions().size());
+  }
+
+  ExecutionState(const ExecutionState&) = delete;
+  ExecutionState& operator=(const ExecutionState&) = delete;
+
+  // Indexed by slot
+  Value* slots() {
+    return slots_.data();
+  }
+
+  const Value& slot(ValueId slot) const {
+    return slots_[slot];
+  }
+
+  // Indexed by instruction, for executors that count dependencies down on
+  // one thread.
+  std::vector<uint32_t>& pending() {
+    return pending_;
+  }
+
+  RequestArena& arena() {
+    return arena_;
+  }
+
+  template <typename T>
+  void feed(ValueId slot, T value) {
+    if (!slots_[slot].has_value()) {
+      fed_.push_back(slot);
+    }
+    slots_[slot].emplace<T>(std::move(value));
+  }
+
+  // Records that `instr` is about to write its outputs.
+  void ran(uint32_t instr) {
+    ran_.push_back(instr);
+  }
+
+  // For executors that do not record instructions one by one: treat every
+  // instruction as having run.
+  void ran_all() {
+    ran_all_ = true;
+  }
+
+  // Drops the values the recorded instructions wrote, then the arena they
+  // lived in. Fed values stay.
+  void clear_results() {
+    if (ran_all_) {
+      for (const auto& instr : plan_.instructions()) {
+        clear(plan_.outputs(instr));
+      }
+      ran_all_ = false;
+    } else {
+      for (uint32_t instr : ran_) {
+        clear(plan_.outputs(plan_.instructions()[instr]));
+      }
+    }
+    ran_.clear();
+    arena_.reset();
+  }
+
+  // Back to the state of a new request.
+  void reset() {
+    clear_results();
+    clear(fed_);
+    fed_.clear();
+  }
+
+private:
+  const ExecutionPlan& plan_;
+  // Before the slots, so that values die before the memory they live in
+  RequestArena arena_;
+  std::vector<Value> slots_;
+  std::vector<uint32_t> pending_;
+  // Touched since the last reset
+  std::vector<ValueId> fed_;
+  std::vector<uint32_t> ran_;
+  bool ran_all_ = false;
+
+  void clear(Span<const ValueId> slots) {
+    for (ValueId slot : slots) {
+      slots_[slot].reset();
+    }
+  }
+};
+
+// Hands out ExecutionStates of one plan and takes them back, reset, for the
+// next request. In the steady state acquiring a state neither allocates nor
+// builds anything. Safe to use from any number of threads; it must outlive
+// the states it has handed out.
+class ExecutionStatePool {
+public:
+  // Returns a state to its pool, or deletes it if it has none.
+  struct Release {
+    ExecutionStatePool* pool = nullptr;
+
+    void operator()(ExecutionState* state) const {
+      if (pool) {
+        pool->release(state);
+      } else {
+        delete state;
+      }
+    }
+  };
+  using Lease = std::unique_ptr<ExecutionState, Release>;
+
+  explicit ExecutionStatePool(std::shared_ptr<const ExecutionPlan> plan)
+      : plan_(std::move(plan)) {}
+
+  ExecutionStatePool(const ExecutionStatePool&) = delete;
+  ExecutionStatePool& operator=(const ExecutionStatePool&) = delete;
+
+  Lease acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        ExecutionState* state = free_.back().release();
+        free_.pop_back();
+        return Lease(state, Release{this});
+      }
+      created_++;
+    }
+    return Lease(new ExecutionState(*plan_), Release{this});
+  }
+
+  const std::shared_ptr<const ExecutionPlan>& plan() const {
+    return plan_;
+  }
+
+  // States built so far; stays flat once the pool covers peak concurrency.
+  size_t created() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return created_;
+  }
+
+private:
+  std::shared_ptr<const ExecutionPlan> plan_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<ExecutionState>> free_;
+  size_t created_ = 0;
+
+  void release(ExecutionState* state) {
+    state->reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.emplace_back(state);
+  }
+};
+
+// Thrown by `run(token)` once the token has stopped the run. The outputs of
+// the nodes skipped are missing; the executor is usable again.
+class CancelledError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// What the last run of an executor did.
+struct RunStats {
+  // Nodes whose kernel was called
+  size_t nodes_run = 0;
+  // Nodes not dispatched because the run was cancelled
+  size_t nodes_skipped = 0;
+  bool cancelled = false;
+};
+
+// What every executor has: the plan it runs and an ExecutionState, its own
+// or leased from a pool. Inputs are fed and outputs fetched through the
+// `Var`s of the Program the plan was compiled from. Fetched values stay valid
+// until the next run.
+class ExecutorBase {
+public:
+  // Sets a graph input for this and all later runs.
+  template <typename T>
+  void feed(const Var<T>& var, T value) {
+    ValueId slot = plan_->input_slot(var.symbol());
+    if (slot == kNoValue) {
+      throw std::runtime_error(
+          "Not a graph input: " +
+          std::string(plan_->graph().symbols().name(var.symbol())));
+    }
+    state_->feed<T>(slot, std::move(value));
+  }
+
+  // The last value `var` was assigned in the graph. Values of temporaries
+  // may have been moved into the kernel that read them.
+  template <typename T>
+  const T& fetch(const Var<T>& var) const {
+    ValueId slot = plan_->output_slot(var.symbol());
+    if (slot == kNoValue || !state_->slot(slot).has_value()) {
+      throw std::runtime_error(
+          "No value for: " +
+          std::string(plan_->graph().symbols().name(var.symbol())));
+    }
+    return state_->slot(slot).get<T>();
+  }
+
+  const ExecutionPlan& plan() const {
+    return *plan_;
+  }
+
+  const RunStats& run_stats() const {
+    return stats_;
+  }
+
+protected:
+  std::shared_ptr<const ExecutionPlan> plan_;
+  ExecutionStatePool::Lease state_;
+  RunStats stats_;
+
+  explicit ExecutorBase(std::shared_ptr<const ExecutionPlan> plan)
+      : plan_(std::move(plan)), state_(new ExecutionState(*plan_)) {}
+
+  explicit ExecutorBase(ExecutionStatePool& pool)
+      : plan_(pool.plan()), state_(pool.acquire()) {}
+
+  void check_inputs() const {
+    for (ValueId slot : plan_->input_slots()) {
+      if (!state_->slot(slot).has_value()) {
+        throw std::runtime_error("Input not fed: " +
+                                 std::string(plan_->slot_name(slot)));
+      }
+    }
+  }
+
+  // Records a run that called `nodes_run` kernels, and throws if `token`
+  // stopped it before the rest.
+  void finish_run(size_t nodes_run, const CancellationToken* token) {
+    stats_.nodes_run = nodes_run;
+    stats_.nodes_skipped = plan_->instructions().size() - nodes_run;
+    stats_.cancelled = stats_.nodes_skipped != 0;
+    if (stats_.cancelled) {
+      throw CancelledError(token && token->deadline_passed()
+                               ? "Deadline exceeded"
+                               : "Request cancelled");
+    }
+  }
+};
+
+// Runs an ExecutionPlan one request at a time on the calling thread.
+//
+// A run calls the kernels in program order, which is topological, so it does
+// no lookups. Executors sharing a plan are independent and may run
+// concurrently. Built on a pooled state, an executor is cheap enough to
+// create for every request:
+//
+//   SequentialExecutor exec(pool);  // returns its state to `pool` when done
+class SequentialExecutor : public ExecutorBase {
+public:
+  explicit SequentialExecutor(std::shared_ptr<const ExecutionPlan> plan)
+      : ExecutorBase(std::move(plan)) {}
+
+  explicit SequentialExecutor(ExecutionStatePool& pool)
+      : ExecutorBase(pool) {}
+
+  SequentialExecutor(const Graph& graph, const KernelRegistry& kernels)
+      : SequentialExecutor(ExecutionPlan::compile(graph, kernels)) {}
+
+  void run() {
+    run(nullptr);
+  }
+
+  // Runs until done or until `token` is cancelled, which is checked before
+  // every node. A cancelled run throws CancelledError; `run_stats()` tells
+  // how many nodes it skipped.
+  void run(const CancellationToken& token) {
+    run(&token);
+  }
+
+private:
+  void run(const CancellationToken* token) {
+    check_inputs();
+    ExecutionState& state = *state_;
+    state.clear_results();
+    RequestArena::Scope arena(state.arena());
+    CancellationToken::Scope cancellation(token);
+    Value* slots = state.slots();
+    const ExecutionPlan& plan = *plan_;
+    const auto& instructions = plan.instructions();
+    uint32_t i = 0;
+    for (; i < instructions.size(); i++) {
+      if (token && token->cancelled()) {
+        break;
+      }
+      const auto& instr = instructions[i];
+      state.ran(i);
+      (*instr.kernel)(slots, plan.inputs(instr), plan.outputs(instr),
+                      plan.movable(i));
+    }
+    finish_run(i, token);
+  }
+};
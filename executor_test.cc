@@ -0,0 +1,611 @@
+#include "executor.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+TEST(ExecutorTest, LinearChain) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> add_one("add_one");
+  Op<int32_t(int32_t)> twice("twice");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  Var<int32_t> tmp;
+  tmp = add_one(input);
+  output = twice(tmp);
+
+  KernelRegistry kernels;
+  kernels.add(add_one, [](int32_t x) { return x + 1; });
+  kernels.add(twice, [](int32_t x) { return x * 2; });
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  exec.feed(input, 20);
+  exec.run();
+  EXPECT_EQ(exec.fetch(output), 42);
+
+  // inputs stay fed, and slots are reused by the next run
+  exec.feed(input, 1);
+  exec.run();
+  EXPECT_EQ(exec.fetch(output), 4);
+}
+
+TEST(ExecutorTest, TupleOutputsAndCopies) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<std::tuple<std::string, int32_t>(std::string)> split_op("split_op");
+  Op<std::string(std::string, int32_t)> repeat_op("repeat_op");
+  Var<std::string> input(placeholder, "input");
+  Var<std::string> word("word"), output("output"), alias("alias");
+  Var<int32_t> count("count");
+  (word, count) = split_op(input);
+  output = repeat_op(word, count);
+  alias = input;
+
+  KernelRegistry kernels;
+  kernels.add(split_op, [](const std::string& s) {
+    size_t space = s.find(' ');
+    return std::make_tuple(s.substr(0, space),
+                           static_cast<int32_t>(std::stoi(s.substr(space))));
+  });
+  kernels.add(repeat_op, [](const std::string& s, int32_t n) {
+    std::string result;
+    for (int32_t i = 0; i < n; i++) {
+      result += s;
+    }
+    return result;
+  });
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  exec.feed(input, std::string("ab 3"));
+  exec.run();
+  EXPECT_EQ(exec.fetch(word), "ab");
+  EXPECT_EQ(exec.fetch(count), 3);
+  EXPECT_EQ(exec.fetch(output), "ababab");
+  EXPECT_EQ(exec.fetch(alias), "ab 3");
+}
+
+TEST(ExecutorTest, VariadicOp) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(Variadic<int32_t>)> sum("sum");
+  Var<int32_t> a(placeholder, "a"), b(placeholder, "b"), c(placeholder, "c");
+  Var<int32_t> output("output");
+  output = sum(a, b, c);
+
+  KernelRegistry kernels;
+  kernels.add(sum, [](VariadicArgs<int32_t> xs) {
+    int32_t total = 0;
+    for (size_t i = 0; i < xs.size(); i++) {
+      total += xs[i];
+    }
+    return total;
+  });
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  exec.feed(a, 1);
+  exec.feed(b, 2);
+  exec.feed(c, 3);
+  exec.run();
+  EXPECT_EQ(exec.fetch(output), 6);
+}
+
+TEST(ExecutorTest, Errors) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> add_one("add_one");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  Var<int32_t> unused("unused");
+  output = add_one(input);
+
+  KernelRegistry empty;
+  EXPECT_THROW(SequentialExecutor(prog.graph(), empty), std::runtime_error);
+
+  KernelRegistry kernels;
+  kernels.add(add_one, [](int32_t x) { return x + 1; });
+  SequentialExecutor exec(prog.graph(), kernels);
+  EXPECT_THROW(exec.run(), std::runtime_error);
+  EXPECT_THROW(exec.feed(output, 1), std::runtime_error);
+  EXPECT_THROW(exec.fetch(unused), std::runtime_error);
+}
+
+TEST(ExecutorTest, TypeMismatchBetweenKernels) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // Two Op declarations that disagree about the type of "mid"
+  Op<int32_t(int32_t)> produce("produce");
+  Op<int32_t(int32_t)> consume("consume");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> mid("mid"), output("output");
+  mid = produce(input);
+  output = consume(mid);
+
+  Op<std::string(int32_t)> produce_string("produce");
+  KernelRegistry kernels;
+  kernels.add(produce_string, [](int32_t x) { return std::to_string(x); });
+  kernels.add(consume, [](int32_t x) { return x; });
+  EXPECT_THROW(SequentialExecutor(prog.graph(), kernels), std::runtime_error);
+}
+
+TEST(ExecutorTest, SharedPlan) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // A diamond: input -> (left, right) -> output
+  Op<int32_t(int32_t)> add_one("add_one"), twice("twice");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> left("left"), right("right"), output("output");
+  left = add_one(input);
+  right = twice(input);
+  output = add(left, right);
+
+  KernelRegistry kernels;
+  kernels.add(add_one, [](int32_t x) { return x + 1; });
+  kernels.add(twice, [](int32_t x) { return x * 2; });
+  kernels.add(add, [](int32_t a, int32_t b) { return a + b; });
+
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+  const auto& instructions = plan->instructions();
+  ASSERT_EQ(instructions.size(), 3);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(instructions.data()) % 32, 0);
+  EXPECT_EQ(instructions[0].kernel->name(), "add_one");
+  EXPECT_EQ(instructions[0].dependencies, 0);
+  EXPECT_EQ(instructions[1].dependencies, 0);
+  EXPECT_EQ(instructions[2].dependencies, 2);
+  EXPECT_EQ(plan->roots().size(), 2);
+  ASSERT_EQ(plan->successors(instructions[0]).size(), 1);
+  EXPECT_EQ(plan->successors(instructions[0])[0], 2);
+  EXPECT_EQ(plan->successors(instructions[2]).size(), 0);
+  EXPECT_EQ(plan->inputs(instructions[2]).size(), 2);
+  EXPECT_EQ(plan->outputs(instructions[2])[0],
+            plan->output_slot(output.symbol()));
+
+  // One executor per thread, all running the same plan
+  constexpr int kThreads = 4;
+  std::vector<int32_t> results(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t] {
+      SequentialExecutor exec(plan);
+      for (int32_t i = 0; i < 100; i++) {
+        exec.feed(input, t + i);
+        exec.run();
+      }
+      results[t] = exec.fetch(output);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int t = 0; t < kThreads; t++) {
+    int32_t x = t + 99;
+    EXPECT_EQ(results[t], (x + 1) + x * 2);
+  }
+}
+
+TEST(ExecutorTest, KernelsAllocateFromRequestArena) {
+  using Words = std::pmr::vector<std::pmr::string>;
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<Words(std::string)> split_op("split_op");
+  Op<int32_t(Words)> count_op("count_op");
+  Var<std::string> input(placeholder, "input");
+  Var<Words> words("words");
+  Var<int32_t> count("count");
+  words = split_op(input);
+  count = count_op(words);
+
+  std::vector<std::pmr::memory_resource*> resources;
+  KernelRegistry kernels;
+  kernels.add(split_op, [&](const std::string& s) {
+    resources.push_back(RequestArena::current());
+    Words result(RequestArena::current());
+    size_t begin = 0;
+    while (begin < s.size()) {
+      size_t end = std::min(s.find(' ', begin), s.size());
+      result.emplace_back(s.substr(begin, end - begin));
+      begin = end + 1;
+    }
+    return result;
+  });
+  kernels.add(count_op,
+              [](const Words& w) { return static_cast<int32_t>(w.size()); });
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  for (int i = 0; i < 3; i++) {
+    exec.feed(input, std::string("a fairly long sentence, long enough not "
+                                 "to fit in any small string buffer"));
+    exec.run();
+    EXPECT_EQ(exec.fetch(count), 14);
+    const Words& fetched = exec.fetch(words);
+    EXPECT_EQ(fetched.get_allocator().resource(), resources.back());
+    EXPECT_EQ(fetched[3], "sentence,");
+  }
+  // one arena for every request of the executor
+  EXPECT_NE(resources[0], std::pmr::get_default_resource());
+  EXPECT_EQ(resources[0], resources[2]);
+  EXPECT_EQ(RequestArena::current(), std::pmr::get_default_resource());
+}
+
+TEST(ExecutorTest, LastUseMovesAndFanOutShares) {
+  using Gids = std::vector<int64_t>;
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<Gids(int32_t)> make_gids("make_gids");
+  Op<Gids(Gids)> dedup("dedup");
+  Op<int32_t(Gids)> count("count"), total("total");
+  Var<int32_t> n(placeholder, "n"), m(placeholder, "m");
+  Var<Gids> gids("gids"), unique("unique");
+  Var<int32_t> first("first"), second("second"), third("third");
+  Var<Gids> tmp;
+  // One reader: the anonymous temporary is moved into dedup
+  tmp = make_gids(n);
+  unique = dedup(tmp);
+  // Two readers of `gids`, and `unique` is still fetchable: all shared
+  gids = make_gids(m);
+  first = count(gids);
+  second = count(unique);
+  third = total(gids);
+
+  std::vector<bool> owned;
+  std::vector<const Gids*> seen;
+  KernelRegistry kernels;
+  kernels.add(make_gids, [](int32_t size) { return Gids(size, 1); });
+  kernels.add(dedup, [&](In<Gids> in) {
+    owned.push_back(in.owned());
+    Gids result = in.take();
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  });
+  auto count_kernel = [&](In<Gids> in) {
+    owned.push_back(in.owned());
+    seen.push_back(&*in);
+    return static_cast<int32_t>(in->size());
+  };
+  kernels.add(count, count_kernel);
+  kernels.add(total, count_kernel);
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  exec.feed(n, 100);
+  exec.feed(m, 50);
+  exec.run();
+  EXPECT_EQ(owned, (std::vector<bool>{true, false, false, false}));
+  EXPECT_EQ(exec.fetch(first), 50);
+  EXPECT_EQ(exec.fetch(second), 1);
+  EXPECT_EQ(exec.fetch(third), 50);
+  // both readers of `gids` saw the same object, not copies
+  EXPECT_EQ(seen[0], seen[2]);
+  EXPECT_EQ(seen[0], &exec.fetch(gids));
+  EXPECT_THROW(exec.fetch(tmp), std::runtime_error);
+}
+
+TEST(ExecutorTest, NestedCallMovesTemporary) {
+  using Gids = std::vector<int64_t>;
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<Gids(int32_t)> make_gids("make_gids");
+  Op<Gids(Gids)> sort("sort"), dedup("dedup");
+  Var<int32_t> n(placeholder, "n");
+  Var<Gids> gids("gids"), unique("unique");
+  gids = make_gids(n);
+  // sort's result is named "sort_0/output" but nothing can fetch it
+  unique = dedup(sort(gids));
+
+  std::vector<bool> owned;
+  KernelRegistry kernels;
+  kernels.add(make_gids, [](int32_t size) { return Gids(size, 1); });
+  kernels.add(sort, [&](In<Gids> in) {
+    owned.push_back(in.owned());
+    Gids result = in.take();
+    std::sort(result.begin(), result.end());
+    return result;
+  });
+  kernels.add(dedup, [&](In<Gids> in) {
+    owned.push_back(in.owned());
+    Gids result = in.take();
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  });
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  exec.feed(n, 10);
+  exec.run();
+  EXPECT_EQ(owned, (std::vector<bool>{false, true}));
+  EXPECT_EQ(exec.fetch(unique), Gids{1});
+  EXPECT_EQ(exec.fetch(gids).size(), 10);
+}
+
+TEST(ExecutorTest, PooledStates) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> add_one("add_one");
+  Op<int32_t(int32_t)> check("check");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> checked("checked"), output("output");
+  checked = check(input);
+  output = add_one(checked);
+
+  KernelRegistry kernels;
+  kernels.add(add_one, [](int32_t x) { return x + 1; });
+  kernels.add(check, [](int32_t x) {
+    if (x < 0) {
+      throw std::runtime_error("negative");
+    }
+    return x;
+  });
+  ExecutionStatePool pool(ExecutionPlan::compile(prog.graph(), kernels));
+
+  for (int32_t i = 0; i < 10; i++) {
+    SequentialExecutor exec(pool);
+    // a new request starts empty, even on a reused state
+    EXPECT_THROW(exec.run(), std::runtime_error);
+    EXPECT_THROW(exec.fetch(output), std::runtime_error);
+    exec.feed(input, i);
+    exec.run();
+    EXPECT_EQ(exec.fetch(output), i + 1);
+  }
+  // a failed request leaves nothing behind either
+  {
+    SequentialExecutor exec(pool);
+    exec.feed(input, 1);
+    exec.run();
+    exec.feed(input, -1);
+    EXPECT_THROW(exec.run(), std::runtime_error);
+  }
+  {
+    SequentialExecutor exec(pool);
+    EXPECT_THROW(exec.fetch(checked), std::runtime_error);
+  }
+  EXPECT_EQ(pool.created(), 1);
+
+  // one state per concurrent request
+  constexpr int kThreads = 4;
+  std::vector<std::thread> threads;
+  std::vector<char> correct(kThreads, 1);
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t] {
+      for (int32_t i = 0; i < 100; i++) {
+        SequentialExecutor exec(pool);
+        exec.feed(input, t * 1000 + i);
+        exec.run();
+        if (exec.fetch(output) != t * 1000 + i + 1) {
+          correct[t] = 0;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(correct, std::vector<char>(kThreads, 1));
+  EXPECT_LE(pool.created(), kThreads);
+}
+
+TEST(ExecutorTest, CancellationSkipsRemainingNodes) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // x -> step -> step -> ... ten steps
+  Op<int32_t(int32_t)> step("step");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  output = input;
+  for (int i = 0; i < 10; i++) {
+    output = step(output);
+  }
+
+  // the fourth step cancels its request, the kernels seeing the token
+  CancellationToken token;
+  int calls = 0;
+  bool saw_cancel = false;
+  KernelRegistry kernels;
+  kernels.add(step, [&](int32_t x) {
+    EXPECT_NE(CancellationToken::current(), nullptr);
+    if (++calls == 4) {
+      token.cancel();
+      saw_cancel = CancellationToken::requested();
+    }
+    return x + 1;
+  });
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  exec.feed(input, 0);
+  try {
+    exec.run(token);
+    FAIL() << "run was not cancelled";
+  } catch (const CancelledError& e) {
+    EXPECT_STREQ(e.what(), "Request cancelled");
+  }
+  EXPECT_TRUE(saw_cancel);
+  EXPECT_EQ(calls, 4);
+  EXPECT_TRUE(exec.run_stats().cancelled);
+  EXPECT_EQ(exec.run_stats().nodes_run, 4);
+  EXPECT_EQ(exec.run_stats().nodes_skipped, 6);
+  EXPECT_THROW(exec.fetch(output), std::runtime_error);
+
+  // a passed deadline skips everything
+  CancellationToken expired(CancellationToken::Clock::now());
+  try {
+    exec.run(expired);
+    FAIL() << "run was not cancelled";
+  } catch (const CancelledError& e) {
+    EXPECT_STREQ(e.what(), "Deadline exceeded");
+  }
+  EXPECT_EQ(exec.run_stats().nodes_skipped, 10);
+  EXPECT_EQ(calls, 4);
+
+  // a live token does not get in the way
+  CancellationToken later(CancellationToken::Clock::now() +
+                          std::chrono::hours(1));
+  exec.run(later);
+  EXPECT_EQ(exec.fetch(output), 10);
+  EXPECT_FALSE(exec.run_stats().cancelled);
+  EXPECT_EQ(exec.run_stats().nodes_run, 10);
+  EXPECT_EQ(exec.run_stats().nodes_skipped, 0);
+  EXPECT_EQ(CancellationToken::current(), nullptr);
+}
+
+TEST(ExecutorTest, HorizontalFusionMatchesUnfusedRuns) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // Three scoring heads and two splits over one embedding
+  Op<int32_t(int32_t)> embed("embed");
+  Op<int32_t(int32_t, int32_t)> head("head");
+  Op<std::tuple<int32_t, int32_t>(int32_t, int32_t)> divmod("divmod");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> w1(placeholder, "w1"), w2(placeholder, "w2"),
+      w3(placeholder, "w3");
+  Var<int32_t> emb("emb"), s1("s1"), s2("s2"), s3("s3");
+  Var<int32_t> q1("q1"), r1("r1"), q2("q2"), r2("r2");
+  emb = embed(input);
+  s1 = head(emb, w1);
+  s2 = head(emb, w2);
+  s3 = head(emb, w3);
+  (q1, r1) = divmod(emb, w1);
+  (q2, r2) = divmod(emb, w2);
+
+  struct Head {
+    int* row_calls;
+    int* column_calls;
+
+    int32_t operator()(int32_t x, int32_t w) const {
+      ++*row_calls;
+      return x * w;
+    }
+    Batch<int32_t> operator()(const Batch<int32_t>& xs,
+                              const Batch<int32_t>& ws) const {
+      ++*column_calls;
+      Batch<int32_t> result(xs.size());
+      for (size_t i = 0; i < xs.size(); i++) {
+        result[i] = xs[i] * ws[i];
+      }
+      return result;
+    }
+  };
+  int row_calls = 0, column_calls = 0;
+  auto kernels = std::make_shared<KernelRegistry>();
+  kernels->add(embed, [](int32_t x) { return x + 1; });
+  kernels->add(head, Head{&row_calls, &column_calls});
+  kernels->add(divmod, [](int32_t x, int32_t y) {
+    return std::make_tuple(x / y, x % y);
+  });
+  EXPECT_EQ(kernels->size(), 4);
+  EXPECT_TRUE(kernels->kernel(kernels->find("fused:head"))->fused());
+
+  auto run = [&](SequentialExecutor& exec) {
+    exec.feed(input, 16);
+    exec.feed(w1, 2);
+    exec.feed(w2, 3);
+    exec.feed(w3, 5);
+    exec.run();
+    return std::vector<int32_t>{exec.fetch(s1), exec.fetch(s2),
+                                exec.fetch(s3), exec.fetch(q1),
+                                exec.fetch(r1), exec.fetch(q2),
+                                exec.fetch(r2)};
+  };
+  SequentialExecutor unfused(prog.graph(), *kernels);
+  auto expected = run(unfused);
+  EXPECT_EQ(expected, (std::vector<int32_t>{34, 51, 85, 8, 1, 5, 2}));
+  EXPECT_EQ(row_calls, 3);
+
+  prog.passes().add("horizontal_fusion", horizontal_fusion(kernels));
+  // the pass keeps the registry alive for as long as the program
+  EXPECT_EQ(kernels.use_count(), 2);
+  Graph g = prog.graph();
+  EXPECT_EQ(g.node_count(), 3);
+  SequentialExecutor fused(g, *kernels);
+  EXPECT_EQ(run(fused), expected);
+  EXPECT_EQ(row_calls, 3);
+  EXPECT_EQ(column_calls, 1);
+  EXPECT_EQ(fused.run_stats().nodes_run, 3);
+}
+
+TEST(ExecutorTest, VerticalFusionMatchesUnfusedRuns) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // name -> greet -> suffix(_, punct) -> shout -> output, then a loop of
+  // four add_one steps
+  Op<std::string(std::string)> greet("greet"), shout("shout");
+  Op<std::string(std::string, std::string)> suffix("suffix");
+  Op<int32_t(int32_t)> add_one("add_one");
+  Var<std::string> name(placeholder, "name"), punct(placeholder, "punct");
+  Var<std::string> output("output");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> count("count");
+  Var<std::string> greeting, suffixed;
+  greeting = greet(name);
+  suffixed = suffix(greeting, punct);
+  output = shout(suffixed);
+  count = input;
+  for (int i = 0; i < 4; i++) {
+    count = add_one(count);
+  }
+
+  std::vector<bool> owned;
+  auto kernels = std::make_shared<KernelRegistry>();
+  kernels->add(greet, [](const std::string& n) { return "hello " + n; });
+  kernels->add(suffix, [&](In<std::string> s, const std::string& p) {
+    owned.push_back(s.owned());
+    if (p.empty()) {
+      throw std::runtime_error("no punctuation");
+    }
+    return s.take() + p;
+  });
+  kernels->add(shout, [&](In<std::string> s) {
+    owned.push_back(s.owned());
+    std::string result = s.take();
+    std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+    return result;
+  });
+  kernels->add(add_one, [](int32_t x) { return x + 1; });
+
+  SequentialExecutor unfused(prog.graph(), *kernels);
+  unfused.feed(name, std::string("ada"));
+  unfused.feed(punct, std::string("!"));
+  unfused.feed(input, 10);
+  unfused.run();
+  EXPECT_EQ(unfused.fetch(output), "HELLO ADA!");
+  EXPECT_EQ(unfused.fetch(count), 14);
+
+  prog.passes().add("vertical_fusion", vertical_fusion(kernels));
+  EXPECT_EQ(kernels.use_count(), 2);
+  auto plan = ExecutionPlan::compile(prog.graph(), *kernels);
+  // one node per chain
+  EXPECT_EQ(plan->instructions().size(), 2);
+  SequentialExecutor fused(plan);
+  fused.feed(name, std::string("ada"));
+  fused.feed(punct, std::string("!"));
+  fused.feed(input, 10);
+  owned.clear();
+  fused.run();
+  EXPECT_EQ(fused.fetch(output), "HELLO ADA!");
+  EXPECT_EQ(fused.fetch(count), 14);
+  // intermediates move from stage to stage
+  EXPECT_EQ(owned, (std::vector<bool>{true, true}));
+
+  // a failing stage fails the node, and the next run starts clean
+  fused.feed(punct, std::string());
+  EXPECT_THROW(fused.run(), std::runtime_error);
+  EXPECT_THROW(fused.fetch(output), std::runtime_error);
+  fused.feed(punct, std::string("?"));
+  fused.run();
+  EXPECT_EQ(fused.fetch(output), "HELLO ADA?");
+}
@@ -0,0 +1,1319 @@
+#pragma once
+#include "dag.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory_resource>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Identifies a C++ type without RTTI.
+using TypeId = const void*;
+
+template <typename T>
+TypeId type_id() {
+  static const char tag = 0;
+  return &tag;
+}
+
+// A type-erased value slot. Small values that are nothrow movable are stored
+// inline, so filling a slot with e.g. an int or a std::string does not
+// allocate beyond what the value itself does; anything else goes to the heap.
+class Value {
+public:
+  static constexpr size_t kInlineSize = 32;
+
+  Value() = default;
+
+  Value(const Value& other) {
+    if (other.ops_) {
+      other.ops_->copy(*this, other);
+    }
+  }
+
+  Value(Value&& other) noexcept {
+    if (other.ops_) {
+      other.ops_->move(*this, other);
+    }
+  }
+
+  Value& operator=(const Value& other) {
+    if (this != &other) {
+      reset();
+      if (other.ops_) {
+        other.ops_->copy(*this, other);
+      }
+    }
+    return *this;
+  }
+
+  Value& operator=(Value&& other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.ops_) {
+        other.ops_->move(*this, other);
+      }
+    }
+    return *this;
+  }
+
+  ~Value() {
+    reset();
+  }
+
+  template <typename T, typename... Args>
+  std::decay_t<T>& emplace(Args&&... args) {
+    using U = std::decay_t<T>;
+    reset();
+    U* p;
+    if constexpr (stored_inline<U>()) {
+      p = new (storage_) U(std::forward<Args>(args)...);
+    } else {
+      p = new U(std::forward<Args>(args)...);
+      *reinterpret_cast<U**>(storage_) = p;
+    }
+    ops_ = &kOps<U>;
+    return *p;
+  }
+
+  template <typename T>
+  T& get() {
+    if (!holds<T>()) {
+      throw std::runtime_error("Value holds a different type");
+    }
+    return *ptr<T>();
+  }
+
+  template <typename T>
+  const T& get() const {
+    return const_cast<Value*>(this)->get<T>();
+  }
+
+  // nullptr if the slot is empty or holds another type.
+  template <typename T>
+  T* get_if() {
+    return holds<T>() ? ptr<T>() : nullptr;
+  }
+
+  template <typename T>
+  bool holds() const {
+    return ops_ && ops_->type == type_id<T>();
+  }
+
+  bool has_value() const {
+    return ops_ != nullptr;
+  }
+
+  // nullptr when empty.
+  TypeId type() const {
+    return ops_ ? ops_->type : nullptr;
+  }
+
+  void reset() {
+    if (ops_) {
+      ops_->destroy(*this);
+      ops_ = nullptr;
+    }
+  }
+
+private:
+  struct Ops {
+    TypeId type;
+    void (*destroy)(Value& self);
+    void (*copy)(Value& to, const Value& from);
+    void (*move)(Value& to, Value& from) noexcept;
+  };
+
+  template <typename T>
+  static constexpr bool stored_inline() {
+    return sizeof(T) <= kInlineSize &&
+           alignof(T) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible_v<T>;
+  }
+
+  template <typename T>
+  T* ptr() {
+    if constexpr (stored_inline<T>()) {
+      return std::launder(reinterpret_cast<T*>(storage_));
+    } else {
+      return *reinterpret_cast<T**>(storage_);
+    }
+  }
+
+  template <typename T>
+  static void destroy(Value& self) {
+    if constexpr (stored_inline<T>()) {
+      self.ptr<T>()->~T();
+    } else {
+      delete self.ptr<T>();
+    }
+  }
+
+  template <typename T>
+  static void copy(Value& to, const Value& from) {
+    if constexpr (std::is_copy_constructible_v<T>) {
+      to.emplace<T>(*const_cast<Value&>(from).ptr<T>());
+    } else {
+      throw std::runtime_error("Value type is not copyable");
+    }
+  }
+
+  // Leaves `from` empty.
+  template <typename T>
+  static void move(Value& to, Value& from) noexcept {
+    if constexpr (stored_inline<T>()) {
+      new (to.storage_) T(std::move(*from.ptr<T>()));
+      from.ptr<T>()->~T();
+    } else {
+      *reinterpret_cast<T**>(to.storage_) = from.ptr<T>();
+    }
+    to.ops_ = from.ops_;
+    from.ops_ = nullptr;
+  }
+
+  template <typename T>
+  static inline const Ops kOps = {type_id<T>(), &destroy<T>, &copy<T>,
+                                  &move<T>};
+
+  alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+  const Ops* ops_ = nullptr;
+};
+
+// The result of an asynchronous kernel: a lazily started coroutine that
+// produces a T. A kernel returns one to give up its thread while it waits,
+// e.g. on a remote service:
+//
+//   kernels.add(lookup_op, [&](int32_t key) -> Async<std::string> {
+//     co_return co_await service.lookup(key);
+//   });
+//
+// An Async can be awaited from another coroutine, or started with a
+// callback. It completes on whichever thread resumes it last.
+template <typename T = void>
+class [[nodiscard]] Async {
+  struct PromiseBase;
+
+public:
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+  using DoneCallback = void (*)(void* context);
+
+  Async(Async&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+  Async& operator=(Async&& other) noexcept {
+    if (this != &other) {
+      reset();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  ~Async() {
+    reset();
+  }
+
+  // Runs the coroutine until it first suspends. `done(context)` is called
+  // once it has finished, possibly before start() returns.
+  void start(DoneCallback done, void* context) {
+    handle_.promise().done = done;
+    handle_.promise().context = context;
+    handle_.resume();
+  }
+
+  // Starts the coroutine and blocks until it has finished.
+  void wait() {
+    struct Waiter {
+      std::mutex mutex;
+      std::condition_variable finished;
+      bool done = false;
+    } waiter;
+    start(
+        [](void* context) {
+          auto* w = static_cast<Waiter*>(context);
+          // Notify under the lock: `waiter` dies as soon as wait() returns
+          std::lock_guard<std::mutex> lock(w->mutex);
+          w->done = true;
+          w->finished.notify_one();
+        },
+        &waiter);
+    std::unique_lock<std::mutex> lock(waiter.mutex);
+    waiter.finished.wait(lock, [&] { return waiter.done; });
+  }
+
+  bool done() const {
+    return handle_ && handle_.done();
+  }
+
+  // Once done: the result, or rethrows what the coroutine threw.
+  T result() {
+    return handle_.promise().result();
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    handle_.promise().continuation = awaiter;
+    return handle_;
+  }
+
+  T await_resume() {
+    return handle_.promise().result();
+  }
+
+private:
+  Handle handle_;
+
+  explicit Async(Handle handle) : handle_(handle) {}
+
+  void reset() {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = {};
+    }
+  }
+
+  struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    DoneCallback done = nullptr;
+    void* context = nullptr;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    // Resumes an awaiting coroutine, or reports to whoever started us.
+    struct FinalAwaiter {
+      bool await_ready() noexcept {
+        return false;
+      }
+
+      std::coroutine_handle<> await_suspend(Handle self) noexcept {
+        PromiseBase& promise = self.promise();
+        if (promise.continuation) {
+          return promise.continuation;
+        }
+        if (promise.done) {
+          promise.done(promise.context);
+        }
+        return std::noop_coroutine();
+      }
+
+      void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept {
+      return {};
+    }
+
+    void unhandled_exception() {
+      error = std::current_exception();
+    }
+  };
+
+  template <typename U>
+  struct ReturnValue : PromiseBase {
+    std::optional<U> value;
+
+    template <typename V>
+    void return_value(V&& v) {
+      value.emplace(std::forward<V>(v));
+    }
+
+    U result() {
+      if (this->error) {
+        std::rethrow_exception(this->error);
+      }
+      return std::move(*value);
+    }
+  };
+
+  struct ReturnVoid : PromiseBase {
+    void return_void() {}
+
+    void result() {
+      if (this->error) {
+        std::rethrow_exception(this->error);
+      }
+    }
+  };
+
+public:
+  struct promise_type
+      : std::conditional_t<std::is_void_v<T>, ReturnVoid, ReturnValue<T>> {
+    Async get_return_object() {
+      return Async(Handle::from_promise(*this));
+    }
+  };
+};
+
+template <typename T>
+struct is_async : std::false_type {};
+
+template <typename T>
+struct is_async<Async<T>> : std::true_type {};
+
+template <typename T>
+constexpr bool is_async_v = is_async<T>::value;
+
+// Memory for the values one request produces. Kernels allocate their
+// outputs from `RequestArena::current()` through std::pmr containers:
+//
+//   kernels.add(split_op, [](const std::string& s) {
+//     std::pmr::vector<std::string> words(RequestArena::current());
+//     ...
+//   });
+//
+// Allocating bumps a pointer and freeing is a no-op; everything is released
+// at once when the executor starts the next request. The arena keeps its
+// buffer, grown to the largest request seen, so in the steady state it does
+// not allocate at all.
+class RequestArena {
+public:
+  explicit RequestArena(size_t initial_size = 4096)
+      : buffer_(new std::byte[initial_size]), capacity_(initial_size) {
+    resource_.emplace(buffer_.get(), capacity_, &upstream_);
+  }
+
+  RequestArena(const RequestArena&) = delete;
+  RequestArena& operator=(const RequestArena&) = delete;
+
+  std::pmr::memory_resource* resource() {
+    return &*resource_;
+  }
+
+  // Releases everything allocated since the last reset. Values allocated
+  // from the arena must be gone by then.
+  void reset() {
+    size_t overflow = upstream_.allocated;
+    resource_.reset();
+    if (overflow) {
+      // Next time, fit the whole request in one buffer
+      capacity_ += overflow;
+      buffer_.reset(new std::byte[capacity_]);
+      upstream_.allocated = 0;
+    }
+    resource_.emplace(buffer_.get(), capacity_, &upstream_);
+  }
+
+  // Bytes available before the arena has to allocate.
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // The arena of the request running on this thread, or the default
+  // resource outside of one.
+  static std::pmr::memory_resource* current() {
+    std::pmr::memory_resource* resource = current_slot();
+    return resource ? resource : std::pmr::get_default_resource();
+  }
+
+  // RAII helper making an arena current on this thread
+  class Scope {
+  public:
+    explicit Scope(RequestArena& arena)
+        : previous_(std::exchange(current_slot(), arena.resource())) {}
+
+    ~Scope() {
+      current_slot() = previous_;
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    std::pmr::memory_resource* previous_;
+  };
+
+private:
+  // Counts what the arena needs beyond its buffer.
+  struct Upstream : std::pmr::memory_resource {
+    size_t allocated = 0;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+      allocated += bytes;
+      return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+      std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+  };
+
+  std::unique_ptr<std::byte[]> buffer_;
+  size_t capacity_;
+  Upstream upstream_;
+  std::optional<std::pmr::monotonic_buffer_resource> resource_;
+
+  static std::pmr::memory_resource*& current_slot() {
+    thread_local std::pmr::memory_resource* current = nullptr;
+    return current;
+  }
+};
+
+// Cancels a request, explicitly with cancel() or when its deadline passes.
+// Executors stop dispatching nodes of a cancelled request; long-running
+// kernels can poll `CancellationToken::requested()` to stop early too.
+// cancel() may be called from any thread.
+class CancellationToken {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  CancellationToken() = default;
+
+  explicit CancellationToken(Clock::time_point deadline)
+      : deadline_(deadline) {}
+
+  CancellationToken(const CancellationToken&) = delete;
+  CancellationToken& operator=(const CancellationToken&) = delete;
+
+  void cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+  }
+
+  bool cancelled() const {
+    return cancelled_.load(std::memory_order_relaxed) || deadline_passed();
+  }
+
+  bool deadline_passed() const {
+    return deadline_ != Clock::time_point::max() && Clock::now() >= deadline_;
+  }
+
+  Clock::time_point deadline() const {
+    return deadline_;
+  }
+
+  // The token of the request running on this thread, or nullptr.
+  static const CancellationToken* current() {
+    return current_slot();
+  }
+
+  // Whether the request running on this thread has been cancelled.
+  static bool requested() {
+    const CancellationToken* token = current_slot();
+    return token && token->cancelled();
+  }
+
+  // RAII helper making a token current on this thread
+  class Scope {
+  public:
+    explicit Scope(const CancellationToken* token)
+        : previous_(std::exchange(current_slot(), token)) {}
+
+    ~Scope() {
+      current_slot() = previous_;
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    const CancellationToken* previous_;
+  };
+
+private:
+  std::atomic<bool> cancelled_{false};
+  Clock::time_point deadline_ = Clock::time_point::max();
+
+  static const CancellationToken*& current_slot() {
+    thread_local const CancellationToken* current = nullptr;
+    return current;
+  }
+};
+
+// A fixed kernel argument, read in place from its slot. A kernel that
+// declares a parameter as In<T> instead of `const T&` learns whether it may
+// take ownership of the value: it may when this is the value's last use, and
+// nothing else, not even a fetch(), will read it. Otherwise the value is
+// shared with other readers and must be copied to be kept.
+//
+//   kernels.add(dedup_op, [](In<std::vector<Gid>> gids) {
+//     std::vector<Gid> result = gids.take();  // moved when possible
+//     ...
+//   });
+template <typename T>
+class In {
+public:
+  In(Value& slot, bool owned) : slot_(&slot), owned_(owned) {}
+
+  const T& get() const {
+    return slot_->get<T>();
+  }
+
+  operator const T&() const {
+    return get();
+  }
+
+  const T& operator*() const {
+    return get();
+  }
+
+  const T* operator->() const {
+    return &get();
+  }
+
+  // Whether take() moves.
+  bool owned() const {
+    return owned_;
+  }
+
+  // The value itself: moved out of its slot if owned, copied otherwise.
+  // Throws for a shared value of a move-only type.
+  T take() const {
+    if (!owned_) {
+      if constexpr (std::is_copy_constructible_v<T>) {
+        return get();
+      } else {
+        throw std::runtime_error("Cannot take a shared move-only value");
+      }
+    }
+    T value = std::move(slot_->get<T>());
+    slot_->reset();
+    return value;
+  }
+
+private:
+  Value* slot_;
+  bool owned_;
+};
+
+// A column of values of one variable, one per row, for running a graph
+// over many rows at once (see BatchExecutor). A kernel that also accepts
+// `const Batch<Args>&...` and returns a Batch<R> is called once for a whole
+// column, and can use SIMD across rows:
+//
+//   struct Scale {
+//     float operator()(float x) const { return x * 2; }
+//     Batch<float> operator()(const Batch<float>& xs) const { ... }
+//   };
+//
+// Any other kernel is called once per row.
+template <typename T>
+class Batch : public std::vector<T> {
+public:
+  using std::vector<T>::vector;
+
+  Batch() = default;
+
+  explicit Batch(std::vector<T> rows) : std::vector<T>(std::move(rows)) {}
+};
+
+// The variadic arguments of a kernel call, read in place from their slots.
+template <typename T>
+class VariadicArgs {
+  Value* slots_;
+  const uint32_t* indexes_;
+  size_t size_;
+
+public:
+  VariadicArgs(Value* slots, Span<const uint32_t> indexes)
+      : slots_(slots), indexes_(indexes.data()), size_(indexes.size()) {}
+
+  size_t size() const {
+    return size_;
+  }
+
+  const T& operator[](size_t i) const {
+    return slots_[indexes_[i]].get<T>();
+  }
+};
+
+// Whether a kernel result of type `Result` implements a declared result `R`:
+// convertible to it, or an Async of something convertible to it.
+template <typename R, typename Result>
+struct kernel_returns : std::is_convertible<Result, R> {};
+
+template <typename R, typename T>
+struct kernel_returns<R, Async<T>> : std::is_convertible<T, R> {};
+
+template <typename R, typename F, typename... Args>
+constexpr bool kernel_invocable() {
+  if constexpr (std::is_invocable_v<const F&, Args...>) {
+    return kernel_returns<R, std::invoke_result_t<const F&, Args...>>::value;
+  } else {
+    return false;
+  }
+}
+
+// Whether `F` can implement an op declared as `Signature`: callable with the
+// declared arguments as In<T>, which also binds to `const T&` and `T`
+// parameters (variadic ones as a VariadicArgs), returning something
+// convertible to the declared result, or an Async of it.
+template <typename Signature, typename F>
+struct is_kernel_for : std::false_type {};
+
+template <typename R, typename... Args, typename F>
+struct is_kernel_for<R(Args...), F>
+    : std::bool_constant<kernel_invocable<R, F, In<Args>...>()> {};
+
+template <typename R, typename ArgT, typename F>
+struct is_kernel_for<R(Variadic<ArgT>), F>
+    : std::bool_constant<kernel_invocable<R, F, VariadicArgs<ArgT>>()> {};
+
+template <typename R, typename FixedArgT, typename VarArgT, typename F>
+struct is_kernel_for<R(FixedArgT, Variadic<VarArgT>), F>
+    : std::bool_constant<
+          kernel_invocable<R, F, In<FixedArgT>, VariadicArgs<VarArgT>>()> {};
+
+template <typename R, typename FixedArg1T, typename FixedArg2T,
+          typename VarArgT, typename F>
+struct is_kernel_for<R(FixedArg1T, FixedArg2T, Variadic<VarArgT>), F>
+    : std::bool_constant<
+          kernel_invocable<R, F, In<FixedArg1T>, In<FixedArg2T>,
+                           VariadicArgs<VarArgT>>()> {};
+
+template <typename Signature, typename F>
+constexpr bool is_kernel_for_v = is_kernel_for<Signature, F>::value;
+
+// Whether `F` also has a vectorized overload for an op declared as
+// `R(Args...)`: one taking a Batch of every argument and returning a Batch
+// of results.
+template <typename R, typename F, typename... Args>
+constexpr bool is_vectorized_kernel_v =
+    std::is_invocable_r_v<Batch<R>, const F&, const Batch<Args>&...>;
+
+// A type-erased kernel. Reads its arguments from `slots[inputs[i]]` and
+// writes its results, one per output variable, to `slots[outputs[i]]`. Bit i
+// of `movable` says that it may move from `slots[inputs[i]]`.
+//
+// An asynchronous kernel can also be started with `start()`, which returns
+// the pending call; calling it directly blocks until the call has finished.
+//
+// `run_batch()` runs a kernel over a number of rows at once, every slot
+// holding a Batch of its type: in one call if the kernel is vectorized,
+// otherwise one call per row.
+//
+// A fused kernel runs the node IR::horizontal_fusion() made of several
+// invocations of one op: its inputs and outputs are the members', one
+// member after the other.
+class Kernel {
+public:
+  using Invoke = void (*)(const void* fn, Value* slots,
+                          Span<const uint32_t> inputs,
+                          Span<const uint32_t> outputs, uint64_t movable);
+  using Start = Async<> (*)(const void* fn, Value* slots,
+                            Span<const uint32_t> inputs,
+                            Span<const uint32_t> outputs, uint64_t movable);
+  using InvokeBatch = void (*)(const void* fn, Value* slots,
+                               Span<const uint32_t> inputs,
+                               Span<const uint32_t> outputs, uint64_t movable,
+                               size_t rows);
+
+  Kernel(std::string name, Invoke invoke, Start start,
+         InvokeBatch invoke_batch, bool vectorized,
+         std::shared_ptr<const void> fn, std::vector<TypeId> input_types,
+         std::vector<TypeId> output_types, bool variadic, bool fused = false)
+      : name_(std::move(name)), invoke_(invoke), start_(start),
+        invoke_batch_(invoke_batch), vectorized_(vectorized),
+        fn_(std::move(fn)), input_types_(std::move(input_types)),
+        output_types_(std::move(output_types)), variadic_(variadic),
+        fused_(fused) {}
+
+  void operator()(Value* slots, Span<const uint32_t> inputs,
+                  Span<const uint32_t> outputs, uint64_t movable = 0) const {
+    invoke_(fn_.get(), slots, inputs, outputs, movable);
+  }
+
+  // Only for async kernels. The results are written when the call finishes;
+  // until then the argument slots must stay untouched.
+  Async<> start(Value* slots, Span<const uint32_t> inputs,
+                Span<const uint32_t> outputs, uint64_t movable = 0) const {
+    return start_(fn_.get(), slots, inputs, outputs, movable);
+  }
+
+  bool async() const {
+    return start_ != nullptr;
+  }
+
+  void run_batch(Value* slots, Span<const uint32_t> inputs,
+                 Span<const uint32_t> outputs, uint64_t movable,
+                 size_t rows) const {
+    invoke_batch_(fn_.get(), slots, inputs, outputs, movable, rows);
+  }
+
+  // Whether run_batch() calls the kernel once, rather than once per row.
+  bool vectorized() const {
+    return vectorized_;
+  }
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  // Declared argument types. For a variadic op the last one is the type of
+  // every remaining argument. Empty for kernels that accept any type.
+  const std::vector<TypeId>& input_types() const {
+    return input_types_;
+  }
+
+  const std::vector<TypeId>& output_types() const {
+    return output_types_;
+  }
+
+  bool variadic() const {
+    return variadic_;
+  }
+
+  // Whether the kernel runs fused nodes, with the input and output types of
+  // one member.
+  bool fused() const {
+    return fused_;
+  }
+
+private:
+  std::string name_;
+  Invoke invoke_;
+  Start start_;
+  InvokeBatch invoke_batch_;
+  bool vectorized_;
+  std::shared_ptr<const void> fn_;
+  std::vector<TypeId> input_types_;
+  std::vector<TypeId> output_types_;
+  bool variadic_;
+  bool fused_;
+};
+
+// Dense id of an op name in a KernelRegistry.
+using OpId = Symbol;
+constexpr OpId kNoOp = kNoSymbol;
+
+// Binds op declarations to C++ callables.
+//
+// Registration checks the callable against the Op's signature at compile
+// time. Ops are interned into dense OpIds, so an executor resolves each op
+// name once when it prepares a graph and then looks kernels up by id.
+// A "copy" kernel, which copies any value, is always registered, and so is
+// a fused kernel, named fused_op_name(op), for every op with a fixed
+// number of arguments and a blocking kernel. A fused kernel makes one
+// vectorized call for all its members if the kernel is vectorized.
+//
+// Register everything before sharing the registry; lookups are then safe
+// from any number of threads.
+class KernelRegistry {
+public:
+  KernelRegistry() {
+    insert("copy", &copy_value, nullptr, &copy_column, true, nullptr, {}, {},
+           false);
+  }
+
+  KernelRegistry(const KernelRegistry&) = delete;
+  KernelRegistry& operator=(const KernelRegistry&) = delete;
+
+  template <typename R, typename... Args, typename F>
+  OpId add(const Op<R(Args...)>& op, F fn) {
+    static_assert(is_kernel_for_v<R(Args...), F>,
+                  "Kernel signature does not match the Op declaration");
+    return insert_kernel<R, std::tuple<>, Args...>(
+        op.name(), std::move(fn), {type_id<Args>()...}, false);
+  }
+
+  template <typename R, typename ArgT, typename F>
+  OpId add(const Op<R(Variadic<ArgT>)>& op, F fn) {
+    static_assert(is_kernel_for_v<R(Variadic<ArgT>), F>,
+                  "Kernel signature does not match the Op declaration");
+    return insert_kernel<R, std::tuple<ArgT>>(op.name(), std::move(fn),
+                                              {type_id<ArgT>()}, true);
+  }
+
+  template <typename R, typename FixedArgT, typename VarArgT, typename F>
+  OpId add(const Op<R(FixedArgT, Variadic<VarArgT>)>& op, F fn) {
+    static_assert(is_kernel_for_v<R(FixedArgT, Variadic<VarArgT>), F>,
+                  "Kernel signature does not match the Op declaration");
+    return insert_kernel<R, std::tuple<VarArgT>, FixedArgT>(
+        op.name(), std::move(fn), {type_id<FixedArgT>(), type_id<VarArgT>()},
+        true);
+  }
+
+  template <typename R, typename FixedArg1T, typename FixedArg2T,
+            typename VarArgT, typename F>
+  OpId add(const Op<R(FixedArg1T, FixedArg2T, Variadic<VarArgT>)>& op, F fn) {
+    static_assert(
+        is_kernel_for_v<R(FixedArg1T, FixedArg2T, Variadic<VarArgT>), F>,
+        "Kernel signature does not match the Op declaration");
+    return insert_kernel<R, std::tuple<VarArgT>, FixedArg1T, FixedArg2T>(
+        op.name(), std::move(fn),
+        {type_id<FixedArg1T>(), type_id<FixedArg2T>(), type_id<VarArgT>()},
+        true);
+  }
+
+  // kNoOp if no kernel was registered under `op_name`.
+  OpId find(std::string_view op_name) const {
+    OpId id = names_.find(op_name);
+    return id < kernels_.size() && kernels_[id] ? id : kNoOp;
+  }
+
+  // nullptr if `id` has no kernel.
+  const Kernel* kernel(OpId id) const {
+    return id < kernels_.size() ? kernels_[id].get() : nullptr;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+private:
+  SymbolTable names_;
+  // Indexed by OpId. Kernels never move, so executors may keep pointers.
+  std::vector<std::unique_ptr<const Kernel>> kernels_;
+  size_t size_ = 0;
+
+  // Picks the blocking and async entry points by what `fn` returns.
+  template <typename R, typename Variadic, typename... Fixed, typename F>
+  OpId insert_kernel(std::string_view name, F fn, std::vector<TypeId> inputs,
+                     bool variadic) {
+    using Result = decltype(call<Variadic, Fixed...>(
+        std::declval<const F&>(), nullptr, Span<const uint32_t>(), 0,
+        std::index_sequence_for<Fixed...>()));
+    Kernel::Invoke invoke;
+    Kernel::Start start = nullptr;
+    if constexpr (is_async_v<Result>) {
+      invoke = &invoke_blocking<F, R, Variadic, Fixed...>;
+      start = &invoke_async<F, R, Variadic, Fixed...>;
+    } else {
+      invoke = &invoke_sync<F, R, Variadic, Fixed...>;
+    }
+    Kernel::InvokeBatch invoke_batch;
+    constexpr bool kVectorized = std::tuple_size_v<Variadic> == 0 &&
+                                 !is_tuple<R>::value &&
+                                 is_vectorized_kernel_v<R, F, Fixed...>;
+    if constexpr (kVectorized) {
+      invoke_batch = &invoke_vectorized<F, R, Fixed...>;
+    } else {
+      invoke_batch = &invoke_rows<F, R, Variadic, Fixed...>;
+    }
+    auto shared_fn = std::make_shared<const F>(std::move(fn));
+    OpId id = insert(name, invoke, start, invoke_batch, kVectorized, shared_fn,
+                     inputs, output_types<R>(), variadic);
+    // Calls of an async kernel already overlap; fusing them would not help
+    if constexpr (std::tuple_size_v<Variadic> == 0 && sizeof...(Fixed) != 0 &&
+                  !is_async_v<Result>) {
+      Kernel::Invoke invoke_fused;
+      if constexpr (kVectorized) {
+        invoke_fused = &invoke_fused_vectorized<F, R, Fixed...>;
+      } else {
+        invoke_fused = &invoke_fused_members<F, R, Fixed...>;
+      }
+      insert(fused_op_name(name), invoke_fused, nullptr,
+             &invoke_fused_batch<F, R, Fixed...>, kVectorized,
+             std::move(shared_fn), std::move(inputs), output_types<R>(),
+             false, true);
+    }
+    return id;
+  }
+
+  OpId insert(std::string_view name, Kernel::Invoke invoke,
+              Kernel::Start start, Kernel::InvokeBatch invoke_batch,
+              bool vectorized, std::shared_ptr<const void> fn,
+              std::vector<TypeId> inputs, std::vector<TypeId> outputs,
+              bool variadic, bool fused = false) {
+    OpId id = names_.intern(name);
+    if (id >= kernels_.size()) {
+      kernels_.resize(id + 1);
+    }
+    if (kernels_[id]) {
+      throw std::runtime_error("Kernel already registered: " +
+                               std::string(name));
+    }
+    kernels_[id] = std::make_unique<const Kernel>(
+        std::string(name), invoke, start, invoke_batch, vectorized,
+        std::move(fn), std::move(inputs), std::move(outputs), variadic, fused);
+    // Fused kernels come with their op
+    if (!fused) {
+      size_++;
+    }
+    return id;
+  }
+
+  template <typename T>
+  struct is_tuple : std::false_type {};
+  template <typename... Ts>
+  struct is_tuple<std::tuple<Ts...>> : std::true_type {};
+
+  // A tuple result is spread over one output variable per element.
+  template <typename R>
+  struct Outputs {
+    static std::vector<TypeId> types() {
+      return {type_id<R>()};
+    }
+  };
+  template <typename... Ts>
+  struct Outputs<std::tuple<Ts...>> {
+    static std::vector<TypeId> types() {
+      return {type_id<Ts>()...};
+    }
+  };
+
+  template <typename R>
+  static std::vector<TypeId> output_types() {
+    return Outputs<R>::types();
+  }
+
+  // Calls `f` with the fixed arguments, then, if `Variadic` names an
+  // element type, with the remaining inputs as a VariadicArgs.
+  template <typename Variadic, typename... Fixed, typename F, size_t... I>
+  static decltype(auto) call(const F& f, Value* slots,
+                             Span<const uint32_t> inputs, uint64_t movable,
+                             std::index_sequence<I...>) {
+    if constexpr (std::tuple_size_v<Variadic> == 0) {
+      return f(In<Fixed>(slots[inputs[I]], movable >> I & 1)...);
+    } else {
+      constexpr size_t kFixed = sizeof...(Fixed);
+      VariadicArgs<std::tuple_element_t<0, Variadic>> rest(
+          slots, Span<const uint32_t>(inputs.data() + kFixed,
+                                      inputs.size() - kFixed));
+      return f(In<Fixed>(slots[inputs[I]], movable >> I & 1)..., rest);
+    }
+  }
+
+  template <typename F, typename R, typename Variadic, typename... Fixed>
+  static void invoke_sync(const void* fn, Value* slots,
+                          Span<const uint32_t> inputs,
+                          Span<const uint32_t> outputs, uint64_t movable) {
+    const F& f = *static_cast<const F*>(fn);
+    store<R>(slots, outputs,
+             call<Variadic, Fixed...>(f, slots, inputs, movable,
+                                      std::index_sequence_for<Fixed...>()));
+  }
+
+  template <typename F, typename R, typename Variadic, typename... Fixed>
+  static Async<> invoke_async(const void* fn, Value* slots,
+                              Span<const uint32_t> inputs,
+                              Span<const uint32_t> outputs, uint64_t movable) {
+    const F& f = *static_cast<const F*>(fn);
+    store<R>(slots, outputs,
+             co_await call<Variadic, Fixed...>(
+                 f, slots, inputs, movable,
+                 std::index_sequence_for<Fixed...>()));
+  }
+
+  template <typename F, typename R, typename Variadic, typename... Fixed>
+  static void invoke_blocking(const void* fn, Value* slots,
+                              Span<const uint32_t> inputs,
+                              Span<const uint32_t> outputs, uint64_t movable) {
+    Async<> pending = invoke_async<F, R, Variadic, Fixed...>(
+        fn, slots, inputs, outputs, movable);
+    pending.wait();
+    pending.result();
+  }
+
+  template <typename R, typename Result>
+  static void store(Value* slots, Span<const uint32_t> outputs,
+                    Result&& result) {
+    if constexpr (is_tuple<R>::value) {
+      store_tuple<R>(slots, outputs, R(std::forward<Result>(result)),
+                     std::make_index_sequence<std::tuple_size_v<R>>());
+    } else {
+      slots[outputs[0]].emplace<R>(std::forward<Result>(result));
+    }
+  }
+
+  template <typename R, size_t... I>
+  static void store_tuple(Value* slots, Span<const uint32_t> outputs,
+                          R&& result, std::index_sequence<I...>) {
+    (slots[outputs[I]].emplace<std::tuple_element_t<I, R>>(
+         std::get<I>(std::move(result))),
+     ...);
+  }
+
+  template <typename F, typename R, typename... Fixed, size_t... I>
+  static Batch<R> call_vectorized(const F& f, Value* slots,
+                                  Span<const uint32_t> inputs,
+                                  std::index_sequence<I...>) {
+    return f(slots[inputs[I]].get<Batch<Fixed>>()...);
+  }
+
+  template <typename F, typename R, typename... Fixed>
+  static void invoke_vectorized(const void* fn, Value* slots,
+                                Span<const uint32_t> inputs,
+                                Span<const uint32_t> outputs, uint64_t,
+                                size_t rows) {
+    const F& f = *static_cast<const F*>(fn);
+    Batch<R> result = call_vectorized<F, R, Fixed...>(
+        f, slots, inputs, std::index_sequence_for<Fixed...>());
+    if (result.size() != rows) {
+      throw std::runtime_error("Vectorized kernel returned " +
+                               std::to_string(result.size()) +
+                               " rows, expected " + std::to_string(rows));
+    }
+    slots[outputs[0]].emplace<Batch<R>>(std::move(result));
+  }
+
+  // The output columns of a kernel called row by row.
+  template <typename R>
+  struct Columns {
+    Batch<R> column;
+
+    explicit Columns(size_t rows) {
+      column.reserve(rows);
+    }
+
+    void append(R&& row) {
+      column.push_back(std::move(row));
+    }
+
+    void store(Value* slots, Span<const uint32_t> outputs) {
+      slots[outputs[0]].emplace<Batch<R>>(std::move(column));
+    }
+  };
+  template <typename... Ts>
+  struct Columns<std::tuple<Ts...>> {
+    std::tuple<Batch<Ts>...> columns;
+
+    explicit Columns(size_t rows) {
+      std::apply([&](auto&... column) { (column.reserve(rows), ...); },
+                 columns);
+    }
+
+    void append(std::tuple<Ts...>&& row) {
+      append(std::move(row), std::index_sequence_for<Ts...>());
+    }
+
+    void store(Value* slots, Span<const uint32_t> outputs) {
+      store(slots, outputs, std::index_sequence_for<Ts...>());
+    }
+
+  private:
+    template <size_t... I>
+    void append(std::tuple<Ts...>&& row, std::index_sequence<I...>) {
+      (std::get<I>(columns).push_back(std::get<I>(std::move(row))), ...);
+    }
+
+    template <size_t... I>
+    void store(Value* slots, Span<const uint32_t> outputs,
+               std::index_sequence<I...>) {
+      (slots[outputs[I]].emplace<Batch<Ts>>(std::move(std::get<I>(columns))),
+       ...);
+    }
+  };
+
+  // Copies row `row` of the column in `slot` into `cell`, or moves it out
+  // if the column may be moved from.
+  template <typename T>
+  static void load_row(Value& cell, Value& slot, size_t row, bool movable) {
+    Batch<T>& column = slot.get<Batch<T>>();
+    if (movable) {
+      cell.emplace<T>(std::move(column[row]));
+    } else {
+      cell.emplace<T>(column[row]);
+    }
+  }
+
+  template <typename Variadic, typename... Fixed, size_t... I>
+  static void load_rows(Value* cells, Value* slots,
+                        Span<const uint32_t> inputs, uint64_t movable,
+                        size_t row, std::index_sequence<I...>) {
+    (load_row<Fixed>(cells[I], slots[inputs[I]], row, movable >> I & 1), ...);
+    if constexpr (std::tuple_size_v<Variadic> != 0) {
+      using T = std::tuple_element_t<0, Variadic>;
+      for (size_t i = sizeof...(Fixed); i < inputs.size(); i++) {
+        load_row<T>(cells[i], slots[inputs[i]], row,
+                    i < 64 && (movable >> i & 1));
+      }
+    }
+  }
+
+  // Calls the kernel once per row, with the row's values in scratch cells
+  // that it owns.
+  template <typename F, typename R, typename Variadic, typename... Fixed>
+  static void invoke_rows(const void* fn, Value* slots,
+                          Span<const uint32_t> inputs,
+                          Span<const uint32_t> outputs, uint64_t movable,
+                          size_t rows) {
+    const F& f = *static_cast<const F*>(fn);
+    std::vector<Value> cells(inputs.size());
+    std::vector<uint32_t> indexes(inputs.size());
+    for (uint32_t i = 0; i < indexes.size(); i++) {
+      indexes[i] = i;
+    }
+    Span<const uint32_t> cell_indexes(indexes.data(), indexes.size());
+    Columns<R> columns(rows);
+    for (size_t row = 0; row < rows; row++) {
+      load_rows<Variadic, Fixed...>(cells.data(), slots, inputs, movable, row,
+                                    std::index_sequence_for<Fixed...>());
+      auto&& result = call<Variadic, Fixed...>(
+          f, cells.data(), cell_indexes, ~uint64_t(0),
+          std::index_sequence_for<Fixed...>());
+      if constexpr (is_async_v<std::decay_t<decltype(result)>>) {
+        result.wait();
+        columns.append(R(result.result()));
+      } else {
+        columns.append(R(std::forward<decltype(result)>(result)));
+      }
+    }
+    columns.store(slots, outputs);
+  }
+
+  // Bits of `movable` for the member of a fused node whose inputs start at
+  // `first`.
+  static uint64_t member_movable(uint64_t movable, size_t first) {
+    return first < 64 ? movable >> first : 0;
+  }
+
+  template <typename R>
+  static constexpr size_t result_count() {
+    if constexpr (is_tuple<R>::value) {
+      return std::tuple_size_v<R>;
+    } else {
+      return 1;
+    }
+  }
+
+  // Runs a fused node one member at a time.
+  template <typename F, typename R, typename... Fixed>
+  static void invoke_fused_members(const void* fn, Value* slots,
+                                   Span<const uint32_t> inputs,
+                                   Span<const uint32_t> outputs,
+                                   uint64_t movable) {
+    constexpr size_t kArity = sizeof...(Fixed);
+    constexpr size_t kResults = result_count<R>();
+    for (size_t m = 0; m < inputs.size() / kArity; m++) {
+      invoke_sync<F, R, std::tuple<>, Fixed...>(
+          fn, slots, Span<const uint32_t>(inputs.data() + m * kArity, kArity),
+          Span<const uint32_t>(outputs.data() + m * kResults, kResults),
+          member_movable(movable, m * kArity));
+    }
+  }
+
+  // Runs a fused node in one call: argument i of every member goes into
+  // column i, and result m goes to member m.
+  template <typename F, typename R, typename... Fixed>
+  static void invoke_fused_vectorized(const void* fn, Value* slots,
+                                      Span<const uint32_t> inputs,
+                                      Span<const uint32_t> outputs,
+                                      uint64_t movable) {
+    const F& f = *static_cast<const F*>(fn);
+    Batch<R> result = gather_and_call<F, R, Fixed...>(
+        f, slots, inputs, movable, std::index_sequence_for<Fixed...>());
+    if (result.size() != outputs.size()) {
+      throw std::runtime_error("Vectorized kernel returned " +
+                               std::to_string(result.size()) +
+                               " rows, expected " +
+                               std::to_string(outputs.size()));
+    }
+    for (size_t m = 0; m < outputs.size(); m++) {
+      slots[outputs[m]].emplace<R>(std::move(result[m]));
+    }
+  }
+
+  template <typename F, typename R, typename... Fixed, size_t... I>
+  static Batch<R> gather_and_call(const F& f, Value* slots,
+                                  Span<const uint32_t> inputs,
+                                  uint64_t movable,
+                                  std::index_sequence<I...>) {
+    std::tuple<Batch<Fixed>...> columns;
+    (gather<Fixed>(std::get<I>(columns), slots, inputs, I, sizeof...(Fixed),
+                   movable),
+     ...);
+    return f(std::get<I>(columns)...);
+  }
+
+  // Argument `index` of every member.
+  template <typename T>
+  static void gather(Batch<T>& column, Value* slots,
+                     Span<const uint32_t> inputs, size_t index, size_t arity,
+                     uint64_t movable) {
+    column.reserve(inputs.size() / arity);
+    for (size_t i = index; i < inputs.size(); i += arity) {
+      Value& slot = slots[inputs[i]];
+      if (member_movable(movable, i) & 1) {
+        column.push_back(std::move(slot.get<T>()));
+        slot.reset();
+      } else {
+        column.push_back(slot.get<T>());
+      }
+    }
+  }
+
+  // A fused node over columns: each member runs over all rows on its own.
+  template <typename F, typename R, typename... Fixed>
+  static void invoke_fused_batch(const void* fn, Value* slots,
+                                 Span<const uint32_t> inputs,
+                                 Span<const uint32_t> outputs,
+                                 uint64_t movable, size_t rows) {
+    constexpr size_t kArity = sizeof...(Fixed);
+    constexpr size_t kResults = result_count<R>();
+    for (size_t m = 0; m < inputs.size() / kArity; m++) {
+      Span<const uint32_t> member_inputs(inputs.data() + m * kArity, kArity);
+      Span<const uint32_t> member_outputs(outputs.data() + m * kResults,
+                                          kResults);
+      uint64_t bits = member_movable(movable, m * kArity);
+      if constexpr (!is_tuple<R>::value &&
+                    is_vectorized_kernel_v<R, F, Fixed...>) {
+        invoke_vectorized<F, R, Fixed...>(fn, slots, member_inputs,
+                                          member_outputs, bits, rows);
+      } else {
+        invoke_rows<F, R, std::tuple<>, Fixed...>(
+            fn, slots, member_inputs, member_outputs, bits, rows);
+      }
+    }
+  }
+
+  // Moves when it may, so a copy of a temporary costs nothing.
+  static void copy_value(const void*, Value* slots, Span<const uint32_t> inputs,
+                         Span<const uint32_t> outputs, uint64_t movable) {
+    if (movable & 1) {
+      slots[outputs[0]] = std::move(slots[inputs[0]]);
+    } else {
+      slots[outputs[0]] = slots[inputs[0]];
+    }
+  }
+
+  // A copy of a whole column is a copy of its value.
+  static void copy_column(const void* fn, Value* slots,
+                          Span<const uint32_t> inputs,
+                          Span<const uint32_t> outputs, uint64_t movable,
+                          size_t) {
+    copy_value(fn, slots, inputs, outputs, movable);
+  }
+};
+
+// The horizontal fusion pass for the ops of `kernels` that have a fused
+// kernel. The pass lives as long as the Program, so it shares ownership of
+// the registry. Opt in per program:
+//
+//   auto kernels = std::make_shared<KernelRegistry>();
+//   ...
+//   prog.passes().add("horizontal_fusion", horizontal_fusion(kernels));
+inline PassManager::Pass
+horizontal_fusion(std::shared_ptr<const KernelRegistry> kernels) {
+  return [kernels = std::move(kernels)](IR& ir) {
+    return ir.horizontal_fusion([&](std::string_view op) {
+      return kernels->find(fused_op_name(op)) != kNoOp;
+    });
+  };
+}
+
+// The vertical fusion pass for the ops of `kernels` that can be chained:
+// blocking, with a fixed number of arguments and one result. Like
+// horizontal_fusion, it shares ownership of the registry.
+inline PassManager::Pass
+vertical_fusion(std::shared_ptr<const KernelRegistry> kernels) {
+  return [kernels = std::move(kernels)](IR& ir) {
+    return ir.vertical_fusion([&](std::string_view op) {
+      const Kernel* kernel = kernels->kernel(kernels->find(op));
+      return kernel && !kernel->variadic() && !kernel->async() &&
+             !kernel->fused() && kernel->output_types().size() == 1 &&
+             op.find_first_of(">@") == std::string_view::npos;
+    });
+  };
+}
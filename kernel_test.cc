@@ -0,0 +1,213 @@
+#include "kernel.h"
+#include <gtest/gtest.h>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Signatures are checked at compile time
+static_assert(is_kernel_for_v<int32_t(int32_t), int32_t (*)(int32_t)>);
+static_assert(is_kernel_for_v<int32_t(int32_t), int64_t (*)(const int32_t&)>);
+static_assert(!is_kernel_for_v<int32_t(int32_t), int32_t (*)(std::string)>);
+static_assert(!is_kernel_for_v<int32_t(int32_t), std::string (*)(int32_t)>);
+static_assert(
+    !is_kernel_for_v<int32_t(int32_t, int32_t), int32_t (*)(int32_t)>);
+static_assert(is_kernel_for_v<int32_t(Variadic<int32_t>),
+                              int32_t (*)(VariadicArgs<int32_t>)>);
+static_assert(!is_kernel_for_v<int32_t(Variadic<int32_t>),
+                               int32_t (*)(int32_t)>);
+static_assert(is_kernel_for_v<int32_t(int32_t), int32_t (*)(In<int32_t>)>);
+static_assert(!is_kernel_for_v<int32_t(int32_t), int32_t (*)(In<int64_t>)>);
+static_assert(is_kernel_for_v<int32_t(int32_t), Async<int32_t> (*)(int32_t)>);
+static_assert(
+    !is_kernel_for_v<int32_t(int32_t), Async<std::string> (*)(int32_t)>);
+
+TEST(KernelTest, ValueHoldsOneType) {
+  Value v;
+  EXPECT_FALSE(v.has_value());
+  v.emplace<int32_t>(42);
+  EXPECT_TRUE(v.holds<int32_t>());
+  EXPECT_EQ(v.get<int32_t>(), 42);
+  EXPECT_EQ(v.type(), type_id<int32_t>());
+  EXPECT_THROW(v.get<std::string>(), std::runtime_error);
+  EXPECT_EQ(v.get_if<std::string>(), nullptr);
+
+  v.emplace<std::string>("hello");
+  EXPECT_EQ(v.get<std::string>(), "hello");
+
+  Value copy = v;
+  Value moved = std::move(v);
+  EXPECT_FALSE(v.has_value());
+  EXPECT_EQ(copy.get<std::string>(), "hello");
+  EXPECT_EQ(moved.get<std::string>(), "hello");
+}
+
+TEST(KernelTest, ValueStoresLargeAndMoveOnlyTypes) {
+  struct Large {
+    char bytes[128];
+  };
+  Value large;
+  large.emplace<Large>().bytes[127] = 'x';
+  Value copy = large;
+  EXPECT_EQ(copy.get<Large>().bytes[127], 'x');
+
+  Value owner;
+  owner.emplace<std::unique_ptr<int>>(std::make_unique<int>(7));
+  EXPECT_THROW(Value{owner}, std::runtime_error);
+  Value moved = std::move(owner);
+  EXPECT_EQ(*moved.get<std::unique_ptr<int>>(), 7);
+}
+
+TEST(KernelTest, RunFixedKernel) {
+  Op<int32_t(int32_t, int32_t)> add("add");
+  KernelRegistry registry;
+  OpId id = registry.add(add, [](int32_t a, int32_t b) { return a + b; });
+
+  EXPECT_EQ(registry.find("add"), id);
+  EXPECT_EQ(registry.find("sub"), kNoOp);
+  const Kernel* kernel = registry.kernel(id);
+  ASSERT_NE(kernel, nullptr);
+  EXPECT_EQ(kernel->name(), "add");
+  EXPECT_EQ(kernel->input_types(),
+            (std::vector<TypeId>{type_id<int32_t>(), type_id<int32_t>()}));
+  EXPECT_EQ(kernel->output_types(), std::vector<TypeId>{type_id<int32_t>()});
+
+  std::vector<Value> slots(3);
+  slots[0].emplace<int32_t>(2);
+  slots[1].emplace<int32_t>(40);
+  std::vector<uint32_t> inputs = {0, 1}, outputs = {2};
+  (*kernel)(slots.data(), inputs, outputs);
+  EXPECT_EQ(slots[2].get<int32_t>(), 42);
+
+  // arguments of the wrong type are caught when the kernel runs
+  slots[1].emplace<std::string>("40");
+  EXPECT_THROW((*kernel)(slots.data(), inputs, outputs), std::runtime_error);
+}
+
+TEST(KernelTest, RunTupleAndVariadicKernels) {
+  Op<std::tuple<std::string, int32_t>(std::string)> split("split");
+  Op<int32_t(std::string, Variadic<int32_t>)> sum("sum");
+  KernelRegistry registry;
+  registry.add(split, [](const std::string& s) {
+    return std::make_tuple(s + "!", static_cast<int32_t>(s.size()));
+  });
+  registry.add(sum, [](const std::string& prefix, VariadicArgs<int32_t> xs) {
+    int32_t total = static_cast<int32_t>(prefix.size());
+    for (size_t i = 0; i < xs.size(); i++) {
+      total += xs[i];
+    }
+    return total;
+  });
+
+  std::vector<Value> slots(4);
+  slots[0].emplace<std::string>("abc");
+  std::vector<uint32_t> split_in = {0}, split_out = {1, 2};
+  (*registry.kernel(registry.find("split")))(slots.data(), split_in,
+                                             split_out);
+  EXPECT_EQ(slots[1].get<std::string>(), "abc!");
+  EXPECT_EQ(slots[2].get<int32_t>(), 3);
+
+  std::vector<uint32_t> sum_in = {1, 2, 2}, sum_out = {3};
+  (*registry.kernel(registry.find("sum")))(slots.data(), sum_in, sum_out);
+  EXPECT_EQ(slots[3].get<int32_t>(), 4 + 3 + 3);
+}
+
+TEST(KernelTest, CopyIsBuiltIn) {
+  KernelRegistry registry;
+  OpId copy = registry.find("copy");
+  ASSERT_NE(copy, kNoOp);
+
+  std::vector<Value> slots(2);
+  slots[0].emplace<std::string>("value");
+  std::vector<uint32_t> inputs = {0}, outputs = {1};
+  (*registry.kernel(copy))(slots.data(), inputs, outputs);
+  EXPECT_EQ(slots[0].get<std::string>(), "value");
+  EXPECT_EQ(slots[1].get<std::string>(), "value");
+}
+
+TEST(KernelTest, DuplicateRegistration) {
+  Op<int32_t(int32_t)> add_one("add_one");
+  KernelRegistry registry;
+  registry.add(add_one, [](int32_t x) { return x + 1; });
+  EXPECT_THROW(registry.add(add_one, [](int32_t x) { return x + 2; }),
+               std::runtime_error);
+  EXPECT_EQ(registry.size(), 2);
+}
+
+TEST(KernelTest, AsyncKernel) {
+  Op<int32_t(int32_t)> slow_add_one("slow_add_one");
+  Op<int32_t(int32_t)> add_one("add_one");
+  KernelRegistry registry;
+  registry.add(slow_add_one, [](int32_t x) -> Async<int32_t> {
+    co_return x + 1;
+  });
+  registry.add(add_one, [](int32_t x) { return x + 1; });
+  const Kernel& async_kernel = *registry.kernel(registry.find("slow_add_one"));
+  EXPECT_TRUE(async_kernel.async());
+  EXPECT_FALSE(registry.kernel(registry.find("add_one"))->async());
+
+  std::vector<Value> slots(3);
+  slots[0].emplace<int32_t>(1);
+  std::vector<uint32_t> inputs = {0}, first = {1}, second = {2};
+  // called directly, an async kernel runs to completion
+  async_kernel(slots.data(), inputs, first);
+  EXPECT_EQ(slots[1].get<int32_t>(), 2);
+
+  // started, it writes its result when it finishes
+  Async<> call = async_kernel.start(slots.data(), inputs, second);
+  EXPECT_FALSE(slots[2].has_value());
+  bool finished = false;
+  call.start([](void* done) { *static_cast<bool*>(done) = true; }, &finished);
+  EXPECT_TRUE(finished);
+  EXPECT_TRUE(call.done());
+  call.result();
+  EXPECT_EQ(slots[2].get<int32_t>(), 2);
+}
+
+TEST(KernelTest, RequestArena) {
+  EXPECT_EQ(RequestArena::current(), std::pmr::get_default_resource());
+
+  RequestArena arena(64);
+  {
+    RequestArena::Scope scope(arena);
+    EXPECT_EQ(RequestArena::current(), arena.resource());
+    std::pmr::vector<int32_t> small(4, 1, RequestArena::current());
+    // outgrows the initial buffer
+    std::pmr::vector<int32_t> large(100, 2, RequestArena::current());
+  }
+  EXPECT_EQ(RequestArena::current(), std::pmr::get_default_resource());
+
+  // the next request fits in the arena's own buffer
+  arena.reset();
+  size_t capacity = arena.capacity();
+  EXPECT_GE(capacity, 100 * sizeof(int32_t));
+  for (int request = 0; request < 3; request++) {
+    std::pmr::vector<int32_t> large(100, 2, arena.resource());
+    arena.reset();
+  }
+  EXPECT_EQ(arena.capacity(), capacity);
+}
+
+TEST(KernelTest, InTakesOwnershipOnlyWhenAllowed) {
+  Value shared, owned, unique;
+  shared.emplace<std::vector<int32_t>>(1000, 7);
+  owned.emplace<std::vector<int32_t>>(1000, 7);
+  unique.emplace<std::unique_ptr<int>>(std::make_unique<int>(3));
+
+  In<std::vector<int32_t>> shared_in(shared, false);
+  const int32_t* shared_data = shared_in->data();
+  std::vector<int32_t> copy = shared_in.take();
+  EXPECT_NE(copy.data(), shared_data);
+  EXPECT_EQ(shared.get<std::vector<int32_t>>().size(), 1000);
+
+  In<std::vector<int32_t>> owned_in(owned, true);
+  const int32_t* owned_data = owned_in->data();
+  std::vector<int32_t> moved = owned_in.take();
+  EXPECT_EQ(moved.data(), owned_data);
+  EXPECT_FALSE(owned.has_value());
+
+  EXPECT_THROW(In<std::unique_ptr<int>>(unique, false).take(),
+               std::runtime_error);
+  EXPECT_EQ(*In<std::unique_ptr<int>>(unique, true).take(), 3);
+}
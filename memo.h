@@ -0,0 +1,307 @@
+#pragma once
+#include "kernel.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// How a memoized op hashes an argument of type T. Defaults to std::hash;
+// specialize it for argument types std::hash does not cover.
+template <typename T>
+struct MemoHash : std::hash<T> {};
+
+template <typename T>
+struct MemoHash<std::vector<T>> {
+  size_t operator()(const std::vector<T>& values) const {
+    size_t hash = values.size();
+    for (const T& value : values) {
+      hash = hash * 1000003 ^ MemoHash<T>()(value);
+    }
+    return hash;
+  }
+};
+
+template <typename... Ts>
+struct MemoHash<std::tuple<Ts...>> {
+  size_t operator()(const std::tuple<Ts...>& values) const {
+    return std::apply(
+        [](const Ts&... v) {
+          size_t hash = 0;
+          ((hash = hash * 1000003 ^ MemoHash<Ts>()(v)), ...);
+          return hash;
+        },
+        values);
+  }
+};
+
+// The bytes a cached argument or result of type T holds, for the cache's
+// byte budget and stats. Defaults to sizeof(T); specialize it for types
+// that own memory.
+template <typename T>
+struct MemoBytes {
+  size_t operator()(const T&) const {
+    return sizeof(T);
+  }
+};
+
+template <>
+struct MemoBytes<std::string> {
+  size_t operator()(const std::string& s) const {
+    return sizeof(s) + s.capacity();
+  }
+};
+
+template <typename T>
+struct MemoBytes<std::vector<T>> {
+  size_t operator()(const std::vector<T>& values) const {
+    size_t bytes = sizeof(values) + (values.capacity() - values.size()) *
+                                        sizeof(T);
+    for (const T& value : values) {
+      bytes += MemoBytes<T>()(value);
+    }
+    return bytes;
+  }
+};
+
+template <typename... Ts>
+struct MemoBytes<std::tuple<Ts...>> {
+  size_t operator()(const std::tuple<Ts...>& values) const {
+    return std::apply(
+        [](const Ts&... v) { return (size_t{0} + ... + MemoBytes<Ts>()(v)); },
+        values);
+  }
+};
+
+// Hashes the arguments of an invocation with MemoHash.
+struct MemoArgsHash {
+  template <typename... Args>
+  size_t operator()(const Args&... args) const {
+    size_t hash = 0;
+    ((hash = hash * 1000003 ^ MemoHash<Args>()(args)), ...);
+    return hash;
+  }
+};
+
+// How much a MemoCache holds.
+struct MemoOptions {
+  // Entries held at most, across all shards
+  size_t max_entries = 1024;
+  // Bytes held at most as counted by MemoBytes, or 0 for no limit
+  size_t max_bytes = 0;
+  // Each shard has its own lock and LRU list
+  size_t shards = 16;
+};
+
+struct MemoStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+
+  double hit_rate() const {
+    size_t lookups = hits + misses;
+    return lookups ? static_cast<double>(hits) / lookups : 0.0;
+  }
+};
+
+template <typename Signature, typename Hash = MemoArgsHash>
+class MemoCache;
+
+// A bounded LRU cache of the results of one pure op, keyed by its
+// arguments. Keys are spread over shards by hash, and each shard evicts its
+// least recently used entries once it holds more than its share of the
+// entry or byte budget. Safe to use from any number of threads.
+//
+// Two requests missing on the same arguments at once both compute the
+// result; the cache keeps one.
+template <typename R, typename... Args, typename Hash>
+class MemoCache<R(Args...), Hash> {
+public:
+  using Key = std::tuple<Args...>;
+
+  MemoCache(std::string name, MemoOptions options, Hash hash = Hash())
+      : name_(std::move(name)), hash_(std::move(hash)),
+        shards_(std::max<size_t>(options.shards, 1)) {
+    size_t count = shards_.size();
+    for (Shard& shard : shards_) {
+      shard.max_entries = std::max<size_t>((options.max_entries + count - 1) /
+                                               count,
+                                           1);
+      shard.max_bytes = (options.max_bytes + count - 1) / count;
+    }
+  }
+
+  MemoCache(const MemoCache&) = delete;
+  MemoCache& operator=(const MemoCache&) = delete;
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  // The cached result for `args`, or `compute(args...)`, which is then
+  // cached. An exception from `compute` is not cached.
+  template <typename Compute>
+  R get(const Args&... args, const Compute& compute) {
+    size_t hash = hash_(args...);
+    Shard& shard = shard_of(hash);
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.find(hash, args...);
+      if (it != shard.lru.end()) {
+        shard.hits++;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it);
+        return it->result;
+      }
+      shard.misses++;
+    }
+    R result = compute(args...);
+    Entry entry{hash, Key(args...), result, 0};
+    entry.bytes = MemoBytes<Key>()(entry.key) + MemoBytes<R>()(result);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.insert(std::move(entry));
+    return result;
+  }
+
+  // Summed over shards.
+  MemoStats stats() const {
+    MemoStats stats;
+    for (const Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      stats.hits += shard.hits;
+      stats.misses += shard.misses;
+      stats.evictions += shard.evictions;
+      stats.entries += shard.lru.size();
+      stats.bytes += shard.bytes;
+    }
+    return stats;
+  }
+
+  // Drops every entry; the counters stay.
+  void clear() {
+    for (Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.index.clear();
+      shard.lru.clear();
+      shard.bytes = 0;
+    }
+  }
+
+private:
+  struct Entry {
+    size_t hash;
+    Key key;
+    R result;
+    size_t bytes;
+  };
+  using Iterator = typename std::list<Entry>::iterator;
+
+  struct Shard {
+    mutable std::mutex mutex;
+    // Most recently used first
+    std::list<Entry> lru;
+    // By hash; entries whose hashes collide share a bucket
+    std::unordered_multimap<size_t, Iterator> index;
+    size_t max_entries = 0;
+    size_t max_bytes = 0;
+    size_t bytes = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+
+    Iterator find(size_t hash, const Args&... args) {
+      auto [begin, end] = index.equal_range(hash);
+      for (auto it = begin; it != end; ++it) {
+        if (it->second->key == std::tie(args...)) {
+          return it->second;
+        }
+      }
+      return lru.end();
+    }
+
+    void insert(Entry entry) {
+      if (max_bytes && entry.bytes > max_bytes) {
+        return;
+      }
+      auto existing = std::apply(
+          [&](const Args&... args) { return find(entry.hash, args...); },
+          entry.key);
+      if (existing != lru.end()) {
+        lru.splice(lru.begin(), lru, existing);
+        return;
+      }
+      bytes += entry.bytes;
+      lru.push_front(std::move(entry));
+      index.emplace(lru.front().hash, lru.begin());
+      while (lru.size() > max_entries || (max_bytes && bytes > max_bytes)) {
+        evict();
+      }
+    }
+
+    void evict() {
+      Iterator last = std::prev(lru.end());
+      auto [begin, end] = index.equal_range(last->hash);
+      for (auto it = begin; it != end; ++it) {
+        if (it->second == last) {
+          index.erase(it);
+          break;
+        }
+      }
+      bytes -= last->bytes;
+      lru.erase(last);
+      evictions++;
+    }
+  };
+
+  std::string name_;
+  Hash hash_;
+  std::vector<Shard> shards_;
+
+  // std::hash is the identity for integers, so mix the hash (splitmix64's
+  // finalizer) and pick the shard from its high bits.
+  Shard& shard_of(size_t hash) {
+    uint64_t x = hash;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return shards_[(x >> 32) * shards_.size() >> 32];
+  }
+};
+
+// Registers `fn` as the kernel of the pure `op` behind a MemoCache, and
+// returns the cache, whose stats() tell how well it is sized. The arguments
+// are hashed with `hash`, which by default combines MemoHash of each.
+//
+//   auto cache = add_memoized_kernel(kernels, parser_op, Parse,
+//                                    {.max_entries = 4096});
+//   ...
+//   double hit_rate = cache->stats().hit_rate();
+template <typename R, typename... Args, typename F,
+          typename Hash = MemoArgsHash>
+std::shared_ptr<MemoCache<R(Args...), Hash>>
+add_memoized_kernel(KernelRegistry& kernels, const Op<R(Args...)>& op, F fn,
+                    MemoOptions options = {}, Hash hash = Hash()) {
+  static_assert(std::is_invocable_r_v<R, const F&, const Args&...>,
+                "A memoized kernel takes its arguments by value or const "
+                "reference and returns the result");
+  if (!op.pure()) {
+    throw std::runtime_error("Cannot memoize impure op: " + op.name());
+  }
+  auto cache = std::make_shared<MemoCache<R(Args...), Hash>>(
+      op.name(), options, std::move(hash));
+  kernels.add(op, [cache, fn = std::move(fn)](const Args&... args) {
+    return cache->get(args..., fn);
+  });
+  return cache;
+}
@@ -0,0 +1,208 @@
+#include "memo.h"
+#include "executor.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+TEST(MemoTest, CachesResultsByArguments) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // config, label -> parsed = parse(config, label)
+  Op<std::vector<std::string>(std::string, int32_t)> parse("parse");
+  Var<std::string> config(placeholder, "config");
+  Var<int32_t> label(placeholder, "label");
+  Var<std::vector<std::string>> parsed("parsed");
+  parsed = parse(config, label);
+
+  int calls = 0;
+  KernelRegistry kernels;
+  auto cache = add_memoized_kernel(
+      kernels, parse, [&](const std::string& c, int32_t l) {
+        calls++;
+        return std::vector<std::string>{c, std::to_string(l)};
+      });
+  EXPECT_EQ(cache->name(), "parse");
+
+  SequentialExecutor exec(prog.graph(), kernels);
+  auto run = [&](const std::string& c, int32_t l) {
+    exec.feed(config, c);
+    exec.feed(label, l);
+    exec.run();
+    return exec.fetch(parsed);
+  };
+  EXPECT_EQ(run("a=1", 7), (std::vector<std::string>{"a=1", "7"}));
+  EXPECT_EQ(run("a=1", 7), (std::vector<std::string>{"a=1", "7"}));
+  EXPECT_EQ(run("a=1", 8), (std::vector<std::string>{"a=1", "8"}));
+  EXPECT_EQ(run("b=2", 7), (std::vector<std::string>{"b=2", "7"}));
+  EXPECT_EQ(run("a=1", 7), (std::vector<std::string>{"a=1", "7"}));
+  EXPECT_EQ(calls, 3);
+
+  MemoStats stats = cache->stats();
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.misses, 3);
+  EXPECT_EQ(stats.entries, 3);
+  EXPECT_EQ(stats.evictions, 0);
+  EXPECT_GT(stats.bytes, 3 * sizeof(std::string));
+  EXPECT_DOUBLE_EQ(stats.hit_rate(), 0.4);
+
+  cache->clear();
+  EXPECT_EQ(cache->stats().entries, 0);
+  EXPECT_EQ(cache->stats().bytes, 0);
+  run("a=1", 7);
+  EXPECT_EQ(calls, 4);
+}
+
+TEST(MemoTest, EvictsLeastRecentlyUsed) {
+  int calls = 0;
+  auto square = [&](int32_t x) {
+    calls++;
+    return x * x;
+  };
+  MemoCache<int32_t(int32_t)> cache("square",
+                                    {.max_entries = 2, .shards = 1});
+  EXPECT_EQ(cache.get(1, square), 1);
+  EXPECT_EQ(cache.get(2, square), 4);
+  // 1 is used again, so adding 3 evicts 2
+  EXPECT_EQ(cache.get(1, square), 1);
+  EXPECT_EQ(cache.get(3, square), 9);
+  EXPECT_EQ(calls, 3);
+  EXPECT_EQ(cache.get(1, square), 1);
+  EXPECT_EQ(calls, 3);
+  EXPECT_EQ(cache.get(2, square), 4);
+  EXPECT_EQ(calls, 4);
+  EXPECT_EQ(cache.stats().evictions, 2);
+  EXPECT_EQ(cache.stats().entries, 2);
+
+  // A byte budget evicts too, and a result larger than it is not kept
+  auto repeat = [&](const std::string& s) {
+    calls++;
+    return std::string(s.size() * 100, 'x');
+  };
+  size_t entry_bytes = MemoBytes<std::tuple<std::string>>()({"a"}) +
+                       MemoBytes<std::string>()(repeat("a"));
+  MemoCache<std::string(std::string)> strings(
+      "repeat", {.max_bytes = 2 * entry_bytes + 16, .shards = 1});
+  calls = 0;
+  strings.get("a", repeat);
+  strings.get("b", repeat);
+  EXPECT_EQ(strings.stats().entries, 2);
+  strings.get("c", repeat);
+  EXPECT_EQ(strings.stats().entries, 2);
+  EXPECT_EQ(strings.stats().evictions, 1);
+  EXPECT_LE(strings.stats().bytes, 2 * entry_bytes + 16);
+  strings.get("long", repeat);
+  EXPECT_EQ(strings.stats().entries, 2);
+  strings.get("long", repeat);
+  EXPECT_EQ(calls, 5);
+  EXPECT_EQ(strings.stats().misses, 5);
+}
+
+TEST(MemoTest, SmallIntegerKeysSpreadOverShards) {
+  // std::hash leaves small integers as they are; with the default 16
+  // shards, 200 keys must all fit in a cache of 1024
+  auto twice = [](int32_t x) { return 2 * x; };
+  MemoCache<int32_t(int32_t)> cache("twice", {.max_entries = 1024});
+  for (int round = 0; round < 2; round++) {
+    for (int32_t key = 0; key < 200; key++) {
+      EXPECT_EQ(cache.get(key, twice), 2 * key);
+    }
+  }
+  MemoStats stats = cache.stats();
+  EXPECT_EQ(stats.entries, 200);
+  EXPECT_EQ(stats.evictions, 0);
+  EXPECT_EQ(stats.hits, 200);
+  EXPECT_DOUBLE_EQ(stats.hit_rate(), 0.5);
+}
+
+TEST(MemoTest, HashingAndPurity) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // Only the first element of a key matters to this hash, so every key
+  // collides: lookups must still tell the keys apart
+  struct FirstOnly {
+    size_t operator()(const std::vector<int32_t>& v) const {
+      return v.empty() ? 0 : v[0];
+    }
+  };
+  Op<int32_t(std::vector<int32_t>)> sum("sum");
+  Op<int32_t(int32_t)> sample(impure, "sample");
+  KernelRegistry kernels;
+  auto sum_kernel = [](const std::vector<int32_t>& v) {
+    int32_t total = 0;
+    for (int32_t x : v) {
+      total += x;
+    }
+    return total;
+  };
+  auto cache = add_memoized_kernel(kernels, sum, sum_kernel,
+                                   {.max_entries = 8, .shards = 2},
+                                   FirstOnly());
+  EXPECT_EQ(cache->get({1, 2}, sum_kernel), 3);
+  EXPECT_EQ(cache->get({1, 5}, sum_kernel), 6);
+  EXPECT_EQ(cache->get({1, 2}, sum_kernel), 3);
+  EXPECT_EQ(cache->stats().hits, 1);
+  EXPECT_EQ(cache->stats().entries, 2);
+  EXPECT_EQ(MemoHash<std::vector<int32_t>>()({1, 2}),
+            MemoHash<std::vector<int32_t>>()({1, 2}));
+
+  try {
+    add_memoized_kernel(kernels, sample, [](int32_t x) { return x; });
+    FAIL() << "an impure op was memoized";
+  } catch (const std::runtime_error& e) {
+    EXPECT_STREQ(e.what(), "Cannot memoize impure op: sample");
+  }
+}
+
+TEST(MemoTest, ConcurrentRequests) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> slow_square("slow_square");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  output = slow_square(input);
+
+  constexpr int kThreads = 4;
+  constexpr int kRuns = 200;
+  constexpr int kKeys = 10;
+  std::atomic<int> calls{0};
+  KernelRegistry kernels;
+  auto cache = add_memoized_kernel(kernels, slow_square, [&](int32_t x) {
+    calls++;
+    return x * x;
+  });
+
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+  std::atomic<int> wrong{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t] {
+      SequentialExecutor exec(plan);
+      for (int i = 0; i < kRuns; i++) {
+        int32_t x = (i + t) % kKeys;
+        exec.feed(input, x);
+        exec.run();
+        if (exec.fetch(output) != x * x) {
+          wrong++;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(wrong, 0);
+  MemoStats stats = cache->stats();
+  EXPECT_EQ(stats.hits + stats.misses, kThreads * kRuns);
+  EXPECT_EQ(stats.misses, static_cast<size_t>(calls.load()));
+  EXPECT_EQ(stats.entries, kKeys);
+  // Concurrent misses on one key may each compute it
+  EXPECT_LE(calls, kThreads * kKeys);
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include "executor.h"
+#include "scheduler.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs an ExecutionPlan one request at a time on a pool of worker threads,
+// the calling thread being worker 0.
+//
+// Readiness is tracked by a lock-free Scheduler. Every worker has its own
+// deque of ready instructions. A worker pops from the bottom of its own
+// deque, and when that is empty steals from the top of another's. When an
+// instruction completes, its successors whose last dependency that was are
+// pushed onto the completing worker's deque, so a chain stays on one worker
+// while independent branches spread out. Every worker has its own
+// RequestArena, so kernels allocate without contention.
+class ParallelExecutor : public ExecutorBase {
+public:
+  ParallelExecutor(std::shared_ptr<const ExecutionPlan> plan,
+                   size_t num_threads)
+      : ExecutorBase(std::move(plan)), scheduler_(*plan_, num_threads) {
+    for (size_t worker = 1; worker < scheduler_.num_workers(); worker++) {
+      worker_arenas_.push_back(std::make_unique<RequestArena>());
+    }
+    for (size_t worker = 1; worker < scheduler_.num_workers(); worker++) {
+      threads_.emplace_back([this, worker] { worker_loop(worker); });
+    }
+  }
+
+  ParallelExecutor(const Graph& graph, const KernelRegistry& kernels,
+                   size_t num_threads)
+      : ParallelExecutor(ExecutionPlan::compile(graph, kernels),
+                         num_threads) {}
+
+  ParallelExecutor(const ParallelExecutor&) = delete;
+  ParallelExecutor& operator=(const ParallelExecutor&) = delete;
+
+  ~ParallelExecutor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    start_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+    // Values may live in the worker arenas, which go first
+    state_->clear_results();
+  }
+
+  size_t num_threads() const {
+    return scheduler_.num_workers();
+  }
+
+  // Runs the graph and returns once every instruction has run. If a kernel
+  // throws, no new instructions are started and the first exception is
+  // rethrown here.
+  void run() {
+    run(nullptr);
+  }
+
+  // As run(), but workers stop taking instructions once `token` is
+  // cancelled; kernels already running finish. A cancelled run throws
+  // CancelledError.
+  void run(const CancellationToken& token) {
+    run(&token);
+  }
+
+private:
+  Scheduler scheduler_;
+  // Workers allocate from their own arena; worker 0 uses the state's
+  std::vector<std::unique_ptr<RequestArena>> worker_arenas_;
+  // Set for a run, before the workers start
+  const CancellationToken* token_ = nullptr;
+  std::atomic<bool> failed_{false};
+  std::exception_ptr error_;
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  uint64_t generation_ = 0;
+  size_t busy_workers_ = 0;
+  bool stopping_ = false;
+
+  void run(const CancellationToken* token) {
+    check_inputs();
+    if (plan_->instructions().empty()) {
+      finish_run(0, token);
+      return;
+    }
+    state_->clear_results();
+    state_->ran_all();
+    for (auto& arena : worker_arenas_) {
+      arena->reset();
+    }
+    scheduler_.reset();
+    token_ = token;
+    failed_.store(false, std::memory_order_relaxed);
+    error_ = nullptr;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      generation_++;
+      busy_workers_ = threads_.size();
+    }
+    start_.notify_all();
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return busy_workers_ == 0; });
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    finish_run(plan_->instructions().size() - scheduler_.remaining(), token);
+  }
+
+  void worker_loop(size_t worker) {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+        if (stopping_) {
+          return;
+        }
+        seen = generation_;
+      }
+      work(worker);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--busy_workers_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+
+  // Runs ready instructions until the request is finished, has failed or is
+  // cancelled.
+  void work(size_t worker) {
+    const ExecutionPlan& plan = *plan_;
+    const auto& instructions = plan.instructions();
+    Value* slots = state_->slots();
+    RequestArena::Scope arena(worker ? *worker_arenas_[worker - 1]
+                                     : state_->arena());
+    const CancellationToken* token = token_;
+    CancellationToken::Scope cancellation(token);
+    uint32_t next;
+    while (!scheduler_.done() && !failed_.load(std::memory_order_relaxed)) {
+      if (token && token->cancelled()) {
+        failed_.store(true, std::memory_order_relaxed);
+        return;
+      }
+      if (!scheduler_.next(worker, next)) {
+        std::this_thread::yield();
+        continue;
+      }
+      const auto& instr = instructions[next];
+      try {
+        (*instr.kernel)(slots, plan.inputs(instr), plan.outputs(instr),
+                        plan.movable(next));
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+        failed_.store(true, std::memory_order_relaxed);
+        return;
+      }
+      scheduler_.complete(worker, next);
+    }
+  }
+};
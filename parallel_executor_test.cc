@@ -0,0 +1,149 @@
+#include "parallel_executor.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+TEST(ParallelExecutorTest, LoopParallel) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // One predict_op per model config, as in DagTest.LoopParallel
+  Op<int32_t(int32_t)> predict_op("predict_op");
+  constexpr int kWidth = 64;
+  std::vector<Var<int32_t>> model_configs, predict_results;
+  for (int i = 0; i < kWidth; i++) {
+    model_configs.emplace_back(placeholder,
+                               "model_configs_" + std::to_string(i));
+    predict_results.emplace_back("predict_results_" + std::to_string(i));
+  }
+  for (int i = 0; i < kWidth; i++) {
+    predict_results[i] = predict_op(model_configs[i]);
+  }
+
+  KernelRegistry kernels;
+  kernels.add(predict_op, [](int32_t config) { return config * 10; });
+
+  for (size_t threads : {1, 2, 4}) {
+    ParallelExecutor exec(prog.graph(), kernels, threads);
+    EXPECT_EQ(exec.num_threads(), threads);
+    for (int round = 0; round < 3; round++) {
+      for (int i = 0; i < kWidth; i++) {
+        exec.feed(model_configs[i], i + round);
+      }
+      exec.run();
+      for (int i = 0; i < kWidth; i++) {
+        EXPECT_EQ(exec.fetch(predict_results[i]), (i + round) * 10);
+      }
+    }
+  }
+}
+
+TEST(ParallelExecutorTest, DiamondsMatchSequential) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // A chain of diamonds: x -> (x + 1, x * 2) -> sum -> ...
+  Op<int32_t(int32_t)> add_one("add_one"), twice("twice");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Var<int32_t> input(placeholder, "input");
+  Var<int32_t> output("output");
+  output = input;
+  for (int i = 0; i < 8; i++) {
+    Var<int32_t> left, right;
+    left = add_one(output);
+    right = twice(output);
+    output = add(left, right);
+  }
+
+  KernelRegistry kernels;
+  kernels.add(add_one, [](int32_t x) { return x + 1; });
+  kernels.add(twice, [](int32_t x) { return x * 2; });
+  kernels.add(add, [](int32_t a, int32_t b) { return a + b; });
+
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+  SequentialExecutor sequential(plan);
+  ParallelExecutor parallel(plan, 4);
+  for (int32_t x = 0; x < 20; x++) {
+    sequential.feed(input, x);
+    sequential.run();
+    parallel.feed(input, x);
+    parallel.run();
+    EXPECT_EQ(parallel.fetch(output), sequential.fetch(output));
+  }
+}
+
+TEST(ParallelExecutorTest, KernelErrorsAreRethrown) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  Op<int32_t(int32_t)> check("check");
+  Var<int32_t> a(placeholder, "a"), b(placeholder, "b");
+  Var<int32_t> checked_a("checked_a"), checked_b("checked_b");
+  checked_a = check(a);
+  checked_b = check(b);
+
+  KernelRegistry kernels;
+  kernels.add(check, [](int32_t x) {
+    if (x < 0) {
+      throw std::runtime_error("negative");
+    }
+    return x;
+  });
+
+  ParallelExecutor exec(prog.graph(), kernels, 2);
+  EXPECT_THROW(exec.run(), std::runtime_error);
+  exec.feed(a, 1);
+  exec.feed(b, -1);
+  EXPECT_THROW(exec.run(), std::runtime_error);
+
+  // the executor is usable again after a failed run
+  exec.feed(b, 2);
+  exec.run();
+  EXPECT_EQ(exec.fetch(checked_a), 1);
+  EXPECT_EQ(exec.fetch(checked_b), 2);
+}
+
+TEST(ParallelExecutorTest, CancellationStopsWorkers) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // Two independent chains of 50 steps; the fifth call cancels the request
+  Op<int32_t(int32_t)> step("step");
+  Var<int32_t> a(placeholder, "a"), b(placeholder, "b");
+  Var<int32_t> out_a("out_a"), out_b("out_b");
+  out_a = a;
+  out_b = b;
+  for (int i = 0; i < 50; i++) {
+    out_a = step(out_a);
+    out_b = step(out_b);
+  }
+
+  std::atomic<int> calls{0};
+  CancellationToken token;
+  KernelRegistry kernels;
+  kernels.add(step, [&](int32_t x) {
+    if (++calls == 5) {
+      token.cancel();
+    }
+    return x + 1;
+  });
+
+  ParallelExecutor exec(prog.graph(), kernels, 2);
+  exec.feed(a, 0);
+  exec.feed(b, 0);
+  EXPECT_THROW(exec.run(token), CancelledError);
+  const RunStats& stats = exec.run_stats();
+  EXPECT_TRUE(stats.cancelled);
+  // the other worker may have been mid-call when the token was cancelled
+  EXPECT_GE(stats.nodes_run, 5);
+  EXPECT_LE(stats.nodes_run, 6);
+  EXPECT_EQ(stats.nodes_run, static_cast<size_t>(calls.load()));
+  EXPECT_EQ(stats.nodes_run + stats.nodes_skipped, 100);
+
+  exec.run();
+  EXPECT_EQ(exec.fetch(out_a), 50);
+  EXPECT_EQ(exec.fetch(out_b), 50);
+  EXPECT_EQ(exec.run_stats().nodes_run, 100);
+}
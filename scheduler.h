@@ -0,0 +1,175 @@
+#pragma once
+#include "executor.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A Chase-Lev work-stealing deque of instruction indexes. The owning worker
+// pushes and pops at the bottom; other workers steal from the top. All
+// operations are lock-free.
+//
+// The ring does not grow: it must be able to hold every item pushed between
+// two `reset()`s. A scheduler pushes each instruction once per run, so the
+// instruction count is enough.
+class WorkStealingDeque {
+public:
+  explicit WorkStealingDeque(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    items_.reset(new std::atomic<uint32_t>[size]);
+  }
+
+  // Only while no other thread uses the deque.
+  void reset() {
+    top_.store(0, std::memory_order_relaxed);
+    bottom_.store(0, std::memory_order_relaxed);
+  }
+
+  // Owner only.
+  void push(uint32_t item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    items_[b & mask_].store(item, std::memory_order_relaxed);
+    bottom_.store(b + 1, std::memory_order_release);
+  }
+
+  // Owner only: the most recently pushed item.
+  bool pop(uint32_t& item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_seq_cst);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    item = items_[b & mask_].load(std::memory_order_relaxed);
+    if (t == b) {
+      // The last item: race thieves for it
+      bool won = top_.compare_exchange_strong(t, t + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread: the least recently pushed item.
+  bool steal(uint32_t& item) {
+    int64_t t = top_.load(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_seq_cst);
+    if (t >= b) {
+      return false;
+    }
+    item = items_[t & mask_].load(std::memory_order_relaxed);
+    return top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed);
+  }
+
+  bool empty() const {
+    return top_.load(std::memory_order_relaxed) >=
+           bottom_.load(std::memory_order_relaxed);
+  }
+
+private:
+  // On separate cache lines: thieves hammer top_, the owner bottom_.
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+  std::unique_ptr<std::atomic<uint32_t>[]> items_;
+  size_t mask_ = 0;
+};
+
+// Tracks which instructions of an ExecutionPlan are ready during one run,
+// without locks: every instruction has an atomic count of dependencies not
+// yet run, and every worker a WorkStealingDeque of ready instructions.
+//
+// A worker loops on `next()` and `complete()` until `done()`. Completing an
+// instruction decrements its successors' counts and pushes those that reach
+// zero onto the completing worker's own deque.
+class Scheduler {
+public:
+  Scheduler(const ExecutionPlan& plan, size_t num_workers)
+      : plan_(plan), pending_(plan.instructions().size()) {
+    workers_.reserve(num_workers ? num_workers : 1);
+    for (size_t i = 0; i < (num_workers ? num_workers : 1); i++) {
+      workers_.emplace_back(
+          std::make_unique<WorkStealingDeque>(pending_.size()));
+    }
+  }
+
+  // Starts a run: resets every count from the plan and deals the roots out
+  // across the workers. Only while no worker is running.
+  void reset() {
+    const auto& instructions = plan_.instructions();
+    for (size_t i = 0; i < instructions.size(); i++) {
+      pending_[i].count.store(instructions[i].dependencies,
+                              std::memory_order_relaxed);
+    }
+    remaining_.count.store(instructions.size(), std::memory_order_relaxed);
+    for (auto& deque : workers_) {
+      deque->reset();
+    }
+    Span<const uint32_t> roots = plan_.roots();
+    for (size_t i = 0; i < roots.size(); i++) {
+      workers_[i % workers_.size()]->push(roots[i]);
+    }
+  }
+
+  // A ready instruction for `worker`: its own newest, else the oldest of
+  // another worker's.
+  bool next(size_t worker, uint32_t& instr) {
+    if (workers_[worker]->pop(instr)) {
+      return true;
+    }
+    for (size_t i = 1; i < workers_.size(); i++) {
+      if (workers_[(worker + i) % workers_.size()]->steal(instr)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Marks `instr` as run by `worker`.
+  void complete(size_t worker, uint32_t instr) {
+    WorkStealingDeque& own = *workers_[worker];
+    for (uint32_t successor : plan_.successors(plan_.instructions()[instr])) {
+      if (pending_[successor].count.fetch_sub(1, std::memory_order_acq_rel) ==
+          1) {
+        own.push(successor);
+      }
+    }
+    remaining_.count.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  // Every instruction of the run has completed.
+  bool done() const {
+    return remaining_.count.load(std::memory_order_acquire) == 0;
+  }
+
+  // Instructions of the run not yet completed.
+  size_t remaining() const {
+    return remaining_.count.load(std::memory_order_acquire);
+  }
+
+  size_t num_workers() const {
+    return workers_.size();
+  }
+
+private:
+  // One per cache line, so that workers completing neighbouring
+  // instructions do not contend.
+  template <typename T>
+  struct alignas(64) Padded {
+    std::atomic<T> count{0};
+  };
+
+  const ExecutionPlan& plan_;
+  // Indexed by instruction: dependencies not yet run in this run
+  std::vector<Padded<uint32_t>> pending_;
+  Padded<size_t> remaining_;
+  std::vector<std::unique_ptr<WorkStealingDeque>> workers_;
+};
@@ -0,0 +1,111 @@
+#include "scheduler.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+TEST(SchedulerTest, DequeOrder) {
+  WorkStealingDeque deque(3);
+  uint32_t item;
+  EXPECT_FALSE(deque.pop(item));
+  EXPECT_FALSE(deque.steal(item));
+
+  deque.push(1);
+  deque.push(2);
+  deque.push(3);
+  // the owner takes the newest, thieves the oldest
+  ASSERT_TRUE(deque.pop(item));
+  EXPECT_EQ(item, 3);
+  ASSERT_TRUE(deque.steal(item));
+  EXPECT_EQ(item, 1);
+  ASSERT_TRUE(deque.pop(item));
+  EXPECT_EQ(item, 2);
+  EXPECT_TRUE(deque.empty());
+  EXPECT_FALSE(deque.pop(item));
+
+  deque.reset();
+  deque.push(4);
+  ASSERT_TRUE(deque.steal(item));
+  EXPECT_EQ(item, 4);
+}
+
+TEST(SchedulerTest, EveryItemTakenOnce) {
+  constexpr uint32_t kItems = 100000;
+  constexpr int kThieves = 3;
+  WorkStealingDeque deque(kItems);
+  std::vector<std::atomic<int>> taken(kItems);
+  std::atomic<bool> pushing{true};
+
+  std::vector<std::thread> thieves;
+  for (int t = 0; t < kThieves; t++) {
+    thieves.emplace_back([&] {
+      uint32_t item;
+      while (pushing.load() || !deque.empty()) {
+        if (deque.steal(item)) {
+          taken[item]++;
+        }
+      }
+    });
+  }
+  // the owner pushes everything, popping every third item itself
+  uint32_t item;
+  for (uint32_t i = 0; i < kItems; i++) {
+    deque.push(i);
+    if (i % 3 == 0 && deque.pop(item)) {
+      taken[item]++;
+    }
+  }
+  while (deque.pop(item)) {
+    taken[item]++;
+  }
+  pushing = false;
+  for (auto& thief : thieves) {
+    thief.join();
+  }
+  for (uint32_t i = 0; i < kItems; i++) {
+    ASSERT_EQ(taken[i].load(), 1) << "item " << i;
+  }
+}
+
+TEST(SchedulerTest, RespectsDependencies) {
+  Program prog;
+  Context::Scope scope(&prog);
+
+  // a -> (left, right) -> joined -> final
+  Op<int32_t(int32_t)> add_one("add_one"), twice("twice");
+  Op<int32_t(int32_t, int32_t)> add("add");
+  Var<int32_t> a(placeholder, "a");
+  Var<int32_t> left("left"), right("right"), joined("joined"), final("final");
+  left = add_one(a);
+  right = twice(a);
+  joined = add(left, right);
+  final = add_one(joined);
+
+  KernelRegistry kernels;
+  kernels.add(add_one, [](int32_t x) { return x + 1; });
+  kernels.add(twice, [](int32_t x) { return x * 2; });
+  kernels.add(add, [](int32_t x, int32_t y) { return x + y; });
+  auto plan = ExecutionPlan::compile(prog.graph(), kernels);
+
+  Scheduler scheduler(*plan, 2);
+  EXPECT_EQ(scheduler.num_workers(), 2);
+  for (int round = 0; round < 2; round++) {
+    scheduler.reset();
+    std::vector<uint32_t> order;
+    uint32_t instr;
+    while (!scheduler.done()) {
+      // worker 1 only steals, then completes on its own deque
+      size_t worker = order.size() % 2;
+      ASSERT_TRUE(scheduler.next(worker, instr));
+      order.push_back(instr);
+      scheduler.complete(worker, instr);
+    }
+    ASSERT_EQ(order.size(), 4);
+    // both branches before the join, the join before the last node
+    EXPECT_LT(std::max(order[0], order[1]), 2);
+    EXPECT_EQ(order[2], 2);
+    EXPECT_EQ(order[3], 3);
+    EXPECT_FALSE(scheduler.next(0, instr));
+  }
+}